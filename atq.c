@@ -0,0 +1,594 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "common.h"
+#include "xhash.h"
+#include "atq.h"
+
+#define ATQ_VERSION 2
+#define ATQ_SLOT(ID) ((u_int32_t) ((ID) & 0xffffffffULL))
+
+typedef enum {
+    AQ_ADD = 1, AQ_DEL
+} atq_op_t;
+
+/* a log record describes the whole slot after the change */
+typedef struct atq_wal {
+    u_int32_t op;
+    u_int32_t slot;
+    u_int64_t check;
+    atq_job_t job;
+} atq_wal_t;
+
+static int atq_before(atq_t *q, u_int32_t a, u_int32_t b);
+static void atq_place(atq_t *q, u_int32_t slot, u_int32_t pos);
+static void atq_sift_up(atq_t *q, u_int32_t pos);
+static void atq_sift_down(atq_t *q, u_int32_t pos);
+static void atq_heap_remove(atq_t *q, u_int32_t slot);
+static int atq_map(atq_t *q, u_int32_t capacity);
+static int atq_grow(atq_t *q, u_int32_t capacity);
+static void atq_rebuild(atq_t *q);
+static u_int64_t atq_wal_check(const atq_wal_t *rec);
+static int atq_log(atq_t *q, atq_op_t op, const atq_job_t *job);
+static int atq_replay(atq_t *q);
+static int atq_spool_write(atq_t *q, u_int64_t id, const char *command, size_t len);
+static int atq_spool_read(atq_t *q, const atq_job_t *job, sbuf_t *sb);
+static void atq_spool_drop(atq_t *q, u_int64_t id);
+static void atq_spool_clean(atq_t *q);
+
+/* earlier first, then in the order they were added */
+static int atq_before(atq_t *q, u_int32_t a, u_int32_t b)
+{
+    atq_job_t *ja = &q->jobs[a], *jb = &q->jobs[b];
+
+    return ja->when < jb->when || (ja->when == jb->when && ja->id < jb->id);
+}
+
+static void atq_place(atq_t *q, u_int32_t slot, u_int32_t pos)
+{
+    q->heap[pos] = slot;
+    q->jobs[slot].heap = pos;
+}
+
+static void atq_sift_up(atq_t *q, u_int32_t pos)
+{
+    u_int32_t slot = q->heap[pos], parent;
+
+    while (pos > 0)
+    {
+	parent = (pos - 1) / 2;
+	if (!atq_before(q, slot, q->heap[parent]))
+	    break;
+	atq_place(q, q->heap[parent], pos);
+	pos = parent;
+    }
+    atq_place(q, slot, pos);
+}
+
+static void atq_sift_down(atq_t *q, u_int32_t pos)
+{
+    u_int32_t slot = q->heap[pos], child, count = q->header->count;
+
+    while ((child = 2 * pos + 1) < count)
+    {
+	if (child + 1 < count && atq_before(q, q->heap[child + 1], q->heap[child]))
+	    child++;
+	if (!atq_before(q, q->heap[child], slot))
+	    break;
+	atq_place(q, q->heap[child], pos);
+	pos = child;
+    }
+    atq_place(q, slot, pos);
+}
+
+static void atq_heap_remove(atq_t *q, u_int32_t slot)
+{
+    u_int32_t pos, last;
+
+    pos = q->jobs[slot].heap;
+    last = q->heap[--q->header->count];
+    if (last == slot)
+	return;
+    atq_place(q, last, pos);
+    if (pos > 0 && atq_before(q, last, q->heap[(pos - 1) / 2]))
+	atq_sift_up(q, pos);
+    else
+	atq_sift_down(q, pos);
+}
+
+/* Map both files for capacity slots, they are grown if needed. The
+   old mappings are only dropped once the new ones are there, so that a
+   failure leaves the queue as it was */
+static int atq_map(atq_t *q, u_int32_t capacity)
+{
+    char path[PATH_MAX];
+    sbuf_t *heap_map, *jobs_map;
+
+    snprintf(path, sizeof(path), "%s/atq.heap", q->dir);
+    if ((heap_map = file_map_write(path, sizeof(atq_header_t) + capacity * sizeof(u_int32_t))) == NULL)
+	return -1;
+    snprintf(path, sizeof(path), "%s/atq.jobs", q->dir);
+    if ((jobs_map = file_map_write(path, capacity * sizeof(atq_job_t))) == NULL)
+    {
+	file_map_unload(heap_map);
+	return -1;
+    }
+    file_map_unload(q->heap_map);
+    file_map_unload(q->jobs_map);
+    q->heap_map = heap_map;
+    q->jobs_map = jobs_map;
+    q->header = (atq_header_t *) heap_map->buffer;
+    q->heap = (u_int32_t *) (heap_map->buffer + sizeof(atq_header_t));
+    q->jobs = (atq_job_t *) jobs_map->buffer;
+    return 0;
+}
+
+/* the new slots are zeroed by the files growing, so free */
+static int atq_grow(atq_t *q, u_int32_t capacity)
+{
+    u_int32_t old, i;
+
+    old = q->header->capacity;
+    if (capacity <= old)
+	return 0;
+    if (atq_map(q, capacity) < 0)
+	return -1;
+    q->header->capacity = capacity;
+
+    q->free = (u_int32_t *) w_realloc(q->free, capacity * sizeof(u_int32_t));
+    for (i = capacity; i-- > old; )
+	q->free[q->nfree++] = i;
+    return 0;
+}
+
+/* free slots and heap from the slots alone, O(n) */
+static void atq_rebuild(atq_t *q)
+{
+    u_int32_t i, count = 0;
+
+    q->nfree = 0;
+    for (i = q->header->capacity; i-- > 0; )
+    {
+	if (q->jobs[i].id == 0)
+	    q->free[q->nfree++] = i;
+	else
+	    q->heap[count++] = i;
+    }
+    q->header->count = count;
+    for (i = 0; i < count; i++)
+	q->jobs[q->heap[i]].heap = i;
+    for (i = count / 2; i-- > 0; )
+	atq_sift_down(q, i);
+}
+
+static u_int64_t atq_wal_check(const atq_wal_t *rec)
+{
+    u_int64_t h;
+
+    h = xhash_wyhash(&rec->job, sizeof(atq_job_t), ((u_int64_t) rec->op << 32) | rec->slot);
+    return h ? h : 1;
+}
+
+static int atq_log(atq_t *q, atq_op_t op, const atq_job_t *job)
+{
+    atq_wal_t rec;
+    ssize_t w;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.slot = ATQ_SLOT(job->id);
+    rec.job = *job;
+    rec.check = atq_wal_check(&rec);
+
+    if ((w = write(q->wal, &rec, sizeof(rec))) != (ssize_t) sizeof(rec))
+    {
+	message(MSG_ERR, (w < 0) ? errno : ENOSPC, "atq: unable to write the log");
+	/* a partial record is dropped by the next replay, but not if more
+	   come after it */
+	if (w > 0 && ftruncate(q->wal, q->wal_size) == 0)
+	    lseek(q->wal, q->wal_size, SEEK_SET);
+	return -1;
+    }
+    q->wal_size += sizeof(rec);
+    if (q->sync && fdatasync(q->wal) < 0)
+    {
+	message(MSG_ERR, errno, "atq: unable to sync the log");
+	return -1;
+    }
+    return 0;
+}
+
+/* apply what the log holds, it stops at the first torn record */
+static int atq_replay(atq_t *q)
+{
+    atq_wal_t rec;
+    ssize_t r;
+    int n = 0;
+
+    lseek(q->wal, 0, SEEK_SET);
+    while ((r = read(q->wal, &rec, sizeof(rec))) == (ssize_t) sizeof(rec))
+    {
+	if (rec.check != atq_wal_check(&rec) || (rec.op != AQ_ADD && rec.op != AQ_DEL) ||
+	    ATQ_SLOT(rec.job.id) != rec.slot)
+	    break;
+	if (rec.slot >= q->header->capacity && atq_grow(q, (rec.slot + 1) * 2) < 0)
+	    return -1;
+	if (rec.op == AQ_ADD)
+	    q->jobs[rec.slot] = rec.job;
+	else if (q->jobs[rec.slot].id == rec.job.id)
+	    memset(&q->jobs[rec.slot], 0, sizeof(atq_job_t));
+	if ((u_int32_t) (rec.job.id >> 32) > q->header->seq)
+	    q->header->seq = (u_int32_t) (rec.job.id >> 32);
+	n++;
+    }
+    return n;
+}
+
+/* The command goes to its own file, on disk before the job is logged
+   when the log is synced */
+static int atq_spool_write(atq_t *q, u_int64_t id, const char *command, size_t len)
+{
+    char name[32];
+    size_t done = 0;
+    ssize_t w;
+    int fd;
+
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) id);
+    if ((fd = openat(q->spool, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+    {
+	message(MSG_ERR, errno, "atq: unable to create the command of job %s", name);
+	return -1;
+    }
+    while (done < len)
+    {
+	if ((w = write(fd, command + done, len - done)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	done += w;
+    }
+    if (done < len || (q->sync && (fdatasync(fd) < 0 || fsync(q->spool) < 0)))
+    {
+	message(MSG_ERR, errno, "atq: unable to write the command of job %s", name);
+	close(fd);
+	unlinkat(q->spool, name, 0);
+	return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* the command of job in sb, -1 with errno set when it cannot be read */
+static int atq_spool_read(atq_t *q, const atq_job_t *job, sbuf_t *sb)
+{
+    char name[32];
+    ssize_t r;
+    int fd;
+
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) job->id);
+    if ((fd = openat(q->spool, name, O_RDONLY | O_CLOEXEC)) < 0)
+	return -1;
+    sbuf_reset(sb);
+    sbuf_reserve(sb, job->len);
+    while (sb->len < job->len)
+    {
+	if ((r = read(fd, sb->buffer + sb->len, job->len - sb->len)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if (r == 0)
+	{
+	    errno = EIO;
+	    break;
+	}
+	sb->len += r;
+    }
+    close(fd);
+    sb->buffer[sb->len] = '\0';
+    return (sb->len == job->len) ? 0 : -1;
+}
+
+static void atq_spool_drop(atq_t *q, u_int64_t id)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) id);
+    if (unlinkat(q->spool, name, 0) < 0 && errno != ENOENT)
+	message(MSG_WARN, errno, "atq: unable to remove the command of job %s", name);
+}
+
+/* after a crash: the commands written for jobs never logged, or of
+   jobs whose removal was logged */
+static void atq_spool_clean(atq_t *q)
+{
+    DIR *d;
+    struct dirent *de;
+    unsigned long long id;
+    u_int32_t slot;
+    int fd;
+
+    if ((fd = dup(q->spool)) < 0 || (d = fdopendir(fd)) == NULL)
+    {
+	message(MSG_WARN, errno, "atq: unable to list the commands");
+	if (fd >= 0)
+	    close(fd);
+	return;
+    }
+    while ((de = readdir(d)) != NULL)
+    {
+	if (sscanf(de->d_name, "%16llx", &id) != 1 || strlen(de->d_name) != 16)
+	    continue;
+	slot = ATQ_SLOT(id);
+	if (slot >= q->header->capacity || q->jobs[slot].id != id)
+	    unlinkat(q->spool, de->d_name, 0);
+    }
+    closedir(d);
+}
+
+/* The queue kept in dir, created if needed. With sync, a change is on
+   disk when the call returns; without, it survives a crash of the
+   daemon but not of the system */
+atq_t *atq_open(const char *dir, int sync)
+{
+    char path[PATH_MAX];
+    atq_header_t *header;
+    sbuf_t *map;
+    atq_t *q;
+    u_int32_t capacity, i;
+    int replayed;
+
+    q = (atq_t *) w_malloc(sizeof(atq_t));
+    q->dir = strdup(dir);
+    q->sync = sync;
+    q->wal = -1;
+    q->spool = -1;
+
+    /* the header alone first, for the capacity */
+    snprintf(path, sizeof(path), "%s/atq.heap", dir);
+    if ((map = file_map_write(path, sizeof(atq_header_t))) == NULL)
+	goto fail;
+    header = (atq_header_t *) map->buffer;
+    if (header->magic[0] == '\0')
+    {
+	memcpy(header->magic, ATQ_MAGIC, 8);
+	header->version = ATQ_VERSION;
+	header->job_size = sizeof(atq_job_t);
+	header->clean = 1;
+    }
+    if (memcmp(header->magic, ATQ_MAGIC, 8) != 0 || header->version != ATQ_VERSION ||
+	header->job_size != sizeof(atq_job_t))
+    {
+	message(MSG_ERR, 0, "atq: %s is not a valid queue\n", path);
+	file_map_unload(map);
+	goto fail;
+    }
+    capacity = header->capacity;
+    file_map_unload(map);
+
+    if (atq_map(q, capacity ? capacity : 1024) < 0)
+	goto fail;
+    q->free = (u_int32_t *) w_malloc((capacity ? capacity : 1) * sizeof(u_int32_t));
+    if (capacity == 0 && atq_grow(q, 1024) < 0)
+	goto fail;
+
+    snprintf(path, sizeof(path), "%s/atq.wal", dir);
+    if ((q->wal = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+    {
+	message(MSG_ERR, errno, "atq: unable to open %s", path);
+	goto fail;
+    }
+    if ((replayed = atq_replay(q)) < 0)
+	goto fail;
+
+    snprintf(path, sizeof(path), "%s/atq.spool", dir);
+    if ((mkdir(path, 0700) < 0 && errno != EEXIST) ||
+	(q->spool = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+	message(MSG_ERR, errno, "atq: unable to open %s", path);
+	goto fail;
+    }
+
+    if (replayed > 0 || !q->header->clean)
+    {
+	message(MSG_INFO, 0, "atq: recovering, %d changes replayed\n", replayed);
+	atq_rebuild(q);
+	atq_spool_clean(q);
+	if (atq_checkpoint(q) < 0)
+	    goto fail;
+    }
+    else
+    {
+	/* the heap is good, only the free slots are not kept */
+	q->nfree = 0;
+	for (i = q->header->capacity; i-- > 0; )
+	    if (q->jobs[i].id == 0)
+		q->free[q->nfree++] = i;
+    }
+    q->header->clean = 0;
+    return q;
+
+fail:
+    atq_close(q);
+    return NULL;
+}
+
+void atq_close(atq_t *q)
+{
+    if (q == NULL)
+	return;
+    if (q->heap_map != NULL && q->wal >= 0 && atq_checkpoint(q) == 0)
+    {
+	q->header->clean = 1;
+	msync(q->heap_map->buffer, q->heap_map->size, MS_SYNC);
+    }
+    if (q->heap_map != NULL)
+	file_map_unload(q->heap_map);
+    if (q->jobs_map != NULL)
+	file_map_unload(q->jobs_map);
+    if (q->wal >= 0)
+	close(q->wal);
+    if (q->spool >= 0)
+	close(q->spool);
+    w_free(q->free);
+    w_free(q->dir);
+    w_free(q);
+}
+
+/* Queue a job for when, returns its id or 0 when it cannot be kept */
+u_int64_t atq_add(atq_t *q, time_t when, const char *user, const char *command)
+{
+    atq_job_t job;
+    size_t len;
+    u_int32_t slot;
+
+    if (user == NULL || command == NULL || strlen(user) >= ATQ_USER_MAX ||
+	(len = strlen(command)) > UINT32_MAX)
+    {
+	message(MSG_ERR, 0, "atq: job too large\n");
+	return 0;
+    }
+    if (q->nfree == 0 && atq_grow(q, q->header->capacity * 2) < 0)
+	return 0;
+
+    slot = q->free[q->nfree - 1];
+    memset(&job, 0, sizeof(job));
+    if (++q->header->seq == 0)
+	q->header->seq = 1;
+    job.id = ((u_int64_t) q->header->seq << 32) | slot;
+    job.when = when;
+    job.len = (u_int32_t) len;
+    strcpy(job.user, user);
+    if (atq_spool_write(q, job.id, command, len) < 0)
+	return 0;
+    if (atq_log(q, AQ_ADD, &job) < 0)
+    {
+	atq_spool_drop(q, job.id);
+	return 0;
+    }
+
+    q->nfree--;
+    q->jobs[slot] = job;
+    atq_place(q, slot, q->header->count++);
+    atq_sift_up(q, q->jobs[slot].heap);
+
+    if (q->wal_size > ATQ_WAL_MAX)
+	atq_checkpoint(q);
+    return job.id;
+}
+
+int atq_cancel(atq_t *q, u_int64_t id)
+{
+    u_int32_t slot = ATQ_SLOT(id);
+
+    if (id == 0 || slot >= q->header->capacity || q->jobs[slot].id != id)
+	return -1;
+    if (atq_log(q, AQ_DEL, &q->jobs[slot]) < 0)
+	return -1;
+    atq_heap_remove(q, slot);
+    memset(&q->jobs[slot], 0, sizeof(atq_job_t));
+    q->free[q->nfree++] = slot;
+    atq_spool_drop(q, id);
+
+    if (q->wal_size > ATQ_WAL_MAX)
+	atq_checkpoint(q);
+    return 0;
+}
+
+/* run time of the first job, -1 when the queue is empty */
+time_t atq_next(atq_t *q)
+{
+    if (q->header->count == 0)
+	return -1;
+    return (time_t) q->jobs[q->heap[0]].when;
+}
+
+/* Take every job due at now out of the queue and give it with its
+   command to fn, which may add jobs. A job whose command is lost is
+   dropped. Returns the number of jobs given, -1 on error */
+int atq_run(atq_t *q, time_t now, atq_fn_t fn, void *arg)
+{
+    atq_job_t job;
+    sbuf_t *command;
+    u_int32_t slot;
+    int n = 0, lost;
+
+    SBUF_NEW(command, 256);
+    while (q->header->count > 0 && q->jobs[q->heap[0]].when <= now)
+    {
+	slot = q->heap[0];
+	job = q->jobs[slot];
+	/* kept queued when the command cannot be read for now */
+	if ((lost = atq_spool_read(q, &job, command)) < 0 && errno != ENOENT && errno != EIO)
+	{
+	    message(MSG_ERR, errno, "atq: unable to read the command of job %016llx",
+		    (unsigned long long) job.id);
+	    n = -1;
+	    break;
+	}
+	if (atq_log(q, AQ_DEL, &job) < 0)
+	{
+	    n = -1;
+	    break;
+	}
+	atq_heap_remove(q, slot);
+	memset(&q->jobs[slot], 0, sizeof(atq_job_t));
+	q->free[q->nfree++] = slot;
+	atq_spool_drop(q, job.id);
+	if (lost < 0)
+	{
+	    message(MSG_ERR, 0, "atq: the command of job %016llx is lost, job dropped\n",
+		    (unsigned long long) job.id);
+	    continue;
+	}
+	fn(&job, command->buffer, arg);
+	n++;
+    }
+    SBUF_FREE(command);
+
+    if (q->wal_size > ATQ_WAL_MAX)
+	atq_checkpoint(q);
+    return n;
+}
+
+/* the mappings to the disk, then the log can go */
+int atq_checkpoint(atq_t *q)
+{
+    if (msync(q->jobs_map->buffer, q->jobs_map->size, MS_SYNC) < 0 ||
+	msync(q->heap_map->buffer, q->heap_map->size, MS_SYNC) < 0)
+    {
+	message(MSG_ERR, errno, "atq: unable to sync the queue");
+	return -1;
+    }
+    if (ftruncate(q->wal, 0) < 0 || lseek(q->wal, 0, SEEK_SET) < 0)
+    {
+	message(MSG_ERR, errno, "atq: unable to empty the log");
+	return -1;
+    }
+    q->wal_size = 0;
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __ATQ_H__
+#define __ATQ_H__
+
+#include <time.h>
+
+#include "common.h"
+
+/*
+ * Queue of the one-shot jobs of at(1), kept on disk in a directory:
+ *   atq.jobs   array of fixed size job slots, mapped
+ *   atq.heap   header and a binary min-heap of slot numbers on the run
+ *              time, mapped
+ *   atq.wal    write-ahead log of the changes
+ *   atq.spool/ the command of each job, in a file named after its id
+ * A change goes to the log before it touches the mappings, so a crash
+ * in the middle of moving heap entries loses nothing: on open, the log
+ * is replayed on the slots, which it describes entirely, and the heap
+ * is rebuilt from them in O(n). After a clean close the heap is used as
+ * it is. The log is emptied at checkpoints, once the mappings are
+ * synced. The id of a job holds its slot, cancelling needs no index.
+ * A slot only holds fixed metadata, a command has no size limit: its
+ * file is written before the job is logged and removed after, the
+ * files a crash leaves behind are removed on recovery.
+ */
+
+#define ATQ_MAGIC       "CRNATQ01"
+#define ATQ_USER_MAX    32
+#define ATQ_WAL_MAX     (4 * 1024 * 1024)
+
+typedef struct atq_job {
+    u_int64_t id;           /* seq << 32 | slot, 0 for a free slot */
+    int64_t when;
+    u_int32_t heap;         /* position in the heap */
+    u_int32_t len;          /* of the command */
+    char user[ATQ_USER_MAX];
+} atq_job_t;
+
+typedef struct atq_header {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t job_size;
+    u_int32_t capacity;
+    u_int32_t count;        /* in the heap */
+    u_int32_t seq;          /* last one given */
+    u_int32_t clean;        /* closed properly, the heap can be trusted */
+    u_int64_t unused[4];
+} atq_header_t;
+
+typedef struct atq {
+    char *dir;
+    sbuf_t *heap_map;
+    sbuf_t *jobs_map;
+    atq_header_t *header;
+    u_int32_t *heap;
+    atq_job_t *jobs;
+    u_int32_t *free;        /* stack of the free slots */
+    u_int32_t nfree;
+    int wal;
+    off_t wal_size;
+    int spool;              /* the directory of the commands */
+    int sync;               /* fdatasync the log at each change */
+} atq_t;
+
+typedef void (*atq_fn_t)(const atq_job_t *job, const char *command, void *arg);
+
+/* ------- API -------- */
+atq_t *atq_open(const char *dir, int sync);
+void atq_close(atq_t *q);
+u_int64_t atq_add(atq_t *q, time_t when, const char *user, const char *command);
+int atq_cancel(atq_t *q, u_int64_t id);
+time_t atq_next(atq_t *q);
+int atq_run(atq_t *q, time_t now, atq_fn_t fn, void *arg);
+int atq_checkpoint(atq_t *q);
+
+#endif /* __ATQ_H__ */
@@ -0,0 +1,160 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Compare the cold paths of the scheduler, batched with cron_batch, to
+   the same work done job by job: the next times of a whole job table,
+   as at startup or after a big clock step, and the runs skipped by a
+   small clock step. Exits with 1 when the results differ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "crontab.h"
+#include "scheduler.h"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a mix like real crontabs: mostly hourly and daily jobs */
+static void make_sched(cron_sched_t *sched)
+{
+    char line[64];
+    sview_t v;
+    int r;
+
+    r = rand() % 10;
+    if (r < 2)
+	snprintf(line, sizeof(line), "*/%d * * * * true", 5 + rand() % 10);
+    else if (r < 5)
+	snprintf(line, sizeof(line), "%d * * * * true", rand() % 60);
+    else if (r < 9)
+	snprintf(line, sizeof(line), "%d %d * * * true", rand() % 60, rand() % 24);
+    else
+	snprintf(line, sizeof(line), "%d %d * * %d true", rand() % 60, rand() % 24, rand() % 7);
+    v = sview_make(line, strlen(line));
+    cron_sched_parse(&v, sched);
+}
+
+static int bench(cron_sched_t *scheds, sched_entry_t *entries, unsigned long n, int window, time_t t0)
+{
+    static const int spans[] = { 5, 60, 175 };
+    scheduler_t *sched;
+    time_t *ref, *last;
+    long *counts, total, ref_total;
+    unsigned long i;
+    double t, one, batch;
+    int s, offset;
+
+    sched = scheduler_create(n);
+    scheduler_smooth(sched, window, 42);
+    ref = (time_t *) w_malloc(n * sizeof(time_t));
+    counts = (long *) w_malloc(n * sizeof(long));
+    last = (time_t *) w_malloc(n * sizeof(time_t));
+
+    for (i = 0; i < n; i++)
+    {
+	sched_entry_init(&entries[i], &scheds[i], NULL);
+	entries[i].key = i + 1;
+	entries[i].next = SCHED_UNSET;
+    }
+
+    t = now();
+    for (i = 0; i < n; i++)
+    {
+	offset = scheduler_offset(sched, &entries[i]);
+	ref[i] = cron_sched_next(&scheds[i], t0 - offset) + offset;
+    }
+    one = now() - t;
+    t = now();
+    scheduler_load(sched, entries, n, t0);
+    batch = now() - t;
+    printf("%6d %-12s %12.1f %12.1f %7.1fx\n", window, "next times", one * 1e3, batch * 1e3, one / batch);
+    for (i = 0; i < n; i++)
+	if (entries[i].next != ref[i])
+	{
+	    printf("job %lu: next %ld instead of %ld\n", i, (long) entries[i].next, (long) ref[i]);
+	    return 1;
+	}
+
+    /* a step forward, the heap is walked in its order, the runs counted
+       and the last one found as clockwatch_resync() did one by one */
+    for (s = 0; s < (int) (sizeof(spans) / sizeof(spans[0])); s++)
+    {
+	t = now();
+	ref_total = 0;
+	for (i = 0; i < sched->count; i++)
+	{
+	    offset = scheduler_offset(sched, sched->heap[i]);
+	    if ((counts[i] = cron_sched_count(sched->heap[i]->sched, t0 - offset,
+					      t0 + spans[s] * 60 - offset)) == 0)
+		continue;
+	    last[i] = cron_sched_prev(sched->heap[i]->sched, t0 + spans[s] * 60 - offset + 1) + offset;
+	    ref_total += counts[i];
+	}
+	one = now() - t;
+	t = now();
+	total = scheduler_count(sched, t0, t0 + spans[s] * 60, counts, last);
+	batch = now() - t;
+	printf("%6d %3d min step %12.1f %12.1f %7.1fx\n", window, spans[s], one * 1e3, batch * 1e3,
+	       one / batch);
+	if (total != ref_total)
+	{
+	    printf("%ld runs counted instead of %ld\n", total, ref_total);
+	    return 1;
+	}
+    }
+
+    scheduler_destroy(sched);
+    w_free(ref);
+    w_free(counts);
+    w_free(last);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    cron_sched_t *scheds;
+    sched_entry_t *entries;
+    unsigned long i, n;
+    time_t t0;
+
+    n = (argc > 1) ? (unsigned long) atol(argv[1]) : 1000000;
+    t0 = time(NULL);
+    srand(1);
+
+    scheds = (cron_sched_t *) w_malloc(n * sizeof(cron_sched_t));
+    entries = (sched_entry_t *) w_malloc(n * sizeof(sched_entry_t));
+    for (i = 0; i < n; i++)
+	make_sched(&scheds[i]);
+
+    printf("%lu jobs\n", n);
+    printf("%6s %-12s %12s %12s %8s\n", "window", "", "one ms", "batch ms", "speedup");
+    if (bench(scheds, entries, n, 0, t0) || bench(scheds, entries, n, 300, t0))
+	return 1;
+
+    w_free(scheds);
+    w_free(entries);
+    return 0;
+}
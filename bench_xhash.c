@@ -0,0 +1,81 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Compare fnv_64_str and xhash_wyhash on keys of various length */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xhash.h"
+
+#define NKEYS 1024
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t lens[] = { 8, 16, 32, 64, 256 };
+    char *keys[NKEYS];
+    size_t i, l, k, rounds;
+    u_int64_t seed, sink = 0;
+    double t0, fnv, wy;
+
+    seed = xhash_random_seed();
+    rounds = (argc > 1) ? (size_t) atol(argv[1]) : 2000;
+
+    printf("%8s %12s %12s %8s\n", "keylen", "fnv ns/key", "wy ns/key", "speedup");
+    for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+    {
+	/* keys like job names: printable, no NUL inside */
+	for (k = 0; k < NKEYS; k++)
+	{
+	    keys[k] = (char *) malloc(lens[l] + 1);
+	    for (i = 0; i < lens[l]; i++)
+		keys[k][i] = 'a' + (char) ((k * 31 + i * 7) % 26);
+	    keys[k][lens[l]] = '\0';
+	}
+
+	t0 = now();
+	for (i = 0; i < rounds; i++)
+	    for (k = 0; k < NKEYS; k++)
+		sink += fnv_64_str(keys[k], FNV1_64_INIT);
+	fnv = (now() - t0) * 1e9 / (rounds * NKEYS);
+
+	/* the length is known, as with xhash_addn */
+	t0 = now();
+	for (i = 0; i < rounds; i++)
+	    for (k = 0; k < NKEYS; k++)
+		sink += xhash_wyhash(keys[k], lens[l], seed);
+	wy = (now() - t0) * 1e9 / (rounds * NKEYS);
+
+	printf("%8lu %12.2f %12.2f %7.1fx\n", (unsigned long) lens[l], fnv, wy, fnv / wy);
+
+	for (k = 0; k < NKEYS; k++)
+	    free(keys[k]);
+    }
+
+    /* keep the compiler from dropping the loops */
+    return (sink == 42) ? 1 : 0;
+}
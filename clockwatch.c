@@ -0,0 +1,235 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <poll.h>
+#include <string.h>
+#include <sys/timerfd.h>
+
+#include "common.h"
+#include "clockwatch.h"
+
+/* with nothing scheduled, still wake once a day */
+#define CLOCKWATCH_IDLE 86400
+
+static long clockwatch_offset(time_t t);
+static void clockwatch_mark(clockwatch_t *cw);
+
+static long clockwatch_offset(time_t t)
+{
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    return tm.tm_gmtoff;
+}
+
+static void clockwatch_mark(clockwatch_t *cw)
+{
+    cw->wall = time(NULL);
+    clock_gettime(CLOCK_BOOTTIME, &cw->boot);
+    cw->offset = clockwatch_offset(cw->wall);
+}
+
+clockwatch_t *clockwatch_create(void)
+{
+    clockwatch_t *cw;
+
+    cw = (clockwatch_t *) w_malloc(sizeof(clockwatch_t));
+    if ((cw->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    {
+	message(MSG_ERR, errno, "clockwatch: unable to create timer");
+	w_free(cw);
+	return NULL;
+    }
+    clockwatch_mark(cw);
+    return cw;
+}
+
+void clockwatch_destroy(clockwatch_t *cw)
+{
+    if (cw == NULL)
+	return;
+    close(cw->fd);
+    w_free(cw);
+}
+
+int clockwatch_fd(clockwatch_t *cw)
+{
+    return (cw != NULL) ? cw->fd : -1;
+}
+
+/* wake at deadline (wall clock) or when the clock is set, -1 for none */
+int clockwatch_arm(clockwatch_t *cw, time_t deadline)
+{
+    struct itimerspec its;
+
+    if (cw == NULL)
+	return -1;
+
+    memset(&its, 0, sizeof(its));
+    if (deadline < 0)
+	deadline = time(NULL) + CLOCKWATCH_IDLE;
+    /* zero would disarm the timer */
+    its.it_value.tv_sec = (deadline > 0) ? deadline : 1;
+
+    if (timerfd_settime(cw->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+    {
+	message(MSG_ERR, errno, "clockwatch: unable to arm timer");
+	return -1;
+    }
+    return 0;
+}
+
+/* Consume the timer and tell what happened to the clock since the last
+   check. Returns the flags of change, 0 when the clock just went on */
+int clockwatch_check(clockwatch_t *cw, clock_change_t *change)
+{
+    struct timespec boot;
+    u_int64_t expirations;
+    time_t elapsed, delta;
+
+    if (cw == NULL || change == NULL)
+	return -1;
+
+    /* ECANCELED when the clock was set, EAGAIN when not expired */
+    if (read(cw->fd, &expirations, sizeof(expirations)) < 0 &&
+	errno != ECANCELED && errno != EAGAIN)
+	message(MSG_WARN, errno, "clockwatch: unable to read timer");
+
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    elapsed = boot.tv_sec - cw->boot.tv_sec;
+    if (boot.tv_nsec < cw->boot.tv_nsec)
+	elapsed--;
+
+    memset(change, 0, sizeof(clock_change_t));
+    change->now = time(NULL);
+    change->expected = cw->wall + elapsed;
+    change->offset_from = cw->offset;
+    change->offset_to = clockwatch_offset(change->now);
+
+    delta = change->now - change->expected;
+    if (delta > CLOCKWATCH_TOLERANCE || delta < -CLOCKWATCH_TOLERANCE)
+	change->flags |= CW_STEP;
+    if (change->offset_to != change->offset_from)
+	change->flags |= CW_DST;
+
+    if (change->flags & CW_STEP)
+	message(MSG_WARN, 0, "clockwatch: wall clock stepped by %lds\n", (long) delta);
+    if (change->flags & CW_DST)
+	message(MSG_INFO, 0, "clockwatch: UTC offset changed from %lds to %lds\n",
+		change->offset_from, change->offset_to);
+
+    clockwatch_mark(cw);
+    return change->flags;
+}
+
+/* sleep until deadline or a clock step, then check */
+int clockwatch_wait(clockwatch_t *cw, time_t deadline, clock_change_t *change)
+{
+    struct pollfd pfd;
+
+    if (clockwatch_arm(cw, deadline) < 0)
+	return -1;
+
+    pfd.fd = cw->fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) < 0)
+	if (errno != EINTR)
+	{
+	    message(MSG_ERR, errno, "clockwatch: poll failed");
+	    return -1;
+	}
+    return clockwatch_check(cw, change);
+}
+
+/* Make the scheduler agree with a clock change. After a small step
+   forward the jobs that skipped runs stay due and fire once at the next
+   scheduler_run(), the runs beyond that one are counted and given to
+   missed for the SP_ALL entries. After a big step forward every next
+   time is computed again from now and missed gets the skipped runs as
+   the policy of each entry says, like scheduler_catchup(). Minutes
+   replayed by a small step backward are before the next times already
+   computed, so nothing runs twice, a big one reschedules everything.
+   missed may be NULL, it must not remove entries. Returns the number of
+   runs that will not be done */
+long clockwatch_resync(scheduler_t *sched, const clock_change_t *change, sched_missed_t missed, void *arg)
+{
+    sched_entry_t *entry;
+    unsigned long i, n;
+    time_t delta, *last;
+    long *counts, ran, give, skipped;
+    int big;
+
+    if (sched == NULL || change == NULL)
+	return -1;
+    if (!(change->flags & CW_STEP))
+	return 0;
+
+    delta = change->now - change->expected;
+    if (delta < 0)
+    {
+	if (-delta <= CLOCKWATCH_CATCHUP)
+	    message(MSG_INFO, 0, "clockwatch: not repeating %ld minutes\n", (long) (-delta / 60));
+	else
+	{
+	    scheduler_reschedule(sched, change->now);
+	    message(MSG_WARN, 0, "clockwatch: big clock step backward, rescheduled all jobs\n");
+	}
+	return 0;
+    }
+
+    big = (delta > CLOCKWATCH_CATCHUP);
+    if (big)
+	scheduler_reschedule(sched, change->now);
+
+    /* missed may not remove entries, the heap stays as counted */
+    n = sched->count;
+    counts = (long *) w_malloc((n ? n : 1) * sizeof(long));
+    last = (time_t *) w_malloc((n ? n : 1) * sizeof(time_t));
+    scheduler_count(sched, change->expected, change->now, counts, last);
+
+    skipped = 0;
+    for (i = 0; i < n; i++)
+    {
+	entry = sched->heap[i];
+	if (counts[i] == 0)
+	    continue;
+
+	ran = big ? 0 : 1;
+	if (entry->policy == SP_ALL)
+	    give = counts[i] - ran;
+	else if (entry->policy == SP_ONCE)
+	    give = 1 - ran;
+	else
+	    give = 0;
+	if (give > 0 && missed != NULL)
+	    missed(entry, last[i], give, arg);
+	else
+	    give = 0;
+	skipped += counts[i] - ran - give;
+    }
+    w_free(counts);
+    w_free(last);
+
+    if (big)
+	message(MSG_WARN, 0, "clockwatch: big clock step forward, rescheduled all jobs, %ld runs skipped\n",
+		skipped);
+    else
+	message(MSG_INFO, 0, "clockwatch: catching up %ld minutes, %ld runs skipped\n",
+		(long) (delta / 60), skipped);
+    return skipped;
+}
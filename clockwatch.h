@@ -0,0 +1,71 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __CLOCKWATCH_H__
+#define __CLOCKWATCH_H__
+
+#include <time.h>
+
+#include "common.h"
+#include "scheduler.h"
+
+/*
+ * Follow the wall clock: sleep on a timerfd until the next deadline of
+ * the scheduler, nothing else wakes us. The timer is armed with
+ * TFD_TIMER_CANCEL_ON_SET so that a step of the clock (date, ntpdate,
+ * a VM resumed) interrupts the sleep at once. The step is measured
+ * against CLOCK_BOOTTIME, which neither steps nor stops during a
+ * suspend. DST switches do not move the clock, they are noticed by a
+ * change of the UTC offset.
+ */
+
+#define CW_STEP 0x01 /* the wall clock was set */
+#define CW_DST  0x02 /* the UTC offset changed */
+
+/* steps under this, in seconds, are noise from ntp */
+#define CLOCKWATCH_TOLERANCE 2
+/* like vixie-cron: jobs that skipped runs in a smaller step forward
+   run once, a bigger step in either direction reschedules everything.
+   The other skipped runs are counted, see clockwatch_resync() */
+#define CLOCKWATCH_CATCHUP (3 * 3600)
+
+typedef struct clock_change {
+    int flags;
+    time_t expected;    /* wall clock if nothing had happened */
+    time_t now;
+    long offset_from;   /* UTC offset before and after, seconds */
+    long offset_to;
+} clock_change_t;
+
+typedef struct clockwatch {
+    int fd;             /* timerfd on CLOCK_REALTIME */
+    time_t wall;        /* wall clock at the last check */
+    struct timespec boot;
+    long offset;
+} clockwatch_t;
+
+/* ------- API -------- */
+clockwatch_t *clockwatch_create(void);
+void clockwatch_destroy(clockwatch_t *cw);
+int clockwatch_fd(clockwatch_t *cw);
+int clockwatch_arm(clockwatch_t *cw, time_t deadline);
+int clockwatch_check(clockwatch_t *cw, clock_change_t *change);
+int clockwatch_wait(clockwatch_t *cw, time_t deadline, clock_change_t *change);
+long clockwatch_resync(scheduler_t *sched, const clock_change_t *change, sched_missed_t missed, void *arg);
+
+#endif /* __CLOCKWATCH_H__ */
@@ -33,13 +33,29 @@
 
 /*
 void print_err(int err_code, const char *fmt, ...)
+message(msg_level_t level, int err_code, const char *fmt, ...)
 
 void *w_malloc(size_t count)
+void *w_realloc(void *data, size_t count)
 void w_free(void *data)
 
 SBUF_NEW(NAME, SIZE)
 SBUF_FREE(NAME)
 SBUF_CHECK(NAME)
+sbuf_t *sbuf_new(unsigned long size)
+void sbuf_reserve(sbuf_t *sb, unsigned long extra)
+void sbuf_append(sbuf_t *sb, const char *data, unsigned long n)
+void sbuf_append_view(sbuf_t *sb, sview_t v)
+void sbuf_appendf(sbuf_t *sb, const char *fmt, ...)
+void sbuf_reset(sbuf_t *sb)
+sview_t sbuf_view(const sbuf_t *sb)
+
+sview_t sview_make(const char *ptr, unsigned long len)
+int sview_eq(sview_t v, const char *str)
+sview_t sview_trim(sview_t v)
+int sview_cut(sview_t *v, char sep, sview_t *head)
+int sview_token(sview_t *v, sview_t *tok)
+char *sview_dup(sview_t v)
 
 int file_stat(const char *path, int *size)
 int file_open(int *size, const char *path, int flags)
@@ -49,6 +65,7 @@ int file_readline(const int fd, char *buffer, int nbytes)
 char *file_mmap(const char *path, int *size)
 int file_munmap(char *buf, int size)
 sbuf_t *file_map_load(const char *path)
+sbuf_t *file_map_write(const char *path, int size)
 void file_map_unload(sbuf_t *fm)
 
 */
@@ -74,27 +91,42 @@ typedef enum {
     MSG_EMERG
 } msg_level_t;
 
-msg_level_t general_msg_level;
-
-static __inline void message(msg_level_t level, int err_code, const char *fmt, ...)
+/* defined in log.c */
+extern msg_level_t general_msg_level;
+extern volatile int log_running;
+extern const char *msg_tags[];
+void log_vmessage(msg_level_t level, int err_code, const char *fmt, va_list va);
+
+/* The level is checked before the call, so that filtered out messages
+   cost a compare: arguments are neither evaluated nor formatted */
+#define message(LEVEL, ...)                         \
+do {                                                \
+    if ((LEVEL) >= general_msg_level)               \
+	message_write((LEVEL), __VA_ARGS__);        \
+} while (0)
+
+/* once log_start() is called, messages are queued for the log thread,
+   otherwise they are written to stderr right away */
+static __inline void message_write(msg_level_t level, int err_code, const char *fmt, ...)
 {
     va_list va;
     char buffer[_POSIX2_LINE_MAX];
-    char *tags[] = { "[DEBUG]", "[INFO]", "[NOTICE]",
-		    "[WARNING]", "[ERROR]", "[CRITICAL]",
-		    "[ALERT]", "[FATAL]" };
 
-    if (level < general_msg_level)
+    va_start(va, fmt);
+    if (log_running)
+    {
+	log_vmessage(level, err_code, fmt, va);
+	va_end(va);
 	return;
+    }
 
-    va_start(va, fmt);
     vsnprintf(buffer, _POSIX2_LINE_MAX, fmt, va);
 
     if (err_code)
     {
-	fprintf(stderr, "%s %s: %s\n", tags[level], buffer, strerror(err_code));
+	fprintf(stderr, "%s %s: %s\n", msg_tags[level], buffer, strerror(err_code));
     } else {
-	fprintf(stderr, "%s %s", tags[level], buffer);
+	fprintf(stderr, "%s %s", msg_tags[level], buffer);
     }
     va_end(va);
 }
@@ -105,12 +137,22 @@ static __inline void *w_malloc(size_t count)
 {
     void *data;
 	
-    if ((data = malloc(count)) == NULL)
+    /* calloc gets already zeroed pages from the system for big blocks */
+    if ((data = calloc(1, count)) == NULL)
+    {
+	print_err(errno, "FATAL: could not allocate");
+	exit(1);
+    }
+    return data;
+}
+
+static __inline void *w_realloc(void *data, size_t count)
+{
+    if ((data = realloc(data, count)) == NULL)
     {
 	print_err(errno, "FATAL: could not allocate");
 	exit(1);
     }
-    memset(data, 0, count);
     return data;
 }
 
@@ -122,27 +164,225 @@ static __inline void w_free(void *data)
 /* ------------------- end memory --------------------- */
 
 /* ----------------------- sized buffer -------------------- */
+/* size is what buffer can hold, len what is used. A buffer that does not
+   come from malloc (a mapped file, a borrowed string) has owned = 0: it is
+   copied to the heap the first time it has to grow. Owned buffers are
+   always NUL terminated after len. A mapped file stays mapped until
+   file_map_unload(), views into it remain valid after the copy. */
 typedef struct size_buffer {
 	unsigned long size;
+	unsigned long len;
+	int owned;
 	char *buffer;
+	char *map;		/* of file_map_*(), kept after a copy */
+	unsigned long map_len;
 } sbuf_t;
 
+/* Non owning slice of a buffer, not NUL terminated */
+typedef struct string_view {
+	const char *ptr;
+	unsigned long len;
+} sview_t;
+
 #define SBUF_NEW(NAME, SIZE)                         \
 {                                                    \
 	NAME = (sbuf_t *) w_malloc(sizeof(sbuf_t));  \
 	NAME->size = (unsigned long) SIZE;           \
+	NAME->len = 0;                               \
+	NAME->owned = 1;                             \
 	NAME->buffer = (char *) w_malloc(SIZE);      \
-	memset(NAME->buffer, '\0', SIZE);            \
 }
 
 #define SBUF_FREE(NAME)        \
 {                              \
-	w_free(NAME->buffer);  \
+	if (NAME->owned)       \
+	    w_free(NAME->buffer); \
 	w_free(NAME);          \
 }
 
 #define SBUF_CHECK(NAME) \
 if ((NAME->size <= 0) || (NAME->buffer == NULL))
+
+#define SVIEW_FMT "%.*s"
+#define SVIEW_ARG(V) (int) (V).len, (V).ptr
+
+static __inline sbuf_t *sbuf_new(unsigned long size)
+{
+	sbuf_t *sb;
+
+	if (size == 0)
+		size = 64;
+	SBUF_NEW(sb, size);
+	return sb;
+}
+
+/* make room for extra more bytes plus the terminating NUL, growing by
+   doubling so that appends are amortized O(1) */
+static __inline void sbuf_reserve(sbuf_t *sb, unsigned long extra)
+{
+	unsigned long want, n;
+	char *p;
+
+	want = sb->len + extra + 1;
+	if (sb->owned && want <= sb->size)
+		return;
+
+	for (n = (sb->size > 0) ? sb->size : 64; n < want; n *= 2)
+		;
+
+	if (sb->owned)
+	{
+		sb->buffer = (char *) w_realloc(sb->buffer, n);
+	}
+	else
+	{
+		p = (char *) w_malloc(n);
+		if (sb->len)
+			memcpy(p, sb->buffer, sb->len);
+		sb->buffer = p;
+		sb->owned = 1;
+	}
+	sb->size = n;
+}
+
+static __inline void sbuf_append(sbuf_t *sb, const char *data, unsigned long n)
+{
+	sbuf_reserve(sb, n);
+	memcpy(sb->buffer + sb->len, data, n);
+	sb->len += n;
+	sb->buffer[sb->len] = '\0';
+}
+
+static __inline void sbuf_append_view(sbuf_t *sb, sview_t v)
+{
+	sbuf_append(sb, v.ptr, v.len);
+}
+
+static __inline void sbuf_appendf(sbuf_t *sb, const char *fmt, ...)
+{
+	va_list va;
+	int n;
+
+	sbuf_reserve(sb, 0);
+	va_start(va, fmt);
+	n = vsnprintf(sb->buffer + sb->len, sb->size - sb->len, fmt, va);
+	va_end(va);
+	if (n < 0)
+	{
+		sb->buffer[sb->len] = '\0';
+		return;
+	}
+
+	if ((unsigned long) n >= sb->size - sb->len)
+	{
+		sbuf_reserve(sb, n);
+		va_start(va, fmt);
+		vsnprintf(sb->buffer + sb->len, sb->size - sb->len, fmt, va);
+		va_end(va);
+	}
+	sb->len += n;
+}
+
+/* empty the buffer, keeping its memory for the next use */
+static __inline void sbuf_reset(sbuf_t *sb)
+{
+	sb->len = 0;
+	if (sb->owned && sb->size)
+		sb->buffer[0] = '\0';
+}
+
+static __inline sview_t sbuf_view(const sbuf_t *sb)
+{
+	sview_t v;
+
+	v.ptr = sb->buffer;
+	v.len = sb->len;
+	return v;
+}
+
+static __inline sview_t sview_make(const char *ptr, unsigned long len)
+{
+	sview_t v;
+
+	v.ptr = ptr;
+	v.len = len;
+	return v;
+}
+
+static __inline int sview_eq(sview_t v, const char *str)
+{
+	return (strlen(str) == v.len && !memcmp(v.ptr, str, v.len));
+}
+
+/* strip blanks (space, tab, CR, LF) on both ends */
+static __inline sview_t sview_trim(sview_t v)
+{
+	while (v.len && (*v.ptr == ' ' || *v.ptr == '\t' || *v.ptr == '\r' || *v.ptr == '\n'))
+	{
+		v.ptr++;
+		v.len--;
+	}
+	while (v.len && (v.ptr[v.len - 1] == ' ' || v.ptr[v.len - 1] == '\t' ||
+			 v.ptr[v.len - 1] == '\r' || v.ptr[v.len - 1] == '\n'))
+		v.len--;
+	return v;
+}
+
+/* cut v at the first sep: *head gets what is before, v what is after.
+   Without sep, head is the whole view. Returns 0 once v was empty */
+static __inline int sview_cut(sview_t *v, char sep, sview_t *head)
+{
+	const char *p;
+
+	if (v->len == 0 && v->ptr == NULL)
+		return 0;
+
+	head->ptr = v->ptr;
+	if ((p = (const char *) memchr(v->ptr, sep, v->len)) == NULL)
+	{
+		head->len = v->len;
+		v->ptr = NULL;
+		v->len = 0;
+		return 1;
+	}
+	head->len = p - v->ptr;
+	v->len -= head->len + 1;
+	v->ptr = p + 1;
+	return 1;
+}
+
+/* next token separated by blanks, returns 0 when there is none left */
+static __inline int sview_token(sview_t *v, sview_t *tok)
+{
+	unsigned long i;
+
+	while (v->len && (*v->ptr == ' ' || *v->ptr == '\t'))
+	{
+		v->ptr++;
+		v->len--;
+	}
+	if (v->len == 0)
+		return 0;
+
+	for (i = 0; i < v->len && v->ptr[i] != ' ' && v->ptr[i] != '\t'; i++)
+		;
+	tok->ptr = v->ptr;
+	tok->len = i;
+	v->ptr += i;
+	v->len -= i;
+	return 1;
+}
+
+/* NUL terminated heap copy */
+static __inline char *sview_dup(sview_t v)
+{
+	char *s;
+
+	s = (char *) w_malloc(v.len + 1);
+	memcpy(s, v.ptr, v.len);
+	s[v.len] = '\0';
+	return s;
+}
 /* ----------------------- end sized buffer -------------------- */
 
 /* ----------------------- file routines ----------------------- */
@@ -271,6 +511,7 @@ static __inline char *file_mmap(const char *path, int *size)
     if ((buf = mmap(0, *size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
     {
 	print_err(errno, "Unable to map file (%s) into memory", path);
+	file_close(fd);
 	return NULL;
     }
     file_close(fd);
@@ -303,15 +544,67 @@ static __inline sbuf_t *file_map_load(const char *path)
 	fm = (sbuf_t *) w_malloc(sizeof(sbuf_t));
 	fm->buffer = buffer;
 	fm->size = s;
+	fm->len = s;
+	fm->owned = 0;
+	fm->map = buffer;
+	fm->map_len = s;
 	
 	return fm;
 }
 
+/* Shared writable mapping of path, created or grown to size bytes, the
+   whole file when size is 0. Stores go to the file, appending to the
+   sbuf does not */
+static __inline sbuf_t *file_map_write(const char *path, int size)
+{
+	sbuf_t *fm;
+	struct stat sb;
+	char *buffer;
+	int fd;
+
+	if (path == NULL || size < 0)
+		return NULL;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+	{
+		print_err(errno, "Unable to open file %s", path);
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0 || (size == 0 && (size = sb.st_size) == 0) ||
+	    (sb.st_size < size && ftruncate(fd, size) < 0))
+	{
+		print_err(errno, "Unable to size file %s", path);
+		file_close(fd);
+		return NULL;
+	}
+	if ((buffer = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		print_err(errno, "Unable to map file (%s) into memory", path);
+		file_close(fd);
+		return NULL;
+	}
+	file_close(fd);
+
+	fm = (sbuf_t *) w_malloc(sizeof(sbuf_t));
+	fm->buffer = buffer;
+	fm->size = size;
+	fm->len = size;
+	fm->owned = 0;
+	fm->map = buffer;
+	fm->map_len = size;
+	return fm;
+}
+
+/* the buffer may have been copied to the heap by an append, the
+   mapping is still there */
 static __inline void file_map_unload(sbuf_t *fm)
 {
 	if (fm == NULL) return;
 	
-	file_munmap(fm->buffer, fm->size);
+	if (fm->owned)
+		w_free(fm->buffer);
+	if (fm->map != NULL)
+		file_munmap(fm->map, fm->map_len);
 	w_free(fm);
 }
 /* ------------- end file routines ---------- */
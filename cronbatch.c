@@ -0,0 +1,300 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRON_BATCH_AVX2
+#endif
+
+#include "common.h"
+#include "cronbatch.h"
+
+/* one bit per field, for the time being matched */
+typedef struct cron_batch_bits {
+    u_int32_t min_lo, min_hi, hour, dom, month, dow;
+} cron_batch_bits_t;
+
+typedef void (*cron_batch_kernel_t)(const cron_batch_t *batch, const cron_batch_bits_t *b);
+
+static void cron_batch_grow(cron_batch_t *batch, unsigned long size);
+static int cron_batch_month_length(int year, int mon);
+static void cron_batch_step(struct tm *tm);
+static long long cron_batch_minute(const struct tm *tm);
+static void cron_batch_scalar(const cron_batch_t *batch, const cron_batch_bits_t *b);
+#ifdef CRON_BATCH_AVX2
+static void cron_batch_avx2(const cron_batch_t *batch, const cron_batch_bits_t *b);
+#endif
+
+static cron_batch_kernel_t cron_batch_kernel = NULL;
+
+static void cron_batch_grow(cron_batch_t *batch, unsigned long size)
+{
+    u_int32_t **arrays[7];
+    unsigned long old;
+    int i;
+
+    old = batch->size;
+    arrays[0] = &batch->min_lo;
+    arrays[1] = &batch->min_hi;
+    arrays[2] = &batch->hours;
+    arrays[3] = &batch->dom;
+    arrays[4] = &batch->months;
+    arrays[5] = &batch->dow;
+    arrays[6] = &batch->star;
+    /* padding lanes stay zero and never match */
+    for (i = 0; i < 7; i++)
+    {
+	*arrays[i] = (u_int32_t *) w_realloc(*arrays[i], size * sizeof(u_int32_t));
+	memset(*arrays[i] + old, 0, (size - old) * sizeof(u_int32_t));
+    }
+    batch->matches = (u_int64_t *) w_realloc(batch->matches, ((size + 63) / 64) * sizeof(u_int64_t));
+    batch->size = size;
+}
+
+static int cron_batch_month_length(int year, int mon)
+{
+    static const int len[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+    if (mon == 1 && (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)))
+	return 29;
+    return len[mon];
+}
+
+/* the next minute of the wall clock, without asking the time zone */
+static void cron_batch_step(struct tm *tm)
+{
+    if (++tm->tm_min < 60)
+	return;
+    tm->tm_min = 0;
+    if (++tm->tm_hour < 24)
+	return;
+    tm->tm_hour = 0;
+    tm->tm_wday = (tm->tm_wday + 1) % 7;
+    if (++tm->tm_mday <= cron_batch_month_length(tm->tm_year + 1900, tm->tm_mon))
+	return;
+    tm->tm_mday = 1;
+    if (++tm->tm_mon < 12)
+	return;
+    tm->tm_mon = 0;
+    tm->tm_year++;
+}
+
+/* wall clock minutes in order */
+static long long cron_batch_minute(const struct tm *tm)
+{
+    return ((((long long) tm->tm_year * 12 + tm->tm_mon) * 31 + tm->tm_mday) * 24 +
+	    tm->tm_hour) * 60 + tm->tm_min;
+}
+
+/* 64 jobs per result word */
+static void cron_batch_scalar(const cron_batch_t *batch, const cron_batch_bits_t *b)
+{
+    unsigned long i, n;
+    u_int64_t word;
+    int dom, dow, ok;
+
+    n = (batch->count + 63) / 64;
+    memset(batch->matches, 0, n * sizeof(u_int64_t));
+    for (i = 0; i < batch->count; i++)
+    {
+	ok = ((batch->min_lo[i] & b->min_lo) | (batch->min_hi[i] & b->min_hi)) &&
+	    (batch->hours[i] & b->hour) && (batch->months[i] & b->month);
+	dom = (batch->dom[i] & b->dom) != 0;
+	dow = (batch->dow[i] & b->dow) != 0;
+	ok = ok && (batch->star[i] ? (dom & dow) : (dom | dow));
+	word = (u_int64_t) ok << (i & 63);
+	batch->matches[i / 64] |= word;
+    }
+}
+
+#ifdef CRON_BATCH_AVX2
+/* 8 jobs per vector, the sign bits of the 8 lanes give a byte of result */
+__attribute__((target("avx2")))
+static void cron_batch_avx2(const cron_batch_t *batch, const cron_batch_bits_t *b)
+{
+    __m256i zero, min_lo, min_hi, hour, dom, month, dow, ones;
+    __m256i vmin, vhour, vmonth, vdom, vdow, vstar, vday, vok;
+    unsigned char *out;
+    unsigned long i;
+
+    zero = _mm256_setzero_si256();
+    ones = _mm256_set1_epi32(-1);
+    min_lo = _mm256_set1_epi32((int) b->min_lo);
+    min_hi = _mm256_set1_epi32((int) b->min_hi);
+    hour = _mm256_set1_epi32((int) b->hour);
+    dom = _mm256_set1_epi32((int) b->dom);
+    month = _mm256_set1_epi32((int) b->month);
+    dow = _mm256_set1_epi32((int) b->dow);
+
+    out = (unsigned char *) batch->matches;
+    memset(out, 0, ((batch->size + 63) / 64) * sizeof(u_int64_t));
+    for (i = 0; i < batch->count; i += CRON_BATCH_LANES)
+    {
+	/* lanes are all ones when the field does NOT match */
+	vmin = _mm256_or_si256(
+	    _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (batch->min_lo + i)), min_lo),
+	    _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (batch->min_hi + i)), min_hi));
+	vmin = _mm256_cmpeq_epi32(vmin, zero);
+	vhour = _mm256_cmpeq_epi32(_mm256_and_si256(
+	    _mm256_loadu_si256((const __m256i *) (batch->hours + i)), hour), zero);
+	vmonth = _mm256_cmpeq_epi32(_mm256_and_si256(
+	    _mm256_loadu_si256((const __m256i *) (batch->months + i)), month), zero);
+	vdom = _mm256_cmpeq_epi32(_mm256_and_si256(
+	    _mm256_loadu_si256((const __m256i *) (batch->dom + i)), dom), zero);
+	vdow = _mm256_cmpeq_epi32(_mm256_and_si256(
+	    _mm256_loadu_si256((const __m256i *) (batch->dow + i)), dow), zero);
+	vstar = _mm256_loadu_si256((const __m256i *) (batch->star + i));
+
+	/* day misses: either one misses with a star, both miss without */
+	vday = _mm256_or_si256(_mm256_and_si256(vstar, _mm256_or_si256(vdom, vdow)),
+			       _mm256_andnot_si256(vstar, _mm256_and_si256(vdom, vdow)));
+	vok = _mm256_xor_si256(_mm256_or_si256(_mm256_or_si256(vmin, vhour),
+					       _mm256_or_si256(vmonth, vday)), ones);
+
+	out[i / 8] = (unsigned char) _mm256_movemask_ps(_mm256_castsi256_ps(vok));
+    }
+}
+#endif
+
+cron_batch_t *cron_batch_create(unsigned long hint)
+{
+    cron_batch_t *batch;
+
+    if (cron_batch_kernel == NULL)
+    {
+	cron_batch_kernel = cron_batch_scalar;
+#ifdef CRON_BATCH_AVX2
+	if (__builtin_cpu_supports("avx2"))
+	    cron_batch_kernel = cron_batch_avx2;
+#endif
+    }
+
+    if (hint < 64)
+	hint = 64;
+    batch = (cron_batch_t *) w_malloc(sizeof(cron_batch_t));
+    cron_batch_grow(batch, (hint + CRON_BATCH_LANES - 1) & ~(unsigned long) (CRON_BATCH_LANES - 1));
+    return batch;
+}
+
+void cron_batch_destroy(cron_batch_t *batch)
+{
+    if (batch == NULL)
+	return;
+    w_free(batch->min_lo);
+    w_free(batch->min_hi);
+    w_free(batch->hours);
+    w_free(batch->dom);
+    w_free(batch->months);
+    w_free(batch->dow);
+    w_free(batch->star);
+    w_free(batch->matches);
+    w_free(batch);
+}
+
+/* returns the index of the job in the result bitmap */
+unsigned long cron_batch_add(cron_batch_t *batch, const cron_sched_t *sched)
+{
+    if (batch->count == batch->size)
+	cron_batch_grow(batch, batch->size * 2);
+    cron_batch_set(batch, batch->count, sched);
+    return batch->count++;
+}
+
+/* a NULL sched disables the slot */
+void cron_batch_set(cron_batch_t *batch, unsigned long idx, const cron_sched_t *sched)
+{
+    if (idx >= batch->size)
+	return;
+    if (sched == NULL || (sched->flags & CRON_REBOOT))
+    {
+	batch->min_lo[idx] = batch->min_hi[idx] = batch->hours[idx] = 0;
+	batch->dom[idx] = batch->months[idx] = batch->dow[idx] = batch->star[idx] = 0;
+	return;
+    }
+    batch->min_lo[idx] = (u_int32_t) sched->minutes;
+    batch->min_hi[idx] = (u_int32_t) (sched->minutes >> 32);
+    batch->hours[idx] = sched->hours;
+    batch->dom[idx] = sched->dom;
+    batch->months[idx] = sched->months;
+    batch->dow[idx] = sched->dow;
+    batch->star[idx] = (sched->flags & (CRON_DOM_STAR | CRON_DOW_STAR)) ? ~0U : 0;
+}
+
+/* Match every job against tm, the bitmap is in batch->matches. Returns
+   the number of matching jobs */
+unsigned long cron_batch_match(cron_batch_t *batch, const struct tm *tm)
+{
+    cron_batch_bits_t b;
+    unsigned long i, n;
+
+    if (batch == NULL || tm == NULL)
+	return 0;
+
+    b.min_lo = (tm->tm_min < 32) ? 1U << tm->tm_min : 0;
+    b.min_hi = (tm->tm_min < 32) ? 0 : 1U << (tm->tm_min - 32);
+    b.hour = 1U << tm->tm_hour;
+    b.dom = 1U << (tm->tm_mday - 1);
+    b.month = 1U << tm->tm_mon;
+    b.dow = 1U << tm->tm_wday;
+    cron_batch_kernel(batch, &b);
+
+    n = 0;
+    for (i = 0; i < (batch->count + 63) / 64; i++)
+	n += __builtin_popcountll(batch->matches[i]);
+    return n;
+}
+
+/* Every minute of the wall clock after the one of from, up to the one
+   of to included, with the jobs matching it, like cron_sched_count()
+   counts them: the hour skipped when DST starts is walked as if it
+   existed, the one repeated when it ends once. The minutes are stepped
+   on the calendar, only the matching ones are converted to a time, by
+   cron_mktime() as cron_sched_next() does. fn may disable the slot of
+   the job it is given. Returns the number of runs found */
+unsigned long cron_batch_scan(cron_batch_t *batch, time_t from, time_t to,
+			      cron_batch_fn_t fn, void *arg)
+{
+    struct tm tm;
+    unsigned long i, runs;
+    long long end;
+    u_int64_t word;
+    time_t t;
+
+    if (batch == NULL || fn == NULL || localtime_r(&to, &tm) == NULL)
+	return 0;
+    end = cron_batch_minute(&tm);
+    if (localtime_r(&from, &tm) == NULL)
+	return 0;
+
+    runs = 0;
+    for (cron_batch_step(&tm); cron_batch_minute(&tm) <= end; cron_batch_step(&tm))
+    {
+	if (cron_batch_match(batch, &tm) == 0)
+	    continue;
+	t = cron_mktime(tm.tm_year + 1900, tm.tm_mon, tm.tm_mday - 1, tm.tm_hour, tm.tm_min);
+	for (i = 0; i < (batch->count + 63) / 64; i++)
+	    for (word = batch->matches[i]; word != 0; word &= word - 1)
+	    {
+		fn(i * 64 + __builtin_ctzll(word), t, arg);
+		runs++;
+	    }
+    }
+    return runs;
+}
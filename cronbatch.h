@@ -0,0 +1,63 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __CRONBATCH_H__
+#define __CRONBATCH_H__
+
+#include <time.h>
+
+#include "common.h"
+#include "crontab.h"
+
+/*
+ * Many schedules matched against one time at once, for the cold paths
+ * of the scheduler (startup, clock jumps) where every job must be
+ * tested against a series of minutes. The masks are stored as parallel
+ * arrays of 32 bits words, the minutes split in two, so that a vector
+ * unit tests 8 jobs per instruction. The result is a bitmap, one bit per
+ * job, in the order of cron_batch_add().
+ */
+
+#define CRON_BATCH_LANES 8 /* arrays are padded to a multiple of this */
+
+typedef struct cron_batch {
+    unsigned long count;
+    unsigned long size;
+    u_int32_t *min_lo;  /* minutes 0-31 */
+    u_int32_t *min_hi;  /* minutes 32-59 */
+    u_int32_t *hours;
+    u_int32_t *dom;
+    u_int32_t *months;
+    u_int32_t *dow;
+    u_int32_t *star;    /* ~0 when a day field is a star: days are ANDed */
+    u_int64_t *matches; /* result of the last cron_batch_match() */
+} cron_batch_t;
+
+/* called for each job matching at t */
+typedef void (*cron_batch_fn_t)(unsigned long idx, time_t t, void *arg);
+
+/* ------- API -------- */
+cron_batch_t *cron_batch_create(unsigned long hint);
+void cron_batch_destroy(cron_batch_t *batch);
+unsigned long cron_batch_add(cron_batch_t *batch, const cron_sched_t *sched);
+void cron_batch_set(cron_batch_t *batch, unsigned long idx, const cron_sched_t *sched);
+unsigned long cron_batch_match(cron_batch_t *batch, const struct tm *tm);
+unsigned long cron_batch_scan(cron_batch_t *batch, time_t from, time_t to,
+			      cron_batch_fn_t fn, void *arg);
+
+#endif /* __CRONBATCH_H__ */
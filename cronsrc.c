@@ -0,0 +1,528 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <dirent.h>
+#include <string.h>
+#include <sys/inotify.h>
+
+#include "common.h"
+#include "xhash.h"
+#include "cronsrc.h"
+
+#define CRONSRC_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | \
+			IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* line hash and index, sorted to diff two versions of a file */
+typedef struct cronsrc_key {
+    Fnv64_t hash;
+    unsigned long idx;
+} cronsrc_key_t;
+
+static int cronsrc_file_read(const char *path, sbuf_t **text, Fnv64_t *hash);
+static void cronsrc_file_clear(cronsrc_file_t *file);
+static void cronsrc_file_split(cronsrc_file_t *file);
+static int cronsrc_key_cmp(const void *a, const void *b);
+static cronsrc_key_t *cronsrc_keys(Fnv64_t *hashes, unsigned long n);
+static void cronsrc_diff(cronsrc_t *src, cronsrc_file_t *file, Fnv64_t *old_hashes,
+			 unsigned long old_n);
+static void cronsrc_forget(cronsrc_t *src, cronsrc_file_t *file);
+static int cronsrc_reload(cronsrc_t *src, cronsrc_dir_t *dir, const char *name);
+static int cronsrc_drop_dir(cronsrc_t *src, cronsrc_dir_t *dir);
+static int cronsrc_scan(cronsrc_t *src, cronsrc_dir_t *dir);
+static void cronsrc_rescan(cronsrc_t *src);
+
+/* skip editor and package manager leftovers, like other crons do */
+int cronsrc_name_ok(const char *name)
+{
+    size_t l;
+
+    if (name == NULL || name[0] == '\0' || name[0] == '.')
+	return 0;
+    l = strlen(name);
+    if (name[l - 1] == '~' || strstr(name, ".dpkg-") != NULL ||
+	strstr(name, ".rpm") != NULL || (l > 4 && !strcmp(name + l - 4, ".swp")))
+	return 0;
+    return 1;
+}
+
+/* Map a crontab and hash its content: the FNV kept for a file wherever
+   it is compared, here, in the snapshot and at startup. An empty file
+   gives no map and the hash of nothing. Returns -1 when it cannot be
+   read */
+int cronsrc_file_map(const char *path, sbuf_t **map, Fnv64_t *hash)
+{
+    struct stat sb;
+
+    *map = NULL;
+    *hash = FNV1_64_INIT;
+    if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode))
+	return -1;
+    if (sb.st_size == 0)
+	return 0;
+    if ((*map = file_map_load(path)) == NULL)
+	return -1;
+    *hash = fnv_64_buf((*map)->buffer, (*map)->len, FNV1_64_INIT);
+    return 0;
+}
+
+/* Read a crontab into a buffer of our own, with the same hash as
+   cronsrc_file_map(). The lines are kept between two versions: a
+   mapping of the file would fault once it is truncated and rewritten
+   in place */
+static int cronsrc_file_read(const char *path, sbuf_t **text, Fnv64_t *hash)
+{
+    struct stat sb;
+    sbuf_t *buf;
+    ssize_t r;
+    int fd;
+
+    *text = NULL;
+    *hash = FNV1_64_INIT;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return -1;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode))
+    {
+	close(fd);
+	return -1;
+    }
+
+    /* room for the content, the NUL and one more byte to see the end */
+    SBUF_NEW(buf, sb.st_size + 2);
+    for (;;)
+    {
+	if (buf->len + 2 > buf->size)
+	    sbuf_reserve(buf, 4096);
+	if ((r = read(fd, buf->buffer + buf->len, buf->size - buf->len - 1)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    close(fd);
+	    SBUF_FREE(buf);
+	    return -1;
+	}
+	if (r == 0)
+	    break;
+	buf->len += r;
+    }
+    close(fd);
+
+    if (buf->len == 0)
+    {
+	SBUF_FREE(buf);
+	return 0;
+    }
+    buf->buffer[buf->len] = '\0';
+    *hash = fnv_64_buf(buf->buffer, buf->len, FNV1_64_INIT);
+    *text = buf;
+    return 0;
+}
+
+static void cronsrc_file_clear(cronsrc_file_t *file)
+{
+    if (file->text != NULL)
+	SBUF_FREE(file->text);
+    w_free(file->lines);
+    w_free(file->line_hashes);
+    file->text = NULL;
+    file->lines = NULL;
+    file->line_hashes = NULL;
+    file->nlines = 0;
+}
+
+/* keep lines that mean something: no blank lines, no comments */
+static void cronsrc_file_split(cronsrc_file_t *file)
+{
+    sview_t rest, line;
+    unsigned long alloc;
+
+    file->nlines = 0;
+    file->lines = NULL;
+    file->line_hashes = NULL;
+    if (file->text == NULL)
+	return;
+
+    alloc = 0;
+    rest = sbuf_view(file->text);
+    while (sview_cut(&rest, '\n', &line))
+    {
+	line = sview_trim(line);
+	if (line.len == 0 || line.ptr[0] == '#')
+	    continue;
+
+	if (file->nlines == alloc)
+	{
+	    alloc = alloc ? alloc * 2 : 32;
+	    file->lines = (sview_t *) w_realloc(file->lines, alloc * sizeof(sview_t));
+	    file->line_hashes = (Fnv64_t *) w_realloc(file->line_hashes, alloc * sizeof(Fnv64_t));
+	}
+	file->lines[file->nlines] = line;
+	file->line_hashes[file->nlines] = fnv_64_buf(line.ptr, line.len, FNV1_64_INIT);
+	file->nlines++;
+    }
+}
+
+static int cronsrc_key_cmp(const void *a, const void *b)
+{
+    const cronsrc_key_t *ka = (const cronsrc_key_t *)a;
+    const cronsrc_key_t *kb = (const cronsrc_key_t *)b;
+
+    if (ka->hash != kb->hash)
+	return (ka->hash < kb->hash) ? -1 : 1;
+    /* keep file order among equal lines */
+    return (ka->idx < kb->idx) ? -1 : (ka->idx > kb->idx);
+}
+
+static cronsrc_key_t *cronsrc_keys(Fnv64_t *hashes, unsigned long n)
+{
+    cronsrc_key_t *keys;
+    unsigned long i;
+
+    keys = (cronsrc_key_t *) w_malloc((n ? n : 1) * sizeof(cronsrc_key_t));
+    for (i = 0; i < n; i++)
+    {
+	keys[i].hash = hashes[i];
+	keys[i].idx = i;
+    }
+    qsort(keys, n, sizeof(cronsrc_key_t), cronsrc_key_cmp);
+    return keys;
+}
+
+/* Publish the lines of the new version that are not in the old one and
+   the other way round. Lines are compared as multisets, on their hash:
+   a line that moved is not a change. Removals go first, so that a
+   modified line is seen as removed then added. The old text is freed
+   by then, so removed lines only come with their hash */
+static void cronsrc_diff(cronsrc_t *src, cronsrc_file_t *file, Fnv64_t *old_hashes,
+			 unsigned long old_n)
+{
+    cronsrc_key_t *ok, *nk;
+    unsigned long i, j;
+    char *added;
+
+    ok = cronsrc_keys(old_hashes, old_n);
+    nk = cronsrc_keys(file->line_hashes, file->nlines);
+    added = (char *) w_malloc(file->nlines + 1);
+
+    i = j = 0;
+    while (i < old_n || j < file->nlines)
+    {
+	if (j == file->nlines || (i < old_n && ok[i].hash < nk[j].hash))
+	{
+	    src->cb(file, sview_make(NULL, 0), ok[i].hash, CS_REMOVED, src->arg);
+	    i++;
+	}
+	else if (i == old_n || nk[j].hash < ok[i].hash)
+	{
+	    added[nk[j].idx] = 1;
+	    j++;
+	}
+	else
+	{
+	    i++;
+	    j++;
+	}
+    }
+
+    /* additions in file order */
+    for (j = 0; j < file->nlines; j++)
+	if (added[j])
+	    src->cb(file, file->lines[j], file->line_hashes[j], CS_ADDED, src->arg);
+
+    w_free(added);
+    w_free(nk);
+    w_free(ok);
+}
+
+static void cronsrc_forget(cronsrc_t *src, cronsrc_file_t *file)
+{
+    unsigned long i;
+
+    message(MSG_INFO, 0, "cronsrc: %s removed\n", file->path);
+    for (i = 0; i < file->nlines; i++)
+	src->cb(file, sview_make(NULL, 0), file->line_hashes[i], CS_REMOVED, src->arg);
+
+    cronsrc_file_clear(file);
+    /* the key is file->path: frees both */
+    xhash_remove(src->files, file->path);
+}
+
+/* (re)load dir/name, returns 1 if its content changed */
+static int cronsrc_reload(cronsrc_t *src, cronsrc_dir_t *dir, const char *name)
+{
+    cronsrc_file_t *file;
+    Fnv64_t *old_hashes;
+    unsigned long old_n;
+    char path[PATH_MAX];
+    sbuf_t *text;
+    struct stat sb;
+    Fnv64_t hash;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir->path, name) >= (int) sizeof(path))
+	return -1;
+
+    file = (cronsrc_file_t *) xhash_value(src->files, path);
+
+    if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode))
+    {
+	if (file == NULL)
+	    return 0;
+	cronsrc_forget(src, file);
+	return 1;
+    }
+
+    if (cronsrc_file_read(path, &text, &hash) < 0)
+	return -1;
+
+    /* touched but not modified */
+    if (file != NULL && file->hash == hash)
+    {
+	if (text != NULL)
+	    SBUF_FREE(text);
+	return 0;
+    }
+
+    if (file == NULL)
+    {
+	file = (cronsrc_file_t *) w_malloc(sizeof(cronsrc_file_t));
+	file->path = strdup(path);
+	file->name = file->path + strlen(dir->path) + 1;
+	file->system = dir->system;
+	file->text = NULL;
+	file->nlines = 0;
+	file->lines = NULL;
+	file->line_hashes = NULL;
+	xhash_add(src->files, file->path, file);
+    }
+
+    message(MSG_DEBUG, 0, "cronsrc: loading %s\n", path);
+
+    /* only the line hashes of the old version are still meaningful */
+    old_hashes = file->line_hashes;
+    old_n = file->nlines;
+    file->line_hashes = NULL;
+    cronsrc_file_clear(file);
+
+    file->text = text;
+    file->hash = hash;
+    cronsrc_file_split(file);
+    cronsrc_diff(src, file, old_hashes, old_n);
+    w_free(old_hashes);
+
+    return 1;
+}
+
+/* The directory was removed or moved away: its crontabs are gone with
+   it, and nothing is watched there anymore. Giving its path again to
+   cronsrc_add_dir() watches it again. Returns the number of files */
+static int cronsrc_drop_dir(cronsrc_t *src, cronsrc_dir_t *dir)
+{
+    xhash_iter_t it;
+    cronsrc_file_t *file;
+    size_t l;
+    int count = 0;
+
+    message(MSG_WARN, 0, "cronsrc: %s is gone\n", dir->path);
+    /* after a move the watch is still there, the kernel drops it
+       otherwise, IN_IGNORED then finds no directory */
+    inotify_rm_watch(src->fd, dir->wd);
+    dir->wd = -1;
+
+    l = strlen(dir->path);
+    xhash_iter_init(src->files, &it);
+    while (xhash_iter_next(&it, NULL, (void **)&file))
+	if (!strncmp(file->path, dir->path, l) && file->path[l] == '/')
+	{
+	    cronsrc_forget(src, file);
+	    count++;
+	}
+    return count;
+}
+
+static int cronsrc_scan(cronsrc_t *src, cronsrc_dir_t *dir)
+{
+    DIR *d;
+    struct dirent *de;
+
+    if ((d = opendir(dir->path)) == NULL)
+    {
+	message(MSG_ERR, errno, "cronsrc: unable to open %s", dir->path);
+	return -1;
+    }
+    while ((de = readdir(d)) != NULL)
+	if (cronsrc_name_ok(de->d_name))
+	    cronsrc_reload(src, dir, de->d_name);
+    closedir(d);
+    return 0;
+}
+
+/* events were lost: check every known file, then every directory */
+static void cronsrc_rescan(cronsrc_t *src)
+{
+    xhash_iter_t it;
+    cronsrc_file_t *file;
+    int i;
+
+    message(MSG_WARN, 0, "cronsrc: inotify queue overflow, rescanning\n");
+    xhash_iter_init(src->files, &it);
+    while (xhash_iter_next(&it, NULL, (void **)&file))
+	if (access(file->path, F_OK) < 0)
+	    cronsrc_forget(src, file);
+
+    for (i = 0; i < src->ndirs; i++)
+	if (src->dirs[i].wd >= 0)
+	    cronsrc_scan(src, &src->dirs[i]);
+}
+
+cronsrc_t *cronsrc_create(cronsrc_cb_t cb, void *arg)
+{
+    cronsrc_t *src;
+
+    if (cb == NULL)
+	return NULL;
+
+    src = (cronsrc_t *) w_malloc(sizeof(cronsrc_t));
+    if ((src->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    {
+	message(MSG_ERR, errno, "cronsrc: unable to init inotify");
+	w_free(src);
+	return NULL;
+    }
+    src->cb = cb;
+    src->arg = arg;
+    src->ndirs = 0;
+    src->dirs = NULL;
+    src->files = xhash_init(NULL);
+
+    return src;
+}
+
+int cronsrc_destroy(cronsrc_t *src)
+{
+    xhash_iter_t it;
+    cronsrc_file_t *file;
+    int i;
+
+    if (src == NULL)
+	return -1;
+
+    /* no callback: the caller is going away too */
+    xhash_iter_init(src->files, &it);
+    while (xhash_iter_next(&it, NULL, (void **)&file))
+	cronsrc_file_clear(file);
+    xhash_destroy(src->files);
+
+    for (i = 0; i < src->ndirs; i++)
+	w_free(src->dirs[i].path);
+    w_free(src->dirs);
+    close(src->fd);
+    w_free(src);
+
+    return 0;
+}
+
+/* load every crontab of path and watch it */
+int cronsrc_add_dir(cronsrc_t *src, const char *path, int system)
+{
+    cronsrc_dir_t *dir;
+    int i, wd;
+
+    if (src == NULL || path == NULL)
+	return -1;
+
+    if ((wd = inotify_add_watch(src->fd, path, CRONSRC_EVENTS | IN_ONLYDIR)) < 0)
+    {
+	message(MSG_ERR, errno, "cronsrc: unable to watch %s", path);
+	return -1;
+    }
+
+    /* a directory that was gone and came back */
+    for (i = 0; i < src->ndirs; i++)
+	if (src->dirs[i].wd < 0 && !strcmp(src->dirs[i].path, path))
+	{
+	    dir = &src->dirs[i];
+	    dir->wd = wd;
+	    dir->system = system;
+	    return cronsrc_scan(src, dir);
+	}
+
+    src->dirs = (cronsrc_dir_t *) w_realloc(src->dirs, (src->ndirs + 1) * sizeof(cronsrc_dir_t));
+    dir = &src->dirs[src->ndirs++];
+    dir->wd = wd;
+    dir->system = system;
+    dir->path = strdup(path);
+
+    return cronsrc_scan(src, dir);
+}
+
+int cronsrc_fd(cronsrc_t *src)
+{
+    return (src != NULL) ? src->fd : -1;
+}
+
+/* handle pending events, returns the number of files that changed */
+int cronsrc_process(cronsrc_t *src)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    int i, changed;
+
+    if (src == NULL)
+	return -1;
+
+    changed = 0;
+    while ((len = read(src->fd, buf, sizeof(buf))) > 0)
+    {
+	for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+	{
+	    ev = (struct inotify_event *)p;
+
+	    if (ev->mask & IN_Q_OVERFLOW)
+	    {
+		cronsrc_rescan(src);
+		changed++;
+		continue;
+	    }
+	    for (i = 0; i < src->ndirs; i++)
+		if (src->dirs[i].wd == ev->wd)
+		    break;
+	    if (i == src->ndirs)
+		continue;
+
+	    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+	    {
+		changed += cronsrc_drop_dir(src, &src->dirs[i]);
+		continue;
+	    }
+	    if (ev->len == 0 || !cronsrc_name_ok(ev->name))
+		continue;
+
+	    /* deleted and moved away files are missing on reload */
+	    if (cronsrc_reload(src, &src->dirs[i], ev->name) > 0)
+		changed++;
+	}
+    }
+
+    if (len < 0 && errno != EAGAIN && errno != EINTR)
+    {
+	message(MSG_ERR, errno, "cronsrc: unable to read inotify events");
+	return -1;
+    }
+    return changed;
+}
@@ -0,0 +1,80 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __CRONSRC_H__
+#define __CRONSRC_H__
+
+#include "common.h"
+#include "xhash.h"
+
+/*
+ * Crontab sources: directories of crontabs (/etc/cron.d, the user spool)
+ * watched with inotify. When a file changes it is read again and its
+ * lines compared to the previous version, and only the lines that
+ * appeared or disappeared are given to the callback. Nothing runs while
+ * nothing changes: the caller polls cronsrc_fd() and calls
+ * cronsrc_process() when it is readable.
+ */
+
+typedef enum {
+    CS_ADDED, CS_REMOVED
+} cronsrc_change_t;
+
+/* One crontab file */
+typedef struct cronsrc_file {
+    char *path;
+    const char *name;   /* points in path: the user for a spool crontab */
+    int system;         /* lines have a user field (/etc/crontab, cron.d) */
+    sbuf_t *text;       /* copy of the content, NULL for an empty file */
+    Fnv64_t hash;       /* FNV of the content, stable across runs */
+    unsigned long nlines;
+    sview_t *lines;     /* meaningful lines, in text */
+    Fnv64_t *line_hashes;
+} cronsrc_file_t;
+
+/* Lines are identified by their hash. An added line points in the copy
+   of the file and is only valid during the call; a removed line is
+   empty, its text is not available anymore */
+typedef void (*cronsrc_cb_t)(cronsrc_file_t *file, sview_t line, Fnv64_t hash,
+			     cronsrc_change_t change, void *arg);
+
+typedef struct cronsrc_dir {
+    int wd;             /* -1 once the directory is gone */
+    int system;
+    char *path;
+} cronsrc_dir_t;
+
+typedef struct cronsrc {
+    int fd;             /* inotify */
+    cronsrc_cb_t cb;
+    void *arg;
+    int ndirs;
+    cronsrc_dir_t *dirs;
+    xhash_t *files;     /* path -> cronsrc_file_t */
+} cronsrc_t;
+
+/* ------- API -------- */
+cronsrc_t *cronsrc_create(cronsrc_cb_t cb, void *arg);
+int cronsrc_destroy(cronsrc_t *src);
+int cronsrc_add_dir(cronsrc_t *src, const char *path, int system);
+int cronsrc_fd(cronsrc_t *src);
+int cronsrc_process(cronsrc_t *src);
+int cronsrc_name_ok(const char *name);
+int cronsrc_file_map(const char *path, sbuf_t **map, Fnv64_t *hash);
+
+#endif /* __CRONSRC_H__ */
@@ -0,0 +1,641 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common.h"
+#include "crontab.h"
+
+static const char *cron_month_names[] = {
+    "jan", "feb", "mar", "apr", "may", "jun",
+    "jul", "aug", "sep", "oct", "nov", "dec", NULL
+};
+
+static const char *cron_dow_names[] = {
+    "sun", "mon", "tue", "wed", "thu", "fri", "sat", NULL
+};
+
+/* @alias and the five fields it stands for */
+static const struct {
+    const char *name;
+    const char *fields;
+} cron_aliases[] = {
+    { "@yearly", "0 0 1 1 *" },
+    { "@annually", "0 0 1 1 *" },
+    { "@monthly", "0 0 1 * *" },
+    { "@weekly", "0 0 * * 0" },
+    { "@daily", "0 0 * * *" },
+    { "@midnight", "0 0 * * *" },
+    { "@hourly", "0 * * * *" },
+    { NULL, NULL }
+};
+
+static int cron_value_parse(sview_t *v, int base, const char **names, int *value);
+static int cron_field_parse(sview_t field, int min, int max, const char **names,
+			    int base, u_int64_t *bits);
+static int cron_env_line(sview_t line);
+static int cron_bit_next(u_int64_t mask, int pos);
+static int cron_month_length(int year, int mon);
+static u_int32_t cron_month_days(const cron_sched_t *sched, int year, int mon);
+
+/* a number or, when names are given, a 3 letters name, first one is base */
+static int cron_value_parse(sview_t *v, int base, const char **names, int *value)
+{
+    int i;
+
+    if (v->len && isdigit((unsigned char) *v->ptr))
+    {
+	*value = 0;
+	while (v->len && isdigit((unsigned char) *v->ptr))
+	{
+	    *value = *value * 10 + (*v->ptr - '0');
+	    if (*value > 1000)
+		return -1;
+	    v->ptr++;
+	    v->len--;
+	}
+	return 0;
+    }
+
+    if (names == NULL || v->len < 3)
+	return -1;
+    for (i = 0; names[i] != NULL; i++)
+	if (!strncasecmp(v->ptr, names[i], 3))
+	{
+	    *value = base + i;
+	    v->ptr += 3;
+	    v->len -= 3;
+	    return 0;
+	}
+    return -1;
+}
+
+/* Comma separated list of *, N or N-M, each with an optional /step.
+   N/step means N-max/step. Bit 0 of bits is min */
+static int cron_field_parse(sview_t field, int min, int max, const char **names,
+			    int base, u_int64_t *bits)
+{
+    sview_t item;
+    int lo, hi, step, i;
+
+    *bits = 0;
+    while (sview_cut(&field, ',', &item))
+    {
+	step = 1;
+	if (item.len && *item.ptr == '*')
+	{
+	    lo = min;
+	    hi = max;
+	    item.ptr++;
+	    item.len--;
+	}
+	else
+	{
+	    if (cron_value_parse(&item, base, names, &lo) < 0)
+		return -1;
+	    hi = lo;
+	    if (item.len && *item.ptr == '-')
+	    {
+		item.ptr++;
+		item.len--;
+		if (cron_value_parse(&item, base, names, &hi) < 0)
+		    return -1;
+	    }
+	    else if (item.len && *item.ptr == '/')
+		hi = max;
+	}
+
+	if (item.len && *item.ptr == '/')
+	{
+	    item.ptr++;
+	    item.len--;
+	    if (cron_value_parse(&item, 0, NULL, &step) < 0 || step == 0)
+		return -1;
+	}
+
+	if (item.len || lo < min || hi > max || lo > hi)
+	    return -1;
+
+	for (i = lo; i <= hi; i += step)
+	    *bits |= 1ULL << (i - min);
+    }
+    return (*bits != 0) ? 0 : -1;
+}
+
+/* Parse the schedule at the start of line, which is left on what
+   follows it. Returns -1 when it is not a valid schedule */
+int cron_sched_parse(sview_t *line, cron_sched_t *sched)
+{
+    sview_t tok, fields[5], alias;
+    u_int64_t bits;
+    int i;
+
+    if (line == NULL || sched == NULL)
+	return -1;
+
+    memset(sched, 0, sizeof(cron_sched_t));
+    if (!sview_token(line, &tok))
+	return -1;
+
+    if (*tok.ptr == '@')
+    {
+	if (sview_eq(tok, "@reboot"))
+	{
+	    sched->flags = CRON_REBOOT;
+	    return 0;
+	}
+	for (i = 0; cron_aliases[i].name != NULL; i++)
+	    if (sview_eq(tok, cron_aliases[i].name))
+		break;
+	if (cron_aliases[i].name == NULL)
+	    return -1;
+
+	alias = sview_make(cron_aliases[i].fields, strlen(cron_aliases[i].fields));
+	return cron_sched_parse(&alias, sched);
+    }
+
+    fields[0] = tok;
+    for (i = 1; i < 5; i++)
+	if (!sview_token(line, &fields[i]))
+	    return -1;
+
+    if (cron_field_parse(fields[0], 0, 59, NULL, 0, &bits) < 0)
+	return -1;
+    sched->minutes = bits;
+    if (cron_field_parse(fields[1], 0, 23, NULL, 0, &bits) < 0)
+	return -1;
+    sched->hours = (u_int32_t) bits;
+    if (cron_field_parse(fields[2], 1, 31, NULL, 0, &bits) < 0)
+	return -1;
+    sched->dom = (u_int32_t) bits;
+    if (cron_field_parse(fields[3], 1, 12, cron_month_names, 1, &bits) < 0)
+	return -1;
+    sched->months = (u_int16_t) bits;
+    /* 7 is sunday too */
+    if (cron_field_parse(fields[4], 0, 7, cron_dow_names, 0, &bits) < 0)
+	return -1;
+    sched->dow = (u_int8_t) ((bits | (bits >> 7)) & 0x7f);
+
+    if (*fields[2].ptr == '*')
+	sched->flags |= CRON_DOM_STAR;
+    if (*fields[4].ptr == '*')
+	sched->flags |= CRON_DOW_STAR;
+
+    return 0;
+}
+
+/* lowest bit set in mask at pos or above, -1 if none */
+static int cron_bit_next(u_int64_t mask, int pos)
+{
+    if (pos >= 64)
+	return -1;
+    mask &= ~0ULL << pos;
+    return mask ? __builtin_ctzll(mask) : -1;
+}
+
+static int cron_month_length(int year, int mon)
+{
+    static const int len[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+    if (mon == 1 && (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)))
+	return 29;
+    return len[mon];
+}
+
+/* Days of the month allowed by both day fields, bit 0 is the 1st. The
+   week mask is rotated to the weekday of the 1st and repeated over the
+   month instead of testing days one by one */
+static u_int32_t cron_month_days(const cron_sched_t *sched, int year, int mon)
+{
+    static const int t[12] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+    u_int32_t week, dow_days, days;
+    int y, wday1;
+
+    /* Sakamoto's day of week of the 1st */
+    y = year - (mon < 2);
+    wday1 = (y + y / 4 - y / 100 + y / 400 + t[mon] + 1) % 7;
+
+    week = ((sched->dow | ((u_int32_t) sched->dow << 7)) >> wday1) & 0x7f;
+    dow_days = week | week << 7 | week << 14 | week << 21 | week << 28;
+
+    if (sched->flags & (CRON_DOM_STAR | CRON_DOW_STAR))
+	days = sched->dom & dow_days;
+    else
+	days = sched->dom | dow_days;
+    return days & (u_int32_t) ((1ULL << cron_month_length(year, mon)) - 1);
+}
+
+/* The time of a minute of the wall clock, year as 1900 + tm_year, mon
+   and day from 0. mktime() gives either one of the two minutes of the
+   hour repeated when DST ends, depending on what it was asked before:
+   this is always the first one, so that a schedule gives the same times
+   whoever computes them. A minute skipped when DST starts is moved
+   forward, as mktime() does */
+time_t cron_mktime(int year, int mon, int day, int hour, int min)
+{
+    struct tm tm, alt;
+    time_t t, u;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = mon;
+    tm.tm_mday = day + 1;
+    tm.tm_hour = hour;
+    tm.tm_min = min;
+    tm.tm_isdst = -1;
+    alt = tm;
+    if ((t = mktime(&tm)) == -1 || !daylight || tm.tm_isdst != 0)
+	return t;
+
+    /* standard time, the same minute may have been in DST just before */
+    alt.tm_isdst = 1;
+    if ((u = mktime(&alt)) != -1 && u < t && alt.tm_hour == hour && alt.tm_min == min &&
+	alt.tm_mday == day + 1)
+	return u;
+    return t;
+}
+
+/* First time strictly after after, in local time, when sched matches.
+   Each field jumps to its next allowed value with a bit scan, so the
+   search costs a few steps per calendar unit skipped, not one per
+   minute. Returns -1 for @reboot or a schedule that never matches (like
+   the 30th of february) */
+time_t cron_sched_next(const cron_sched_t *sched, time_t after)
+{
+    struct tm tm;
+    time_t t;
+    int year, last, mon, day, hour, min, i;
+
+    if (sched == NULL || (sched->flags & CRON_REBOOT) || localtime_r(&after, &tm) == NULL)
+	return -1;
+
+    year = tm.tm_year + 1900;
+    mon = tm.tm_mon;
+    day = tm.tm_mday - 1;
+    hour = tm.tm_hour;
+    min = tm.tm_min + 1;
+
+    /* the calendar repeats itself every 28 years between 1901 and 2099 */
+    last = year + 28;
+    while (year <= last)
+    {
+	if ((i = cron_bit_next(sched->months, mon)) < 0)
+	{
+	    year++;
+	    mon = day = hour = min = 0;
+	    continue;
+	}
+	if (i != mon)
+	{
+	    mon = i;
+	    day = hour = min = 0;
+	}
+
+	if ((i = cron_bit_next(cron_month_days(sched, year, mon), day)) < 0)
+	{
+	    mon++;
+	    day = hour = min = 0;
+	    continue;
+	}
+	if (i != day)
+	{
+	    day = i;
+	    hour = min = 0;
+	}
+
+	if ((i = cron_bit_next(sched->hours, hour)) < 0)
+	{
+	    day++;
+	    hour = min = 0;
+	    continue;
+	}
+	if (i != hour)
+	{
+	    hour = i;
+	    min = 0;
+	}
+
+	if ((i = cron_bit_next(sched->minutes, min)) < 0)
+	{
+	    hour++;
+	    min = 0;
+	    continue;
+	}
+	min = i;
+
+	if ((t = cron_mktime(year, mon, day, hour, min)) > after)
+	    return t;
+
+	/* the hour repeated when DST ends, already done */
+	min++;
+    }
+    return -1;
+}
+
+/* highest bit set in mask at pos or below, -1 if none */
+static int cron_bit_prev(u_int64_t mask, int pos)
+{
+    if (pos < 0)
+	return -1;
+    if (pos < 63)
+	mask &= (1ULL << (pos + 1)) - 1;
+    return mask ? 63 - __builtin_clzll(mask) : -1;
+}
+
+/* Last time strictly before before when sched matches, the same walk
+   as cron_sched_next() backwards. -1 when there is none */
+time_t cron_sched_prev(const cron_sched_t *sched, time_t before)
+{
+    struct tm tm;
+    time_t t;
+    int year, first, mon, day, hour, min, i;
+
+    if (sched == NULL || (sched->flags & CRON_REBOOT) || localtime_r(&before, &tm) == NULL)
+	return -1;
+
+    year = tm.tm_year + 1900;
+    mon = tm.tm_mon;
+    day = tm.tm_mday - 1;
+    hour = tm.tm_hour;
+    /* a match in the current minute is only before when seconds passed */
+    min = tm.tm_sec ? tm.tm_min : tm.tm_min - 1;
+
+    first = year - 28;
+    while (year >= first)
+    {
+	if ((i = cron_bit_prev(sched->months, mon)) < 0)
+	{
+	    year--;
+	    mon = 11;
+	    day = 30;
+	    hour = 23;
+	    min = 59;
+	    continue;
+	}
+	if (i != mon)
+	{
+	    mon = i;
+	    day = 30;
+	    hour = 23;
+	    min = 59;
+	}
+
+	if ((i = cron_bit_prev(cron_month_days(sched, year, mon), day)) < 0)
+	{
+	    mon--;
+	    day = 30;
+	    hour = 23;
+	    min = 59;
+	    continue;
+	}
+	if (i != day)
+	{
+	    day = i;
+	    hour = 23;
+	    min = 59;
+	}
+
+	if ((i = cron_bit_prev(sched->hours, hour)) < 0)
+	{
+	    day--;
+	    hour = 23;
+	    min = 59;
+	    continue;
+	}
+	if (i != hour)
+	{
+	    hour = i;
+	    min = 59;
+	}
+
+	if ((i = cron_bit_prev(sched->minutes, min)) < 0)
+	{
+	    hour--;
+	    min = 59;
+	    continue;
+	}
+	min = i;
+
+	if ((t = cron_mktime(year, mon, day, hour, min)) < before)
+	    return t;
+
+	/* skipped when DST starts, mktime() moved it forward */
+	min--;
+    }
+    return -1;
+}
+
+/* matches in a matching day between the minutes of the day lo excluded
+   and hi included */
+static long cron_day_count(const cron_sched_t *sched, int lo, int hi)
+{
+    u_int64_t mask;
+    long n = 0;
+    int h, a, b;
+
+    for (h = cron_bit_next(sched->hours, 0); h >= 0; h = cron_bit_next(sched->hours, h + 1))
+    {
+	a = lo - h * 60 + 1;
+	b = hi - h * 60;
+	if (a < 0)
+	    a = 0;
+	if (b > 59)
+	    b = 59;
+	if (a > b)
+	    continue;
+	mask = (~0ULL << a) & ((1ULL << (b + 1)) - 1);
+	n += __builtin_popcountll(sched->minutes & mask);
+    }
+    return n;
+}
+
+static int cron_day_match(const cron_sched_t *sched, const struct tm *tm)
+{
+    return ((sched->months >> tm->tm_mon) & 1) &&
+	((cron_month_days(sched, tm->tm_year + 1900, tm->tm_mon) >> (tm->tm_mday - 1)) & 1);
+}
+
+/* Number of times sched matches after from, up to to included, without
+   walking them: the days in between are counted a month at a time with
+   a popcount of the month days, times the matches of a day. Counted on
+   the wall clock: the hour skipped when DST starts counts as if it
+   existed, the one repeated when it ends counts once */
+long cron_sched_count(const cron_sched_t *sched, time_t from, time_t to)
+{
+    struct tm a, b;
+    long n, per_day;
+    u_int32_t days;
+    int fa, fb, year, mon, lo, hi;
+
+    if (sched == NULL || (sched->flags & CRON_REBOOT) || to <= from ||
+	localtime_r(&from, &a) == NULL || localtime_r(&to, &b) == NULL)
+	return 0;
+
+    fa = a.tm_hour * 60 + a.tm_min;
+    fb = b.tm_hour * 60 + b.tm_min;
+    if (a.tm_year == b.tm_year && a.tm_mon == b.tm_mon && a.tm_mday == b.tm_mday)
+	return cron_day_match(sched, &a) ? cron_day_count(sched, fa, fb) : 0;
+
+    n = 0;
+    if (cron_day_match(sched, &a))
+	n += cron_day_count(sched, fa, 24 * 60 - 1);
+    if (cron_day_match(sched, &b))
+	n += cron_day_count(sched, -1, fb);
+
+    /* whole days in between, bit i is day i + 1 */
+    per_day = cron_day_count(sched, -1, 24 * 60 - 1);
+    year = a.tm_year + 1900;
+    mon = a.tm_mon;
+    while (year < b.tm_year + 1900 || (year == b.tm_year + 1900 && mon <= b.tm_mon))
+    {
+	if ((sched->months >> mon) & 1)
+	{
+	    lo = (year == a.tm_year + 1900 && mon == a.tm_mon) ? a.tm_mday : 0;
+	    hi = (year == b.tm_year + 1900 && mon == b.tm_mon) ? b.tm_mday - 2 : 30;
+	    if (lo <= hi)
+	    {
+		days = cron_month_days(sched, year, mon) &
+		    (u_int32_t) ((~0ULL << lo) & ((1ULL << (hi + 1)) - 1));
+		n += __builtin_popcount(days) * per_day;
+	    }
+	}
+	if (++mon == 12)
+	{
+	    mon = 0;
+	    year++;
+	}
+    }
+    return n;
+}
+
+/* NAME=value, possibly with blanks around the = */
+static int cron_env_line(sview_t line)
+{
+    unsigned long i;
+
+    if (line.len == 0 || !(isalpha((unsigned char) *line.ptr) || *line.ptr == '_'))
+	return 0;
+    for (i = 0; i < line.len; i++)
+    {
+	if (line.ptr[i] == '=')
+	    return 1;
+	if (!isalnum((unsigned char) line.ptr[i]) && line.ptr[i] != '_' &&
+	    line.ptr[i] != ' ' && line.ptr[i] != '\t')
+	    return 0;
+    }
+    return 0;
+}
+
+/* Compile one meaningful line (trimmed, not a comment). A system crontab
+   has a user field before the command. Returns NULL for invalid lines
+   and environment settings, which are not jobs */
+cron_job_t *cron_job_parse(sview_t line, int system)
+{
+    cron_job_t *job;
+    cron_sched_t sched;
+    sview_t rest, user;
+
+    line = sview_trim(line);
+    if (line.len == 0 || *line.ptr == '#' || cron_env_line(line))
+	return NULL;
+
+    rest = line;
+    if (cron_sched_parse(&rest, &sched) < 0)
+	return NULL;
+
+    user = sview_make(NULL, 0);
+    if (system && !sview_token(&rest, &user))
+	return NULL;
+
+    rest = sview_trim(rest);
+    if (rest.len == 0)
+	return NULL;
+
+    job = (cron_job_t *) w_malloc(sizeof(cron_job_t));
+    job->next = NULL;
+    job->sched = sched;
+    job->hash = fnv_64_buf(line.ptr, line.len, FNV1_64_INIT);
+    job->user = system ? sview_dup(user) : NULL;
+    job->command = sview_dup(rest);
+
+    return job;
+}
+
+void cron_job_free(cron_job_t *job)
+{
+    if (job == NULL)
+	return;
+    w_free(job->user);
+    w_free(job->command);
+    w_free(job);
+}
+
+/* the jobs in the text of a crontab, path only names it in warnings */
+cron_jobs_t *crontab_parse(const char *path, sview_t text, int system)
+{
+    cron_jobs_t *jobs;
+    cron_job_t *job;
+    sview_t line;
+    int lineno;
+
+    NEW_XLIST(jobs, cron_jobs_t);
+    lineno = 0;
+    while (sview_cut(&text, '\n', &line))
+    {
+	lineno++;
+	line = sview_trim(line);
+	if (line.len == 0 || *line.ptr == '#' || cron_env_line(line))
+	    continue;
+
+	if ((job = cron_job_parse(line, system)) == NULL)
+	{
+	    message(MSG_WARN, 0, "crontab: %s:%d: invalid line ignored\n", path, lineno);
+	    continue;
+	}
+	INSERT_XLIST(jobs, job);
+    }
+    return jobs;
+}
+
+/* all the jobs of a crontab, the file is only mapped while parsing */
+cron_jobs_t *crontab_load(const char *path, int system)
+{
+    cron_jobs_t *jobs;
+    sbuf_t *map;
+    int size;
+
+    if (path == NULL || file_stat(path, &size) != 0)
+	return NULL;
+
+    /* an empty file cannot be mapped */
+    if (size == 0)
+	return crontab_parse(path, sview_make(NULL, 0), system);
+
+    if ((map = file_map_load(path)) == NULL)
+	return NULL;
+    jobs = crontab_parse(path, sbuf_view(map), system);
+    file_map_unload(map);
+    return jobs;
+}
+
+void crontab_free(cron_jobs_t *jobs)
+{
+    FREE_XLIST(jobs, cron_job_t, cron_job_free);
+}
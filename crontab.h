@@ -0,0 +1,87 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __CRONTAB_H__
+#define __CRONTAB_H__
+
+#include <time.h>
+
+#include "common.h"
+#include "xhash.h"
+#include "xlist.h"
+
+/*
+ * A schedule is compiled to one bit per allowed value, stars, ranges,
+ * steps, names and @aliases are expanded by the parser. Bit 0 of each
+ * mask is the lowest value of the field, so that the fields of a struct
+ * tm are used as is: tm_mday - 1, tm_mon, tm_wday (sunday is 0, a 7 in
+ * the crontab is folded to 0).
+ */
+typedef struct cron_sched {
+    u_int64_t minutes;  /* 0-59 */
+    u_int32_t hours;    /* 0-23 */
+    u_int32_t dom;      /* 1-31 */
+    u_int16_t months;   /* 1-12 */
+    u_int8_t dow;       /* 0-6 */
+    u_int8_t flags;
+} cron_sched_t;
+
+#define CRON_DOM_STAR 0x01 /* day of month field starts with a '*' */
+#define CRON_DOW_STAR 0x02 /* day of week field starts with a '*' */
+#define CRON_REBOOT   0x04 /* @reboot, never matches a time */
+
+typedef struct cron_job {
+    struct cron_job *next;
+    cron_sched_t sched;
+    Fnv64_t hash;       /* of the trimmed line, the same as cronsrc */
+    char *user;         /* NULL in a user crontab */
+    char *command;
+} cron_job_t;
+
+DEF_XLIST(cron_jobs, cron_job_t)
+
+/* When both day fields are restricted, a day matching either of them is
+   enough, like vixie-cron does */
+static __inline int cron_sched_match(const cron_sched_t *sched, const struct tm *tm)
+{
+    int dom, dow;
+
+    if (!((sched->minutes >> tm->tm_min) & (sched->hours >> tm->tm_hour) &
+	  (sched->months >> tm->tm_mon) & 1))
+	return 0;
+
+    dom = (sched->dom >> (tm->tm_mday - 1)) & 1;
+    dow = (sched->dow >> tm->tm_wday) & 1;
+    if (sched->flags & (CRON_DOM_STAR | CRON_DOW_STAR))
+	return dom & dow;
+    return dom | dow;
+}
+
+/* ------- API -------- */
+int cron_sched_parse(sview_t *line, cron_sched_t *sched);
+time_t cron_mktime(int year, int mon, int day, int hour, int min);
+time_t cron_sched_next(const cron_sched_t *sched, time_t after);
+time_t cron_sched_prev(const cron_sched_t *sched, time_t before);
+long cron_sched_count(const cron_sched_t *sched, time_t from, time_t to);
+cron_job_t *cron_job_parse(sview_t line, int system);
+void cron_job_free(cron_job_t *job);
+cron_jobs_t *crontab_parse(const char *path, sview_t text, int system);
+cron_jobs_t *crontab_load(const char *path, int system);
+void crontab_free(cron_jobs_t *jobs);
+
+#endif /* __CRONTAB_H__ */
@@ -0,0 +1,679 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "gossip.h"
+
+/*
+ * Datagram, integers in network order:
+ *   type (1), seq (4), target address (4) and port (2), count (1)
+ *   then count updates: state (1), incarnation (4), address (4), port (2)
+ * The target is the member an ack is for, or to ping for a PING_REQ.
+ */
+#define GOSSIP_MTU       512
+#define GOSSIP_HEADER    12
+#define GOSSIP_UPDATE    11
+#define GOSSIP_PIGGYBACK 6  /* updates on a ping or an ack */
+#define GOSSIP_RETRANSMIT 3 /* times log2(n) each update is sent */
+
+typedef enum {
+    GM_PING = 1, GM_ACK, GM_PING_REQ, GM_JOIN, GM_SYNC
+} gossip_msg_t;
+
+static int gossip_addr_eq(const struct sockaddr_in *a, const struct sockaddr_in *b);
+static unsigned int gossip_addr_hash(const struct sockaddr_in *a);
+static int gossip_lookup(gossip_t *g, const struct sockaddr_in *addr);
+static void gossip_reindex(gossip_t *g);
+static int gossip_member_add(gossip_t *g, const struct sockaddr_in *addr,
+			     gossip_state_t state, u_int32_t incarnation);
+static int gossip_log2(int n);
+static void gossip_enqueue(gossip_t *g, const struct sockaddr_in *addr,
+			   gossip_state_t state, u_int32_t incarnation);
+static int gossip_apply(gossip_t *g, const struct sockaddr_in *addr,
+			gossip_state_t state, u_int32_t incarnation, u_int64_t now);
+static unsigned char *gossip_put_update(unsigned char *p, const struct sockaddr_in *addr,
+					gossip_state_t state, u_int32_t incarnation);
+static void gossip_send(gossip_t *g, const struct sockaddr_in *to, gossip_msg_t type,
+			u_int32_t seq, const struct sockaddr_in *target);
+static void gossip_send_sync(gossip_t *g, const struct sockaddr_in *to);
+static void gossip_send_state(gossip_t *g, const gossip_member_t *m);
+static int gossip_pick(gossip_t *g);
+static void gossip_handle(gossip_t *g, const unsigned char *buf, ssize_t len,
+			  const struct sockaddr_in *from, u_int64_t now);
+
+static int gossip_addr_eq(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static unsigned int gossip_addr_hash(const struct sockaddr_in *a)
+{
+    u_int64_t k;
+
+    k = ((u_int64_t) a->sin_addr.s_addr << 16) | a->sin_port;
+    return (unsigned int) ((k * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static int gossip_lookup(gossip_t *g, const struct sockaddr_in *addr)
+{
+    unsigned int h;
+    int i;
+
+    for (h = gossip_addr_hash(addr) & (g->index_size - 1); (i = g->index[h]) != 0;
+	 h = (h + 1) & (g->index_size - 1))
+	if (gossip_addr_eq(&g->members[i - 1].addr, addr))
+	    return i - 1;
+    return -1;
+}
+
+static void gossip_reindex(gossip_t *g)
+{
+    unsigned int h;
+    int i;
+
+    w_free(g->index);
+    g->index = (int *) w_malloc(g->index_size * sizeof(int));
+    for (i = 0; i < g->nmembers; i++)
+    {
+	for (h = gossip_addr_hash(&g->members[i].addr) & (g->index_size - 1); g->index[h] != 0;
+	     h = (h + 1) & (g->index_size - 1))
+	    ;
+	g->index[h] = i + 1;
+    }
+}
+
+static int gossip_member_add(gossip_t *g, const struct sockaddr_in *addr,
+			     gossip_state_t state, u_int32_t incarnation)
+{
+    gossip_member_t *m;
+    int i, j;
+
+    if (g->nmembers == g->size)
+    {
+	g->size = g->size ? g->size * 2 : 16;
+	g->members = (gossip_member_t *) w_realloc(g->members, g->size * sizeof(gossip_member_t));
+	g->order = (int *) w_realloc(g->order, g->size * sizeof(int));
+    }
+    i = g->nmembers++;
+    m = &g->members[i];
+    memset(m, 0, sizeof(gossip_member_t));
+    m->addr = *addr;
+    m->state = state;
+    m->incarnation = incarnation;
+
+    if ((unsigned int) g->nmembers * 2 > g->index_size)
+    {
+	g->index_size *= 2;
+	gossip_reindex(g);
+    }
+    else
+    {
+	unsigned int h;
+
+	for (h = gossip_addr_hash(addr) & (g->index_size - 1); g->index[h] != 0;
+	     h = (h + 1) & (g->index_size - 1))
+	    ;
+	g->index[h] = i + 1;
+    }
+
+    /* somewhere in what is left of this round */
+    g->order[g->norder++] = i;
+    j = g->next + rand_r(&g->rand) % (g->norder - g->next);
+    g->order[g->norder - 1] = g->order[j];
+    g->order[j] = i;
+    return i;
+}
+
+static int gossip_log2(int n)
+{
+    int l = 1;
+
+    while ((1 << l) < n + 1)
+	l++;
+    return l;
+}
+
+/* a newer update about the same member replaces the older one */
+static void gossip_enqueue(gossip_t *g, const struct sockaddr_in *addr,
+			   gossip_state_t state, u_int32_t incarnation)
+{
+    gossip_update_t *u;
+    int i;
+
+    for (i = 0; i < g->nupdates; i++)
+	if (gossip_addr_eq(&g->updates[i].addr, addr))
+	    break;
+    if (i == g->nupdates)
+    {
+	if (g->nupdates == g->updates_size)
+	{
+	    g->updates_size = g->updates_size ? g->updates_size * 2 : 16;
+	    g->updates = (gossip_update_t *) w_realloc(g->updates,
+						       g->updates_size * sizeof(gossip_update_t));
+	}
+	g->nupdates++;
+    }
+    u = &g->updates[i];
+    u->addr = *addr;
+    u->state = state;
+    u->incarnation = incarnation;
+    u->sent = 0;
+}
+
+/* Merge what we heard about a member, with the SWIM precedence on the
+   incarnation. Returns 1 when it changed something */
+static int gossip_apply(gossip_t *g, const struct sockaddr_in *addr,
+			gossip_state_t state, u_int32_t incarnation, u_int64_t now)
+{
+    gossip_member_t *m;
+    int i, changed;
+
+    /* suspected: refute with a higher incarnation */
+    if (gossip_addr_eq(addr, &g->self))
+    {
+	if (state != GS_ALIVE && incarnation >= g->incarnation)
+	{
+	    g->incarnation = incarnation + 1;
+	    gossip_enqueue(g, &g->self, GS_ALIVE, g->incarnation);
+	}
+	return 0;
+    }
+
+    if ((i = gossip_lookup(g, addr)) < 0)
+    {
+	i = gossip_member_add(g, addr, state, incarnation);
+	m = &g->members[i];
+	if (state == GS_SUSPECT)
+	{
+	    m->suspect_at = now;
+	    g->suspects++;
+	}
+	gossip_enqueue(g, addr, state, incarnation);
+	if (g->change != NULL)
+	    g->change(m, g->arg);
+	return 1;
+    }
+
+    m = &g->members[i];
+    if (state == GS_ALIVE)
+	changed = incarnation > m->incarnation;
+    else if (state == GS_SUSPECT)
+	changed = (m->state == GS_ALIVE && incarnation >= m->incarnation) ||
+	    incarnation > m->incarnation;
+    else
+	changed = (m->state != GS_DEAD && incarnation >= m->incarnation) ||
+	    incarnation > m->incarnation;
+    if (!changed)
+	return 0;
+
+    if (m->state == GS_SUSPECT)
+	g->suspects--;
+    if (state == GS_SUSPECT)
+    {
+	m->suspect_at = now;
+	g->suspects++;
+    }
+    m->state = state;
+    m->incarnation = incarnation;
+    gossip_enqueue(g, addr, state, incarnation);
+    if (g->change != NULL)
+	g->change(m, g->arg);
+    return 1;
+}
+
+static unsigned char *gossip_put_update(unsigned char *p, const struct sockaddr_in *addr,
+					gossip_state_t state, u_int32_t incarnation)
+{
+    u_int32_t n;
+
+    *p++ = (unsigned char) state;
+    n = htonl(incarnation);
+    memcpy(p, &n, 4);
+    memcpy(p + 4, &addr->sin_addr.s_addr, 4);
+    memcpy(p + 8, &addr->sin_port, 2);
+    return p + 10;
+}
+
+/* the header, then the updates sent the least so far */
+static void gossip_send(gossip_t *g, const struct sockaddr_in *to, gossip_msg_t type,
+			u_int32_t seq, const struct sockaddr_in *target)
+{
+    unsigned char buf[GOSSIP_MTU], *p;
+    gossip_update_t *u;
+    int count, i, j, best, limit;
+    u_int32_t n;
+
+    buf[0] = (unsigned char) type;
+    n = htonl(seq);
+    memcpy(buf + 1, &n, 4);
+    if (target != NULL)
+    {
+	memcpy(buf + 5, &target->sin_addr.s_addr, 4);
+	memcpy(buf + 9, &target->sin_port, 2);
+    }
+    else
+	memset(buf + 5, 0, 6);
+
+    p = buf + GOSSIP_HEADER;
+    for (count = 0; count < GOSSIP_PIGGYBACK && count < g->nupdates; count++)
+    {
+	/* selection: the first count ones are done */
+	best = count;
+	for (j = count + 1; j < g->nupdates; j++)
+	    if (g->updates[j].sent < g->updates[best].sent)
+		best = j;
+	if (best != count)
+	{
+	    gossip_update_t tmp = g->updates[count];
+	    g->updates[count] = g->updates[best];
+	    g->updates[best] = tmp;
+	}
+	u = &g->updates[count];
+	p = gossip_put_update(p, &u->addr, u->state, u->incarnation);
+	u->sent++;
+    }
+    buf[11] = (unsigned char) count;
+
+    /* forget what was said enough */
+    limit = GOSSIP_RETRANSMIT * gossip_log2(g->nmembers + 1);
+    for (i = j = 0; i < g->nupdates; i++)
+	if (g->updates[i].sent < limit)
+	    g->updates[j++] = g->updates[i];
+    g->nupdates = j;
+
+    if (sendto(g->fd, buf, p - buf, 0, (const struct sockaddr *) to, sizeof(*to)) > 0)
+	g->msg_sent++;
+}
+
+/* everything we know, for a member that joins through us */
+static void gossip_send_sync(gossip_t *g, const struct sockaddr_in *to)
+{
+    unsigned char buf[GOSSIP_MTU], *p;
+    gossip_member_t *m;
+    int i, count;
+
+    memset(buf, 0, GOSSIP_HEADER);
+    buf[0] = GM_SYNC;
+    p = gossip_put_update(buf + GOSSIP_HEADER, &g->self, GS_ALIVE, g->incarnation);
+    count = 1;
+    for (i = 0; i <= g->nmembers; i++)
+    {
+	if (count == (GOSSIP_MTU - GOSSIP_HEADER) / GOSSIP_UPDATE || i == g->nmembers)
+	{
+	    buf[11] = (unsigned char) count;
+	    if (sendto(g->fd, buf, p - buf, 0, (const struct sockaddr *) to, sizeof(*to)) > 0)
+		g->msg_sent++;
+	    p = buf + GOSSIP_HEADER;
+	    count = 0;
+	}
+	if (i == g->nmembers)
+	    break;
+	m = &g->members[i];
+	if (m->state == GS_DEAD || gossip_addr_eq(&m->addr, to))
+	    continue;
+	p = gossip_put_update(p, &m->addr, m->state, m->incarnation);
+	count++;
+    }
+}
+
+/* what we think of m, to m itself, so that it can refute */
+static void gossip_send_state(gossip_t *g, const gossip_member_t *m)
+{
+    unsigned char buf[GOSSIP_HEADER + GOSSIP_UPDATE];
+
+    memset(buf, 0, GOSSIP_HEADER);
+    buf[0] = GM_SYNC;
+    buf[11] = 1;
+    gossip_put_update(buf + GOSSIP_HEADER, &m->addr, m->state, m->incarnation);
+    if (sendto(g->fd, buf, sizeof(buf), 0, (const struct sockaddr *) &m->addr, sizeof(m->addr)) > 0)
+	g->msg_sent++;
+}
+
+/* next member to probe, the order is shuffled again after each round */
+static int gossip_pick(gossip_t *g)
+{
+    int tries, i, j, tmp;
+
+    for (tries = 0; tries <= g->norder; tries++)
+    {
+	if (g->next >= g->norder)
+	{
+	    for (i = g->norder - 1; i > 0; i--)
+	    {
+		j = rand_r(&g->rand) % (i + 1);
+		tmp = g->order[i];
+		g->order[i] = g->order[j];
+		g->order[j] = tmp;
+	    }
+	    g->next = 0;
+	}
+	if (g->norder == 0)
+	    return -1;
+	i = g->order[g->next++];
+	if (g->members[i].state != GS_DEAD)
+	    return i;
+    }
+    return -1;
+}
+
+static void gossip_handle(gossip_t *g, const unsigned char *buf, ssize_t len,
+			  const struct sockaddr_in *from, u_int64_t now)
+{
+    struct sockaddr_in target, addr;
+    gossip_relay_t *r, *oldest;
+    u_int32_t seq, n;
+    const unsigned char *p;
+    int count, i;
+
+    if (len < GOSSIP_HEADER)
+	return;
+    memcpy(&n, buf + 1, 4);
+    seq = ntohl(n);
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    memcpy(&target.sin_addr.s_addr, buf + 5, 4);
+    memcpy(&target.sin_port, buf + 9, 2);
+
+    /* whoever talks to us is alive */
+    if (gossip_lookup(g, from) < 0)
+	gossip_apply(g, from, GS_ALIVE, 0, now);
+
+    count = buf[11];
+    if (len < GOSSIP_HEADER + count * GOSSIP_UPDATE)
+	return;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    for (i = 0, p = buf + GOSSIP_HEADER; i < count; i++, p += GOSSIP_UPDATE)
+    {
+	if (p[0] > GS_DEAD)
+	    continue;
+	memcpy(&n, p + 1, 4);
+	memcpy(&addr.sin_addr.s_addr, p + 5, 4);
+	memcpy(&addr.sin_port, p + 9, 2);
+	gossip_apply(g, &addr, (gossip_state_t) p[0], ntohl(n), now);
+    }
+
+    /* a member we hold for suspect or dead talks to us, a restart on the
+       same address for instance: it may not know, and would never raise
+       its incarnation above the one we have */
+    if ((i = gossip_lookup(g, from)) >= 0 && g->members[i].state != GS_ALIVE)
+	gossip_send_state(g, &g->members[i]);
+
+    switch ((gossip_msg_t) buf[0])
+    {
+    case GM_PING:
+	gossip_send(g, from, GM_ACK, seq, &g->self);
+	break;
+
+    case GM_ACK:
+	if (g->probing >= 0 && seq == g->probe_seq)
+	{
+	    g->probe_acked = 1;
+	    break;
+	}
+	/* an ack for a ping we made for someone else */
+	for (i = 0; i < GOSSIP_RELAYS; i++)
+	{
+	    r = &g->relays[i];
+	    if (r->expires > now && r->seq == seq)
+	    {
+		gossip_send(g, &r->requester, GM_ACK, r->their_seq, &r->target);
+		r->expires = 0;
+		break;
+	    }
+	}
+	break;
+
+    case GM_PING_REQ:
+	oldest = &g->relays[0];
+	for (i = 0; i < GOSSIP_RELAYS; i++)
+	    if (g->relays[i].expires < oldest->expires)
+		oldest = &g->relays[i];
+	oldest->seq = ++g->seq;
+	oldest->their_seq = seq;
+	oldest->requester = *from;
+	oldest->target = target;
+	oldest->expires = now + g->period;
+	gossip_send(g, &target, GM_PING, oldest->seq, NULL);
+	break;
+
+    case GM_JOIN:
+	gossip_send_sync(g, from);
+	break;
+
+    case GM_SYNC:
+	break;
+    }
+}
+
+u_int64_t gossip_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Bind host:port, host NULL for any local address, and probe a member
+   every period ms. advertise is the address the other members reach us
+   at and the one this node is known by in the cluster: it may only be
+   NULL when host is a single address, which is then advertised */
+gossip_t *gossip_create(const char *host, const char *advertise, int port, int period,
+			gossip_change_t change, void *arg)
+{
+    struct sockaddr_in local;
+    gossip_t *g;
+    socklen_t len;
+
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (host != NULL && inet_pton(AF_INET, host, &local.sin_addr) != 1)
+    {
+	message(MSG_ERR, 0, "gossip: bad address %s\n", host);
+	return NULL;
+    }
+
+    g = (gossip_t *) w_malloc(sizeof(gossip_t));
+    g->self = local;
+    if (advertise != NULL && inet_pton(AF_INET, advertise, &g->self.sin_addr) != 1)
+    {
+	message(MSG_ERR, 0, "gossip: bad address %s\n", advertise);
+	w_free(g);
+	return NULL;
+    }
+    if (g->self.sin_addr.s_addr == htonl(INADDR_ANY))
+    {
+	message(MSG_ERR, 0, "gossip: no address to advertise\n");
+	w_free(g);
+	return NULL;
+    }
+
+    if ((g->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+	message(MSG_ERR, errno, "gossip: unable to create socket");
+	w_free(g);
+	return NULL;
+    }
+    if (bind(g->fd, (struct sockaddr *) &local, sizeof(local)) < 0)
+    {
+	message(MSG_ERR, errno, "gossip: unable to bind port %d", port);
+	close(g->fd);
+	w_free(g);
+	return NULL;
+    }
+    /* the port the system picked when given 0 */
+    len = sizeof(local);
+    getsockname(g->fd, (struct sockaddr *) &local, &len);
+    g->self.sin_port = local.sin_port;
+
+    g->rand = (unsigned int) (gossip_now() ^ ntohs(g->self.sin_port) ^ getpid());
+    g->index_size = 32;
+    g->index = (int *) w_malloc(g->index_size * sizeof(int));
+    g->probing = -1;
+    g->period = (period > 0) ? period : 1000;
+    g->ack_timeout = g->period / 4;
+    g->indirect = 3;
+    g->suspect_mult = 4;
+    g->change = change;
+    g->arg = arg;
+    return g;
+}
+
+void gossip_destroy(gossip_t *g)
+{
+    if (g == NULL)
+	return;
+    close(g->fd);
+    w_free(g->members);
+    w_free(g->order);
+    w_free(g->index);
+    w_free(g->updates);
+    w_free(g);
+}
+
+/* enter the cluster through a member of it */
+int gossip_join(gossip_t *g, const char *host, int port, u_int64_t now)
+{
+    struct sockaddr_in seed;
+
+    memset(&seed, 0, sizeof(seed));
+    seed.sin_family = AF_INET;
+    seed.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &seed.sin_addr) != 1)
+    {
+	message(MSG_ERR, 0, "gossip: bad address %s\n", host);
+	return -1;
+    }
+
+    gossip_enqueue(g, &g->self, GS_ALIVE, g->incarnation);
+    gossip_send(g, &seed, GM_JOIN, 0, NULL);
+    return 0;
+}
+
+int gossip_fd(gossip_t *g)
+{
+    return g->fd;
+}
+
+/* handle every datagram waiting, returns how many */
+int gossip_recv(gossip_t *g, u_int64_t now)
+{
+    unsigned char buf[GOSSIP_MTU];
+    struct sockaddr_in from;
+    socklen_t len;
+    ssize_t r;
+    int n = 0;
+
+    while (1)
+    {
+	len = sizeof(from);
+	if ((r = recvfrom(g->fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &len)) < 0)
+	    break;
+	g->msg_recv++;
+	gossip_handle(g, buf, r, &from, now);
+	n++;
+    }
+    return n;
+}
+
+/* run the timers due at now */
+int gossip_tick(gossip_t *g, u_int64_t now)
+{
+    gossip_member_t *m, *target;
+    u_int64_t timeout;
+    int i, tries, sent;
+
+    /* no direct ack: ask others to try */
+    if (g->probing >= 0 && !g->probe_acked && !g->probe_indirect && now >= g->probe_deadline)
+    {
+	target = &g->members[g->probing];
+	for (sent = tries = 0; sent < g->indirect && tries < 3 * g->indirect && g->nmembers > 1; tries++)
+	{
+	    i = rand_r(&g->rand) % g->nmembers;
+	    m = &g->members[i];
+	    if (i == g->probing || m->state != GS_ALIVE)
+		continue;
+	    gossip_send(g, &m->addr, GM_PING_REQ, g->probe_seq, &target->addr);
+	    sent++;
+	}
+	g->probe_indirect = 1;
+    }
+
+    if (now >= g->next_period)
+    {
+	if (g->probing >= 0 && !g->probe_acked)
+	{
+	    m = &g->members[g->probing];
+	    if (m->state == GS_ALIVE)
+		gossip_apply(g, &m->addr, GS_SUSPECT, m->incarnation, now);
+	}
+
+	g->probing = -1;
+	if ((i = gossip_pick(g)) >= 0)
+	{
+	    g->probing = i;
+	    g->probe_seq = ++g->seq;
+	    g->probe_acked = 0;
+	    g->probe_indirect = 0;
+	    g->probe_deadline = now + g->ack_timeout;
+	    gossip_send(g, &g->members[i].addr, GM_PING, g->probe_seq, NULL);
+	}
+	g->next_period = now + g->period;
+    }
+
+    if (g->suspects > 0)
+    {
+	timeout = (u_int64_t) g->suspect_mult * gossip_log2(g->nmembers + 1) * g->period;
+	for (i = 0; i < g->nmembers; i++)
+	{
+	    m = &g->members[i];
+	    if (m->state == GS_SUSPECT && now >= m->suspect_at + timeout)
+		gossip_apply(g, &m->addr, GS_DEAD, m->incarnation, now);
+	}
+    }
+    return 0;
+}
+
+/* ms until gossip_tick() has something to do */
+int gossip_timeout(gossip_t *g, u_int64_t now)
+{
+    u_int64_t next;
+
+    next = g->next_period;
+    if (g->probing >= 0 && !g->probe_acked && !g->probe_indirect && g->probe_deadline < next)
+	next = g->probe_deadline;
+    return (next > now) ? (int) (next - now) : 0;
+}
+
+/* alive members, ourselves not included */
+int gossip_alive(gossip_t *g)
+{
+    int i, n = 0;
+
+    for (i = 0; i < g->nmembers; i++)
+	if (g->members[i].state == GS_ALIVE)
+	    n++;
+    return n;
+}
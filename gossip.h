@@ -0,0 +1,129 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __GOSSIP_H__
+#define __GOSSIP_H__
+
+#include <netinet/in.h>
+
+#include "common.h"
+
+/*
+ * Membership and failure detection between nodes, SWIM style, over
+ * UDP. Every protocol period a node pings one member, taken in a
+ * shuffled round robin; without an ack it asks a few others to ping it
+ * for us, then suspects it. A suspect that does not refute (by raising
+ * its incarnation) in time is declared dead. Changes are not broadcast:
+ * they ride on the pings and acks, each one a bounded number of times,
+ * so a node sends a constant number of small packets per period
+ * whatever the size of the cluster.
+ *
+ * The caller owns the loop: poll gossip_fd(), call gossip_recv() when it
+ * is readable and gossip_tick() when gossip_timeout() expires. Times are
+ * milliseconds of CLOCK_MONOTONIC.
+ */
+
+typedef enum {
+    GS_ALIVE, GS_SUSPECT, GS_DEAD
+} gossip_state_t;
+
+typedef struct gossip_member {
+    struct sockaddr_in addr;
+    gossip_state_t state;
+    u_int32_t incarnation;
+    u_int64_t suspect_at;
+} gossip_member_t;
+
+/* a change waiting to be piggybacked */
+typedef struct gossip_update {
+    struct sockaddr_in addr;
+    gossip_state_t state;
+    u_int32_t incarnation;
+    int sent;
+} gossip_update_t;
+
+/* a PING sent on behalf of another member */
+typedef struct gossip_relay {
+    u_int32_t seq;
+    u_int32_t their_seq;
+    struct sockaddr_in requester;
+    struct sockaddr_in target;
+    u_int64_t expires;
+} gossip_relay_t;
+
+#define GOSSIP_RELAYS 16
+
+/* a member changed state, new members arrive as GS_ALIVE */
+typedef void (*gossip_change_t)(const gossip_member_t *m, void *arg);
+
+typedef struct gossip {
+    int fd;
+    struct sockaddr_in self;
+    u_int32_t incarnation;
+    unsigned int rand;
+
+    gossip_member_t *members;   /* never removed, the dead stay */
+    int nmembers;
+    int size;
+    int *index;                 /* open addressing on the address */
+    unsigned int index_size;
+
+    int *order;                 /* probe round robin */
+    int norder;
+    int next;
+
+    gossip_update_t *updates;
+    int nupdates;
+    int updates_size;
+
+    u_int32_t seq;
+    int probing;                /* member index, -1 when none */
+    u_int32_t probe_seq;
+    int probe_acked;
+    int probe_indirect;
+    u_int64_t probe_deadline;
+    u_int64_t next_period;
+    int suspects;
+
+    gossip_relay_t relays[GOSSIP_RELAYS];
+
+    int period;                 /* ms */
+    int ack_timeout;            /* ms */
+    int indirect;               /* members asked to ping for us */
+    int suspect_mult;
+
+    gossip_change_t change;
+    void *arg;
+
+    unsigned long msg_sent;
+    unsigned long msg_recv;
+} gossip_t;
+
+/* ------- API -------- */
+gossip_t *gossip_create(const char *host, const char *advertise, int port, int period,
+			gossip_change_t change, void *arg);
+void gossip_destroy(gossip_t *g);
+int gossip_join(gossip_t *g, const char *host, int port, u_int64_t now);
+int gossip_fd(gossip_t *g);
+int gossip_recv(gossip_t *g, u_int64_t now);
+int gossip_tick(gossip_t *g, u_int64_t now);
+int gossip_timeout(gossip_t *g, u_int64_t now);
+int gossip_alive(gossip_t *g);
+u_int64_t gossip_now(void);
+
+#endif /* __GOSSIP_H__ */
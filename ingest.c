@@ -0,0 +1,356 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "ingest.h"
+#include "jobsnap.h"
+#include "cronsrc.h"
+
+typedef struct ingest_worker {
+    ingest_t *ing;
+    int id;
+} ingest_worker_t;
+
+static int ingest_file_cmp(const void *a, const void *b);
+static void ingest_list(ingest_t *ing, unsigned long d);
+static void ingest_parse(ingest_file_t *file);
+static int ingest_steal(ingest_t *ing, int id);
+static void *ingest_list_routine(void *arg);
+static void *ingest_parse_routine(void *arg);
+static int ingest_spawn(ingest_t *ing, void *(*routine)(void *));
+
+static int ingest_file_cmp(const void *a, const void *b)
+{
+    return strcmp(((const ingest_file_t *) a)->path, ((const ingest_file_t *) b)->path);
+}
+
+static void ingest_list(ingest_t *ing, unsigned long d)
+{
+    DIR *dir;
+    struct dirent *de;
+    ingest_file_t *files = NULL;
+    unsigned long n = 0, size = 0;
+    char path[PATH_MAX];
+
+    if ((dir = opendir(ing->dirs[d])) == NULL)
+    {
+	message(MSG_ERR, errno, "ingest: unable to open %s", ing->dirs[d]);
+	return;
+    }
+    while ((de = readdir(dir)) != NULL)
+    {
+	if (!cronsrc_name_ok(de->d_name) ||
+	    snprintf(path, sizeof(path), "%s/%s", ing->dirs[d], de->d_name) >= (int) sizeof(path))
+	    continue;
+	if (n == size)
+	{
+	    size = size ? size * 2 : 64;
+	    files = (ingest_file_t *) w_realloc(files, size * sizeof(ingest_file_t));
+	}
+	memset(&files[n], 0, sizeof(ingest_file_t));
+	files[n].path = strdup(path);
+	files[n].system = ing->system[d];
+	n++;
+    }
+    closedir(dir);
+
+    if (n)
+	qsort(files, n, sizeof(ingest_file_t), ingest_file_cmp);
+    ing->listed[d] = files;
+    ing->nlisted[d] = n;
+}
+
+static void ingest_parse(ingest_file_t *file)
+{
+    sbuf_t *map;
+    Fnv64_t hash;
+
+    /* the hash stays 0 for a file that cannot be read */
+    if (cronsrc_file_map(file->path, &map, &hash) < 0)
+	return;
+    file->hash = hash;
+    file->jobs = crontab_parse(file->path, map ? sbuf_view(map) : sview_make(NULL, 0), file->system);
+    file_map_unload(map);
+}
+
+/* move the back half of the largest range to ours, 0 when all is done */
+static int ingest_steal(ingest_t *ing, int id)
+{
+    ingest_range_t *victim, *mine = &ing->ranges[id];
+    unsigned long best, left, half, hi;
+    int i, v;
+
+    while (1)
+    {
+	v = -1;
+	best = 0;
+	for (i = 0; i < ing->nthreads; i++)
+	{
+	    /* a look without the locks is enough to choose, the ranges
+	       are only stored to atomically for that */
+	    left = __atomic_load_n(&ing->ranges[i].hi, __ATOMIC_RELAXED) -
+		__atomic_load_n(&ing->ranges[i].lo, __ATOMIC_RELAXED);
+	    if (i != id && left > best && left < (unsigned long) LONG_MAX)
+	    {
+		best = left;
+		v = i;
+	    }
+	}
+	if (v < 0)
+	    return 0;
+
+	victim = &ing->ranges[v];
+	pthread_mutex_lock(&victim->mutex);
+	if (victim->hi > victim->lo)
+	{
+	    half = (victim->hi - victim->lo + 1) / 2;
+	    hi = victim->hi;
+	    __atomic_store_n(&victim->hi, hi - half, __ATOMIC_RELAXED);
+	    pthread_mutex_unlock(&victim->mutex);
+	    /* never two locks at once: thieves may pick each other */
+	    pthread_mutex_lock(&mine->mutex);
+	    __atomic_store_n(&mine->lo, hi - half, __ATOMIC_RELAXED);
+	    __atomic_store_n(&mine->hi, hi, __ATOMIC_RELAXED);
+	    pthread_mutex_unlock(&mine->mutex);
+	    __atomic_fetch_add(&ing->stolen, 1, __ATOMIC_RELAXED);
+	    return 1;
+	}
+	pthread_mutex_unlock(&victim->mutex);
+    }
+}
+
+static void *ingest_list_routine(void *arg)
+{
+    ingest_worker_t *w = (ingest_worker_t *) arg;
+    ingest_t *ing = w->ing;
+    unsigned long d;
+
+    while (1)
+    {
+	pthread_mutex_lock(&ing->dirs_mutex);
+	d = ing->next_dir++;
+	pthread_mutex_unlock(&ing->dirs_mutex);
+	if (d >= (unsigned long) ing->ndirs)
+	    break;
+	ingest_list(ing, d);
+    }
+    return NULL;
+}
+
+static void *ingest_parse_routine(void *arg)
+{
+    ingest_worker_t *w = (ingest_worker_t *) arg;
+    ingest_t *ing = w->ing;
+    ingest_range_t *mine = &ing->ranges[w->id];
+    unsigned long i;
+
+    do
+    {
+	while (1)
+	{
+	    pthread_mutex_lock(&mine->mutex);
+	    if (mine->lo >= mine->hi)
+	    {
+		pthread_mutex_unlock(&mine->mutex);
+		break;
+	    }
+	    i = mine->lo;
+	    __atomic_store_n(&mine->lo, i + 1, __ATOMIC_RELAXED);
+	    pthread_mutex_unlock(&mine->mutex);
+	    ingest_parse(&ing->files[i]);
+	}
+    } while (ingest_steal(ing, w->id));
+    return NULL;
+}
+
+/* run routine on every thread of the pool and wait for them */
+static int ingest_spawn(ingest_t *ing, void *(*routine)(void *))
+{
+    pthread_t *threads;
+    ingest_worker_t *workers;
+    pthread_attr_t attr;
+    int i, started, err;
+
+    threads = (pthread_t *) w_malloc(ing->nthreads * sizeof(pthread_t));
+    workers = (ingest_worker_t *) w_malloc(ing->nthreads * sizeof(ingest_worker_t));
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    /* this thread works too */
+    for (started = 1; started < ing->nthreads; started++)
+    {
+	workers[started].ing = ing;
+	workers[started].id = started;
+	if ((err = pthread_create(&threads[started], &attr, routine, &workers[started])) != 0)
+	{
+	    message(MSG_WARN, err, "ingest: unable to create thread");
+	    break;
+	}
+    }
+    pthread_attr_destroy(&attr);
+    workers[0].ing = ing;
+    workers[0].id = 0;
+    routine(&workers[0]);
+    for (i = 1; i < started; i++)
+	pthread_join(threads[i], NULL);
+
+    w_free(workers);
+    w_free(threads);
+    return 0;
+}
+
+/* Load every crontab of the directories with nthreads threads, 0 for
+   one per CPU. Returns NULL when nothing could be listed */
+ingest_t *ingest_run(const char **dirs, const int *system, int ndirs, int nthreads)
+{
+    ingest_t *ing;
+    unsigned long i, per, n;
+    int d, t;
+    cron_job_t *job;
+
+    if (dirs == NULL || system == NULL || ndirs <= 0)
+	return NULL;
+    if (nthreads <= 0 && (nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+	nthreads = 1;
+
+    ing = (ingest_t *) w_malloc(sizeof(ingest_t));
+    ing->dirs = dirs;
+    ing->system = system;
+    ing->ndirs = ndirs;
+    ing->nthreads = nthreads;
+    ing->listed = (ingest_file_t **) w_malloc(ndirs * sizeof(ingest_file_t *));
+    ing->nlisted = (unsigned long *) w_malloc(ndirs * sizeof(unsigned long));
+    pthread_mutex_init(&ing->dirs_mutex, NULL);
+    ingest_spawn(ing, ingest_list_routine);
+    pthread_mutex_destroy(&ing->dirs_mutex);
+
+    /* directories in the order given, each one sorted */
+    for (d = 0, n = 0; d < ndirs; d++)
+	n += ing->nlisted[d];
+    ing->files = (ingest_file_t *) w_malloc((n ? n : 1) * sizeof(ingest_file_t));
+    for (d = 0; d < ndirs; d++)
+    {
+	if (ing->nlisted[d])
+	    memcpy(ing->files + ing->nfiles, ing->listed[d], ing->nlisted[d] * sizeof(ingest_file_t));
+	ing->nfiles += ing->nlisted[d];
+	w_free(ing->listed[d]);
+    }
+    w_free(ing->listed);
+    w_free(ing->nlisted);
+    ing->listed = NULL;
+    ing->nlisted = NULL;
+
+    ing->ranges = (ingest_range_t *) w_malloc(nthreads * sizeof(ingest_range_t));
+    per = (ing->nfiles + nthreads - 1) / nthreads;
+    for (t = 0; t < nthreads; t++)
+    {
+	pthread_mutex_init(&ing->ranges[t].mutex, NULL);
+	ing->ranges[t].lo = (t * per < ing->nfiles) ? t * per : ing->nfiles;
+	ing->ranges[t].hi = ((t + 1) * per < ing->nfiles) ? (t + 1) * per : ing->nfiles;
+    }
+    ingest_spawn(ing, ingest_parse_routine);
+    for (t = 0; t < nthreads; t++)
+	pthread_mutex_destroy(&ing->ranges[t].mutex);
+    w_free(ing->ranges);
+    ing->ranges = NULL;
+
+    for (i = 0; i < ing->nfiles; i++)
+	if (ing->files[i].jobs != NULL)
+	    FOR_XLIST(job, ing->files[i].jobs)
+		ing->njobs++;
+    return ing;
+}
+
+void ingest_free(ingest_t *ing)
+{
+    unsigned long i;
+
+    if (ing == NULL)
+	return;
+    for (i = 0; i < ing->nfiles; i++)
+    {
+	crontab_free(ing->files[i].jobs);
+	w_free(ing->files[i].path);
+    }
+    w_free(ing->files);
+    w_free(ing);
+}
+
+/* Queue every job parsed on sched. The data of an entry is its
+   cron_job_t: ing is kept as long as the entries are queued. Returns
+   the entries, njobs of them, NULL on error */
+sched_entry_t *ingest_schedule(ingest_t *ing, scheduler_t *sched, time_t now)
+{
+    sched_entry_t *entries;
+    cron_job_t *job;
+    unsigned long i, n;
+
+    if (ing == NULL || sched == NULL)
+	return NULL;
+
+    entries = (sched_entry_t *) w_malloc((ing->njobs ? ing->njobs : 1) * sizeof(sched_entry_t));
+    for (i = 0, n = 0; i < ing->nfiles; i++)
+    {
+	if (ing->files[i].jobs == NULL)
+	    continue;
+	FOR_XLIST(job, ing->files[i].jobs)
+	{
+	    sched_entry_init(&entries[n], &job->sched, job);
+	    entries[n].key = job->hash;
+	    entries[n].next = SCHED_UNSET;
+	    n++;
+	}
+    }
+    if (scheduler_load(sched, entries, n, now) < 0)
+    {
+	w_free(entries);
+	return NULL;
+    }
+    return entries;
+}
+
+/* Snapshot what was parsed, for the next start. An unreadable file goes
+   in with a hash of 0 and no jobs: it stays fresh while it cannot be
+   read and is parsed again once it can */
+int ingest_save(ingest_t *ing, const char *path, time_t now)
+{
+    jobsnap_source_t *sources;
+    unsigned long i;
+    int ret;
+
+    if (ing == NULL || path == NULL)
+	return -1;
+
+    sources = (jobsnap_source_t *) w_malloc((ing->nfiles ? ing->nfiles : 1) * sizeof(jobsnap_source_t));
+    for (i = 0; i < ing->nfiles; i++)
+    {
+	sources[i].path = ing->files[i].path;
+	sources[i].system = ing->files[i].system;
+	sources[i].hash = ing->files[i].hash;
+	sources[i].jobs = ing->files[i].jobs;
+    }
+    ret = jobsnap_save(path, sources, (int) ing->nfiles, now);
+    w_free(sources);
+    return ret;
+}
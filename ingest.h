@@ -0,0 +1,77 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __INGEST_H__
+#define __INGEST_H__
+
+#include <pthread.h>
+
+#include "common.h"
+#include "xhash.h"
+#include "crontab.h"
+#include "scheduler.h"
+
+/*
+ * Parallel loading of the crontabs at startup. A pool of threads first
+ * lists the directories, one task per directory, then maps, hashes and
+ * parses the files found. Each thread owns a range of the files and
+ * takes them from the front; an idle thread steals the back half of the
+ * largest range left. Results land in the slot of their file and files
+ * are sorted by directory then name, so the job table is the same
+ * whatever the number of threads and whoever parsed what.
+ */
+
+typedef struct ingest_file {
+    char *path;
+    int system;
+    Fnv64_t hash;           /* of the content, as cronsrc computes it */
+    cron_jobs_t *jobs;      /* NULL when it could not be read */
+} ingest_file_t;
+
+typedef struct ingest_range {
+    pthread_mutex_t mutex;
+    unsigned long lo;
+    unsigned long hi;
+} ingest_range_t;
+
+typedef struct ingest {
+    int ndirs;
+    const char **dirs;
+    const int *system;
+    unsigned long next_dir; /* taken under dirs_mutex */
+    pthread_mutex_t dirs_mutex;
+    ingest_file_t **listed; /* per directory */
+    unsigned long *nlisted;
+
+    ingest_file_t *files;
+    unsigned long nfiles;
+    unsigned long njobs;
+
+    int nthreads;
+    ingest_range_t *ranges;
+    unsigned long stolen;
+} ingest_t;
+
+/* ------- API -------- */
+ingest_t *ingest_run(const char **dirs, const int *system, int ndirs, int nthreads);
+void ingest_free(ingest_t *ing);
+sched_entry_t *ingest_schedule(ingest_t *ing, scheduler_t *sched, time_t now);
+int ingest_save(ingest_t *ing, const char *path, time_t now);
+
+#endif /* __INGEST_H__ */
@@ -0,0 +1,552 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "common.h"
+#include "jobsnap.h"
+#include "cronsrc.h"
+
+static u_int32_t jobsnap_intern(sbuf_t *strings, const char *str);
+static jobsnap_parsed_t *jobsnap_parse(jobsnap_t *snap, const char *path, int system, long file,
+				       time_t now);
+
+static u_int32_t jobsnap_intern(sbuf_t *strings, const char *str)
+{
+    u_int32_t off;
+
+    if (str == NULL)
+	return 0;
+    off = (u_int32_t) strings->len;
+    sbuf_append(strings, str, strlen(str) + 1);
+    return off;
+}
+
+/* Write the jobs of the sources to path, through a temporary file and a
+   rename so that a crash leaves the previous snapshot */
+int jobsnap_save(const char *path, const jobsnap_source_t *sources, int n, time_t now)
+{
+    jobsnap_header_t header;
+    jobsnap_file_t file;
+    jobsnap_job_t job;
+    const jobsnap_file_t *f;
+    const jobsnap_t *snap;
+    sbuf_t *out, *strings;
+    cron_job_t *j;
+    char tmp[PATH_MAX];
+    u_int32_t njobs, k;
+    int i, fd, ret = -1;
+    ssize_t w;
+    unsigned long done;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOBSNAP_MAGIC, 8);
+    header.version = JOBSNAP_VERSION;
+    header.sched_size = sizeof(cron_sched_t);
+    header.taken = now;
+    header.last = now;
+    header.nfiles = n;
+    header.files = sizeof(header);
+
+    SBUF_NEW(out, 4096);
+    SBUF_NEW(strings, 4096);
+    sbuf_append(strings, "", 1);
+    sbuf_append(out, (char *) &header, sizeof(header));
+
+    njobs = 0;
+    for (i = 0; i < n; i++)
+    {
+	memset(&file, 0, sizeof(file));
+	file.hash = sources[i].hash;
+	file.path = jobsnap_intern(strings, sources[i].path);
+	file.system = sources[i].system;
+	file.first_job = njobs;
+	if (sources[i].snap != NULL)
+	    file.njobs = sources[i].snap->files[sources[i].file].njobs;
+	else if (sources[i].jobs != NULL)
+	    FOR_XLIST(j, sources[i].jobs)
+		file.njobs++;
+	njobs += file.njobs;
+	sbuf_append(out, (char *) &file, sizeof(file));
+    }
+
+    header.njobs = njobs;
+    header.jobs = out->len;
+    for (i = 0; i < n; i++)
+    {
+	if (sources[i].snap != NULL)
+	{
+	    snap = sources[i].snap;
+	    f = &snap->files[sources[i].file];
+	    for (k = f->first_job; k < f->first_job + f->njobs; k++)
+	    {
+		memset(&job, 0, sizeof(job));
+		job.sched = snap->jobs[k].sched;
+		job.hash = snap->jobs[k].hash;
+		job.next = cron_sched_next(&job.sched, now);
+		if (snap->jobs[k].user != 0)
+		    job.user = jobsnap_intern(strings, jobsnap_string(snap, snap->jobs[k].user));
+		job.command = jobsnap_intern(strings, jobsnap_string(snap, snap->jobs[k].command));
+		sbuf_append(out, (char *) &job, sizeof(job));
+	    }
+	    continue;
+	}
+	if (sources[i].jobs == NULL)
+	    continue;
+	FOR_XLIST(j, sources[i].jobs)
+	{
+	    memset(&job, 0, sizeof(job));
+	    job.sched = j->sched;
+	    job.hash = j->hash;
+	    job.next = cron_sched_next(&j->sched, now);
+	    job.user = jobsnap_intern(strings, j->user);
+	    job.command = jobsnap_intern(strings, j->command);
+	    sbuf_append(out, (char *) &job, sizeof(job));
+	}
+    }
+
+    header.strings = out->len;
+    sbuf_append(out, strings->buffer, strings->len);
+    header.size = out->len;
+    header.checksum = xhash_wyhash(out->buffer + sizeof(header), out->len - sizeof(header), 0);
+    memcpy(out->buffer, &header, sizeof(header));
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    {
+	message(MSG_ERR, errno, "jobsnap: unable to create %s", tmp);
+	goto end;
+    }
+    for (done = 0; done < out->len; done += w)
+    {
+	if ((w = write(fd, out->buffer + done, out->len - done)) < 0)
+	{
+	    if (errno == EINTR)
+	    {
+		w = 0;
+		continue;
+	    }
+	    break;
+	}
+    }
+    if (done < out->len || fsync(fd) < 0)
+    {
+	message(MSG_ERR, errno, "jobsnap: unable to write %s", tmp);
+	close(fd);
+	unlink(tmp);
+	goto end;
+    }
+    close(fd);
+    if (rename(tmp, path) < 0)
+    {
+	message(MSG_ERR, errno, "jobsnap: unable to rename %s", tmp);
+	unlink(tmp);
+	goto end;
+    }
+    ret = 0;
+
+end:
+    SBUF_FREE(strings);
+    SBUF_FREE(out);
+    return ret;
+}
+
+/* Map a snapshot, NULL when it is missing, from another version or
+   damaged: the caller then parses the crontabs */
+jobsnap_t *jobsnap_load(const char *path)
+{
+    const jobsnap_header_t *h;
+    const jobsnap_file_t *files;
+    jobsnap_t *snap;
+    sbuf_t *map;
+    u_int32_t i;
+
+    if ((map = file_map_load(path)) == NULL)
+	return NULL;
+
+    h = (const jobsnap_header_t *) map->buffer;
+    if (map->len < sizeof(jobsnap_header_t) || memcmp(h->magic, JOBSNAP_MAGIC, 8) != 0 ||
+	h->version != JOBSNAP_VERSION || h->sched_size != sizeof(cron_sched_t) ||
+	h->size != map->len)
+    {
+	message(MSG_WARN, 0, "jobsnap: %s is not a usable snapshot\n", path);
+	file_map_unload(map);
+	return NULL;
+    }
+    if (h->files != sizeof(jobsnap_header_t) ||
+	h->jobs != h->files + (u_int64_t) h->nfiles * sizeof(jobsnap_file_t) ||
+	h->strings != h->jobs + (u_int64_t) h->njobs * sizeof(jobsnap_job_t) ||
+	h->strings >= h->size || map->buffer[h->size - 1] != '\0' ||
+	xhash_wyhash(map->buffer + sizeof(jobsnap_header_t), h->size - sizeof(jobsnap_header_t), 0) !=
+	h->checksum)
+    {
+	message(MSG_WARN, 0, "jobsnap: %s is damaged\n", path);
+	file_map_unload(map);
+	return NULL;
+    }
+
+    files = (const jobsnap_file_t *) (map->buffer + h->files);
+    for (i = 0; i < h->nfiles; i++)
+	if ((u_int64_t) files[i].first_job + files[i].njobs > h->njobs)
+	{
+	    message(MSG_WARN, 0, "jobsnap: %s is damaged\n", path);
+	    file_map_unload(map);
+	    return NULL;
+	}
+
+    snap = (jobsnap_t *) w_malloc(sizeof(jobsnap_t));
+    snap->map = map;
+    snap->header = h;
+    snap->files = files;
+    snap->jobs = (const jobsnap_job_t *) (map->buffer + h->jobs);
+    snap->strings = map->buffer + h->strings;
+    snap->strings_len = h->size - h->strings;
+    snap->state = (unsigned char *) w_malloc(h->nfiles ? h->nfiles : 1);
+    return snap;
+}
+
+/* none of the entries, those of the snapshot and those parsed, may be
+   queued anymore */
+void jobsnap_unload(jobsnap_t *snap)
+{
+    unsigned long i;
+
+    if (snap == NULL)
+	return;
+    for (i = 0; i < snap->nparsed; i++)
+    {
+	crontab_free(snap->parsed[i].jobs);
+	w_free(snap->parsed[i].entries);
+	w_free(snap->parsed[i].path);
+    }
+    w_free(snap->parsed);
+    file_map_unload(snap->map);
+    w_free(snap->state);
+    w_free(snap);
+}
+
+/* The stored next time is the first match after the snapshot was taken:
+   it is also the first after now while it is ahead of now, unless the
+   clock went back since */
+time_t jobsnap_next(const jobsnap_t *snap, unsigned long job, time_t now)
+{
+    const jobsnap_job_t *j = &snap->jobs[job];
+
+    if (now >= snap->header->taken && j->next > now)
+	return (time_t) j->next;
+    return cron_sched_next(&j->sched, now);
+}
+
+/* the hash cronsrc keeps for a file, 0 when it cannot be read */
+Fnv64_t jobsnap_file_hash(const char *path)
+{
+    sbuf_t *map;
+    Fnv64_t hash;
+
+    if (cronsrc_file_map(path, &map, &hash) < 0)
+	return 0;
+    file_map_unload(map);
+    return hash;
+}
+
+/* Is a source file still what the snapshot was taken of. Done once per
+   file, when the caller gets to it: returns 1 when fresh, 0 when its
+   jobs must be loaded again */
+int jobsnap_check(jobsnap_t *snap, unsigned long file)
+{
+    const jobsnap_file_t *f;
+
+    if (file >= snap->header->nfiles)
+	return 0;
+    if (snap->state[file] == JS_UNCHECKED)
+    {
+	f = &snap->files[file];
+	snap->state[file] = (jobsnap_file_hash(jobsnap_string(snap, f->path)) == f->hash) ?
+	    JS_FRESH : JS_STALE;
+    }
+    return snap->state[file] == JS_FRESH;
+}
+
+/* Queue every job of the snapshot on sched, with the next times it
+   holds. The data of an entry is its jobsnap_job_t, in the map: the
+   snapshot stays loaded as long as the entries are queued. Returns the
+   entries, njobs of them, to free once removed, NULL on error */
+sched_entry_t *jobsnap_schedule(jobsnap_t *snap, scheduler_t *sched, time_t now)
+{
+    sched_entry_t *entries;
+    unsigned long i, n;
+
+    if (snap == NULL || sched == NULL)
+	return NULL;
+
+    n = snap->header->njobs;
+    entries = (sched_entry_t *) w_malloc((n ? n : 1) * sizeof(sched_entry_t));
+    for (i = 0; i < n; i++)
+    {
+	sched_entry_init(&entries[i], &snap->jobs[i].sched, (void *) &snap->jobs[i]);
+	entries[i].key = snap->jobs[i].hash;
+	/* what jobsnap_next() gives, the search is left to scheduler_load() */
+	if (now >= snap->header->taken && snap->jobs[i].next > now)
+	    entries[i].next = (time_t) snap->jobs[i].next;
+	else
+	    entries[i].next = SCHED_UNSET;
+    }
+    if (scheduler_load(sched, entries, n, now) < 0)
+    {
+	w_free(entries);
+	return NULL;
+    }
+    snap->sched = sched;
+    snap->entries = entries;
+    return entries;
+}
+
+/* the file a job of the snapshot comes from: the last one starting at
+   or before it, files with no job start where the next one does */
+unsigned long jobsnap_job_file(const jobsnap_t *snap, unsigned long job)
+{
+    unsigned long lo = 0, hi = snap->header->nfiles, mid;
+
+    while (hi - lo > 1)
+    {
+	mid = (lo + hi) / 2;
+	if (snap->files[mid].first_job <= job)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Parse path and queue its jobs next to those of the snapshot. The
+   jobs are few, they are added one by one */
+static jobsnap_parsed_t *jobsnap_parse(jobsnap_t *snap, const char *path, int system, long file,
+				       time_t now)
+{
+    jobsnap_parsed_t *p;
+    cron_job_t *job;
+    sbuf_t *map;
+    Fnv64_t hash;
+    unsigned long n;
+
+    if (snap->nparsed == snap->parsed_size)
+    {
+	snap->parsed_size = snap->parsed_size ? snap->parsed_size * 2 : 16;
+	snap->parsed = (jobsnap_parsed_t *) w_realloc(snap->parsed,
+						       snap->parsed_size * sizeof(jobsnap_parsed_t));
+    }
+    p = &snap->parsed[snap->nparsed++];
+    memset(p, 0, sizeof(jobsnap_parsed_t));
+    p->path = strdup(path);
+    p->system = system;
+    p->file = file;
+
+    /* like ingest, a file that cannot be read keeps a hash of 0 */
+    if (cronsrc_file_map(path, &map, &hash) < 0)
+	return p;
+    p->hash = hash;
+    p->jobs = crontab_parse(path, map ? sbuf_view(map) : sview_make(NULL, 0), system);
+    file_map_unload(map);
+    if (p->jobs == NULL)
+	return p;
+
+    FOR_XLIST(job, p->jobs)
+	p->njobs++;
+    p->entries = (sched_entry_t *) w_malloc((p->njobs ? p->njobs : 1) * sizeof(sched_entry_t));
+    n = 0;
+    FOR_XLIST(job, p->jobs)
+    {
+	sched_entry_init(&p->entries[n], &job->sched, job);
+	p->entries[n].key = job->hash;
+	scheduler_add(snap->sched, &p->entries[n], now);
+	n++;
+    }
+    return p;
+}
+
+/* Check a file of the snapshot and when it changed, replace its jobs by
+   what it holds now. Returns 1 when its jobs were replaced, now or
+   before, 0 when the snapshot still holds */
+int jobsnap_refresh(jobsnap_t *snap, unsigned long file, time_t now)
+{
+    const jobsnap_file_t *f;
+    unsigned long i;
+
+    if (snap->sched == NULL || file >= snap->header->nfiles)
+	return -1;
+    if (snap->state[file] == JS_RELOADED)
+	return 1;
+    if (jobsnap_check(snap, file))
+	return 0;
+
+    f = &snap->files[file];
+    for (i = f->first_job; i < (unsigned long) f->first_job + f->njobs; i++)
+	scheduler_remove(snap->sched, &snap->entries[i]);
+    jobsnap_parse(snap, jobsnap_string(snap, f->path), f->system, (long) file, now);
+    snap->state[file] = JS_RELOADED;
+    message(MSG_INFO, 0, "jobsnap: %s changed since the snapshot\n", jobsnap_string(snap, f->path));
+    return 1;
+}
+
+/* For the fire callback: may a job of the snapshot run. Its file is
+   checked on the first fire, and when it changed the job runs only if
+   its line is still there, it then stays queued from the file parsed
+   again */
+int jobsnap_runs(jobsnap_t *snap, const jobsnap_job_t *job, time_t now)
+{
+    unsigned long file, i;
+    cron_job_t *j;
+
+    file = jobsnap_job_file(snap, (unsigned long) (job - snap->jobs));
+    if (snap->state[file] == JS_FRESH || jobsnap_refresh(snap, file, now) == 0)
+	return 1;
+
+    for (i = snap->nparsed; i-- > 0; )
+    {
+	if (snap->parsed[i].file != (long) file)
+	    continue;
+	if (snap->parsed[i].jobs != NULL)
+	    FOR_XLIST(j, snap->parsed[i].jobs)
+		if (j->hash == job->hash)
+		    return 1;
+	break;
+    }
+    return 0;
+}
+
+/* Parse and queue the crontabs that appeared in dirs since the snapshot
+   was taken. Only the directories changed since are listed, the files
+   that left them are found stale by their check. Returns how many */
+int jobsnap_added(jobsnap_t *snap, const char **dirs, const int *system, int ndirs, time_t now)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    xhash_t *known = NULL;
+    unsigned long i;
+    DIR *dir;
+    int d, count = 0;
+
+    if (snap->sched == NULL)
+	return -1;
+
+    for (d = 0; d < ndirs; d++)
+    {
+	if (stat(dirs[d], &st) < 0 || st.st_mtime < snap->header->taken)
+	    continue;
+	if ((dir = opendir(dirs[d])) == NULL)
+	{
+	    message(MSG_ERR, errno, "jobsnap: unable to open %s", dirs[d]);
+	    continue;
+	}
+	if (known == NULL)
+	{
+	    known = xhash_init(NULL);
+	    for (i = 0; i < snap->header->nfiles; i++)
+		xhash_add(known, strdup(jobsnap_string(snap, snap->files[i].path)), NULL);
+	}
+	while ((de = readdir(dir)) != NULL)
+	{
+	    if (!cronsrc_name_ok(de->d_name) ||
+		snprintf(path, sizeof(path), "%s/%s", dirs[d], de->d_name) >= (int) sizeof(path) ||
+		xhash_exists(known, path))
+		continue;
+	    jobsnap_parse(snap, path, system[d], -1, now);
+	    count++;
+	}
+	closedir(dir);
+    }
+    xhash_destroy(known);
+    return count;
+}
+
+/* Check up to max more files, in order, for the main loop to call while
+   it has nothing else to do. Returns the number of files left */
+unsigned long jobsnap_validate(jobsnap_t *snap, unsigned long max, time_t now)
+{
+    while (snap->checked < snap->header->nfiles && max-- > 0)
+	jobsnap_refresh(snap, snap->checked++, now);
+    return snap->header->nfiles - snap->checked;
+}
+
+/* did any crontab change or appear since the snapshot was taken */
+int jobsnap_changed(const jobsnap_t *snap)
+{
+    return snap->nparsed > 0;
+}
+
+/* Write what is queued now, the files that still hold from the snapshot
+   and the others as parsed again, as the snapshot of the next start */
+int jobsnap_resave(jobsnap_t *snap, const char *path, time_t now)
+{
+    jobsnap_source_t *sources;
+    struct stat st;
+    unsigned long i, n;
+    int ret;
+
+    n = snap->header->nfiles + snap->nparsed;
+    sources = (jobsnap_source_t *) w_malloc((n ? n : 1) * sizeof(jobsnap_source_t));
+    for (i = 0, n = 0; i < snap->header->nfiles; i++)
+    {
+	if (snap->state[i] == JS_RELOADED)
+	    continue;
+	sources[n].path = jobsnap_string(snap, snap->files[i].path);
+	sources[n].system = snap->files[i].system;
+	sources[n].hash = snap->files[i].hash;
+	sources[n].snap = snap;
+	sources[n].file = i;
+	n++;
+    }
+    for (i = 0; i < snap->nparsed; i++)
+    {
+	/* a crontab that was removed has nothing left to check */
+	if (snap->parsed[i].hash == 0 && stat(snap->parsed[i].path, &st) < 0 && errno == ENOENT)
+	    continue;
+	sources[n].path = snap->parsed[i].path;
+	sources[n].system = snap->parsed[i].system;
+	sources[n].hash = snap->parsed[i].hash;
+	sources[n].jobs = snap->parsed[i].jobs;
+	n++;
+    }
+    ret = jobsnap_save(path, sources, (int) n, now);
+    w_free(sources);
+    return ret;
+}
+
+/* Record that the scheduler ran at now, in the header of the snapshot
+   at path. Not synced: losing the last few minutes in a crash only
+   makes the next start count fewer missed runs */
+int jobsnap_tick(const char *path, time_t now)
+{
+    int64_t last = now;
+    int fd, ret = 0;
+
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+	return -1;
+    if (pwrite(fd, &last, sizeof(last), offsetof(jobsnap_header_t, last)) != sizeof(last))
+    {
+	message(MSG_ERR, errno, "jobsnap: unable to update %s", path);
+	ret = -1;
+    }
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,161 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __JOBSNAP_H__
+#define __JOBSNAP_H__
+
+#include <time.h>
+
+#include "common.h"
+#include "xhash.h"
+#include "crontab.h"
+#include "scheduler.h"
+
+/*
+ * Binary snapshot of the compiled job table, so that a restart does not
+ * have to parse every crontab before the first job fires. The file is
+ * used in place through file_map_load(): the schedules in it are
+ * cron_sched_t the scheduler can point to, and the next fire time of
+ * each job, computed when the snapshot was taken, still holds as long
+ * as it is in the future. The snapshot is versioned and checksummed;
+ * each source file comes with the FNV hash of its content, the one
+ * cronsrc computes, so that the files can be checked later, one by one,
+ * and only the stale ones reparsed.
+ *
+ * The daemon schedules from the snapshot before reading any crontab.
+ * jobsnap_added() parses the files that appeared in a directory since,
+ * jobsnap_validate() then checks the others a few at a time from the
+ * main loop, and a job whose file was not checked yet is checked when it
+ * first fires, by jobsnap_runs(). A stale file has its jobs replaced by
+ * those parsed again, the rest of the snapshot stays in use, and
+ * jobsnap_resave() writes the result for the next start.
+ *
+ * The header also keeps the last time the scheduler ran, written in
+ * place by jobsnap_tick() outside of the checksum, so that the next
+ * start knows for how long the daemon was down and what runs it missed.
+ */
+
+#define JOBSNAP_MAGIC   "CRNJSNP1"
+#define JOBSNAP_VERSION 2
+
+typedef struct jobsnap_header {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t sched_size;   /* layout of cron_sched_t */
+    u_int64_t checksum;     /* wyhash of what follows the header */
+    u_int64_t size;
+    int64_t taken;          /* when the next times were computed */
+    int64_t last;           /* last run of the scheduler, kept by jobsnap_tick() */
+    u_int32_t nfiles;
+    u_int32_t njobs;
+    u_int64_t files;        /* offsets in the file */
+    u_int64_t jobs;
+    u_int64_t strings;
+} jobsnap_header_t;
+
+typedef struct jobsnap_file {
+    Fnv64_t hash;           /* of the content */
+    u_int32_t path;         /* offsets in the strings */
+    u_int32_t system;
+    u_int32_t first_job;
+    u_int32_t njobs;
+} jobsnap_file_t;
+
+typedef struct jobsnap_job {
+    cron_sched_t sched;
+    Fnv64_t hash;           /* of the line */
+    int64_t next;
+    u_int32_t user;         /* 0 in a user crontab: the strings start with "" */
+    u_int32_t command;
+} jobsnap_job_t;
+
+typedef enum {
+    JS_UNCHECKED, JS_FRESH, JS_STALE, JS_RELOADED
+} jobsnap_state_t;
+
+/* a crontab parsed again, or new since the snapshot was taken */
+typedef struct jobsnap_parsed {
+    char *path;
+    int system;
+    Fnv64_t hash;
+    cron_jobs_t *jobs;      /* NULL when it could not be read */
+    sched_entry_t *entries; /* data is the cron_job_t */
+    unsigned long njobs;
+    long file;              /* in the snapshot, -1 for a new crontab */
+} jobsnap_parsed_t;
+
+typedef struct jobsnap {
+    sbuf_t *map;
+    const jobsnap_header_t *header;
+    const jobsnap_file_t *files;
+    const jobsnap_job_t *jobs;
+    const char *strings;
+    u_int64_t strings_len;
+    unsigned char *state;   /* jobsnap_state_t of each file */
+    scheduler_t *sched;     /* where jobsnap_schedule() queued the jobs */
+    sched_entry_t *entries;
+    unsigned long checked;  /* files jobsnap_validate() went through */
+    jobsnap_parsed_t *parsed;
+    unsigned long nparsed;
+    unsigned long parsed_size;
+} jobsnap_t;
+
+/* what a snapshot is taken of: the jobs of one crontab, parsed or those
+   of a file of a previous snapshot when snap is set */
+typedef struct jobsnap_source {
+    const char *path;
+    int system;
+    Fnv64_t hash;
+    cron_jobs_t *jobs;
+    const jobsnap_t *snap;
+    unsigned long file;
+} jobsnap_source_t;
+
+/* a string of the snapshot, "" when the offset makes no sense */
+static __inline const char *jobsnap_string(const jobsnap_t *snap, u_int32_t off)
+{
+    return (off < snap->strings_len) ? snap->strings + off : "";
+}
+
+/* the job of the snapshot an entry points to, NULL for a parsed one */
+static __inline const jobsnap_job_t *jobsnap_job_of(const jobsnap_t *snap, const void *data)
+{
+    const jobsnap_job_t *job = (const jobsnap_job_t *) data;
+
+    return (job >= snap->jobs && job < snap->jobs + snap->header->njobs) ? job : NULL;
+}
+
+/* ------- API -------- */
+int jobsnap_save(const char *path, const jobsnap_source_t *sources, int n, time_t now);
+jobsnap_t *jobsnap_load(const char *path);
+void jobsnap_unload(jobsnap_t *snap);
+time_t jobsnap_next(const jobsnap_t *snap, unsigned long job, time_t now);
+Fnv64_t jobsnap_file_hash(const char *path);
+int jobsnap_check(jobsnap_t *snap, unsigned long file);
+sched_entry_t *jobsnap_schedule(jobsnap_t *snap, scheduler_t *sched, time_t now);
+unsigned long jobsnap_job_file(const jobsnap_t *snap, unsigned long job);
+int jobsnap_refresh(jobsnap_t *snap, unsigned long file, time_t now);
+int jobsnap_runs(jobsnap_t *snap, const jobsnap_job_t *job, time_t now);
+int jobsnap_added(jobsnap_t *snap, const char **dirs, const int *system, int ndirs, time_t now);
+unsigned long jobsnap_validate(jobsnap_t *snap, unsigned long max, time_t now);
+int jobsnap_changed(const jobsnap_t *snap);
+int jobsnap_resave(jobsnap_t *snap, const char *path, time_t now);
+int jobsnap_tick(const char *path, time_t now);
+
+#endif /* __JOBSNAP_H__ */
@@ -0,0 +1,510 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+
+#include "common.h"
+#include "jobsync.h"
+
+/*
+ * Messages, one per line, numbers in hex:
+ *   R root               -> "=" when in step, else the H of the level 1
+ *   N level idx...       -> H of the children of each node
+ *   H level idx hash
+ *   B idx...             -> E of every entry of these leaves
+ *   E id version deleted line
+ *   P token, then E lines -> OK applied
+ */
+
+/* what the peer has in the leaves compared, or pushes */
+typedef struct jobsync_remote {
+    u_int64_t id;
+    u_int64_t version;
+    int deleted;
+    sview_t text;
+} jobsync_remote_t;
+
+static unsigned long jobsync_index(u_int64_t id, int level);
+static u_int64_t jobsync_digest(const jobsync_entry_t *e);
+static void jobsync_tree_update(jobsync_t *sync, u_int64_t id, u_int64_t old, u_int64_t new);
+static jobsync_entry_t *jobsync_set(jobsync_t *sync, u_int64_t id, u_int64_t version,
+				    int deleted, sview_t line);
+static int jobsync_newer(u_int64_t v1, int d1, u_int64_t v2, int d2);
+static int jobsync_hex(sview_t tok, u_int64_t *value);
+static void jobsync_entry_write(sbuf_t *sb, const jobsync_entry_t *e);
+static int jobsync_entry_read(sview_t line, jobsync_remote_t *r);
+static long jobsync_entries_read(sview_t text, jobsync_remote_t **entries);
+static int jobsync_merge(jobsync_t *sync, const jobsync_remote_t *r);
+static void jobsync_children(jobsync_t *sync, int level, unsigned long idx, sbuf_t *resp);
+static int jobsync_remote_cmp(const void *a, const void *b);
+
+static unsigned long jobsync_index(u_int64_t id, int level)
+{
+    return level ? (unsigned long) (id >> (64 - 4 * level)) : 0;
+}
+
+/* splitmix64 finalizer over the state of the entry */
+static u_int64_t jobsync_digest(const jobsync_entry_t *e)
+{
+    u_int64_t z;
+
+    z = e->id ^ (e->version * 0x9e3779b97f4a7c15ULL) ^ (u_int64_t) e->deleted;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* node hashes are sums: replace old by new on the path to the root */
+static void jobsync_tree_update(jobsync_t *sync, u_int64_t id, u_int64_t old, u_int64_t new)
+{
+    int level;
+
+    for (level = 0; level <= JOBSYNC_DEPTH; level++)
+	sync->tree[level][jobsync_index(id, level)] += new - old;
+}
+
+static jobsync_entry_t *jobsync_set(jobsync_t *sync, u_int64_t id, u_int64_t version,
+				    int deleted, sview_t line)
+{
+    jobsync_entry_t *e;
+    u_int64_t old;
+
+    if ((e = jobsync_lookup(sync, id)) == NULL)
+    {
+	e = (jobsync_entry_t *) w_malloc(sizeof(jobsync_entry_t));
+	e->id = id;
+	e->next = sync->buckets[jobsync_index(id, JOBSYNC_DEPTH)];
+	sync->buckets[jobsync_index(id, JOBSYNC_DEPTH)] = e;
+	sync->count++;
+	old = 0;
+    }
+    else
+	old = jobsync_digest(e);
+
+    e->version = version;
+    e->deleted = deleted;
+    if (line.len)
+    {
+	w_free(e->line);
+	e->line = sview_dup(line);
+    }
+    jobsync_tree_update(sync, id, old, jobsync_digest(e));
+    return e;
+}
+
+/* does (v1, d1) win over (v2, d2): higher version, then removal */
+static int jobsync_newer(u_int64_t v1, int d1, u_int64_t v2, int d2)
+{
+    return v1 > v2 || (v1 == v2 && d1 && !d2);
+}
+
+static int jobsync_hex(sview_t tok, u_int64_t *value)
+{
+    unsigned long i;
+    int c;
+
+    if (tok.len == 0 || tok.len > 16)
+	return -1;
+    *value = 0;
+    for (i = 0; i < tok.len; i++)
+    {
+	c = tok.ptr[i];
+	if (c >= '0' && c <= '9')
+	    c -= '0';
+	else if (c >= 'a' && c <= 'f')
+	    c -= 'a' - 10;
+	else
+	    return -1;
+	*value = (*value << 4) | c;
+    }
+    return 0;
+}
+
+static void jobsync_entry_write(sbuf_t *sb, const jobsync_entry_t *e)
+{
+    sbuf_appendf(sb, "E %llx %llx %d %s\n", (unsigned long long) e->id,
+		 (unsigned long long) e->version, e->deleted, e->line ? e->line : "");
+}
+
+/* the id of a live entry must be the hash of its line, as
+   jobsync_put() makes it, or a peer could give any command to any id */
+static int jobsync_entry_read(sview_t line, jobsync_remote_t *r)
+{
+    sview_t tok;
+    u_int64_t deleted;
+
+    if (!sview_token(&line, &tok) || !sview_eq(tok, "E") ||
+	!sview_token(&line, &tok) || jobsync_hex(tok, &r->id) < 0 ||
+	!sview_token(&line, &tok) || jobsync_hex(tok, &r->version) < 0 ||
+	!sview_token(&line, &tok) || jobsync_hex(tok, &deleted) < 0)
+	return -1;
+    r->deleted = (deleted != 0);
+    r->text = sview_trim(line);
+    if (!r->deleted && (r->text.len == 0 ||
+			fnv_64_buf(r->text.ptr, r->text.len, FNV1_64_INIT) != r->id))
+	return -1;
+    return 0;
+}
+
+/* every E line of text, all of them checked before any is applied.
+   Returns the number of entries, -1 when one is malformed */
+static long jobsync_entries_read(sview_t text, jobsync_remote_t **entries)
+{
+    jobsync_remote_t *r;
+    sview_t line;
+    long n = 0;
+
+    /* "E 0 0 1\n" is the shortest */
+    r = (jobsync_remote_t *) w_malloc((text.len / 8 + 1) * sizeof(jobsync_remote_t));
+    while (sview_cut(&text, '\n', &line))
+    {
+	if (line.len == 0)
+	    continue;
+	if (jobsync_entry_read(line, &r[n]) < 0)
+	{
+	    w_free(r);
+	    return -1;
+	}
+	n++;
+    }
+    *entries = r;
+    return n;
+}
+
+/* take a remote entry when it wins, returns 1 when it did */
+static int jobsync_merge(jobsync_t *sync, const jobsync_remote_t *r)
+{
+    jobsync_entry_t *e;
+
+    e = jobsync_lookup(sync, r->id);
+    if (e != NULL && !jobsync_newer(r->version, r->deleted, e->version, e->deleted))
+	return 0;
+    e = jobsync_set(sync, r->id, r->version, r->deleted, r->text);
+    if (sync->apply != NULL)
+	sync->apply(e, sync->arg);
+    return 1;
+}
+
+static void jobsync_children(jobsync_t *sync, int level, unsigned long idx, sbuf_t *resp)
+{
+    unsigned long child;
+
+    if (level >= JOBSYNC_DEPTH || idx >= (1UL << (4 * level)))
+	return;
+    for (child = idx * JOBSYNC_FANOUT; child < (idx + 1) * JOBSYNC_FANOUT; child++)
+	sbuf_appendf(resp, "H %d %lx %llx\n", level + 1, child,
+		     (unsigned long long) sync->tree[level + 1][child]);
+}
+
+static int jobsync_remote_cmp(const void *a, const void *b)
+{
+    const jobsync_remote_t *ra = (const jobsync_remote_t *)a;
+    const jobsync_remote_t *rb = (const jobsync_remote_t *)b;
+
+    return (ra->id < rb->id) ? -1 : (ra->id > rb->id);
+}
+
+jobsync_t *jobsync_create(jobsync_apply_t apply, void *arg)
+{
+    jobsync_t *sync;
+    int level;
+
+    sync = (jobsync_t *) w_malloc(sizeof(jobsync_t));
+    for (level = 0; level <= JOBSYNC_DEPTH; level++)
+	sync->tree[level] = (u_int64_t *) w_malloc((1UL << (4 * level)) * sizeof(u_int64_t));
+    sync->buckets = (jobsync_entry_t **) w_malloc(JOBSYNC_LEAVES * sizeof(jobsync_entry_t *));
+    sync->apply = apply;
+    sync->arg = arg;
+    return sync;
+}
+
+void jobsync_destroy(jobsync_t *sync)
+{
+    jobsync_entry_t *e, *next;
+    unsigned long i;
+    int level;
+
+    if (sync == NULL)
+	return;
+    for (i = 0; i < JOBSYNC_LEAVES; i++)
+	for (e = sync->buckets[i]; e != NULL; e = next)
+	{
+	    next = e->next;
+	    w_free(e->line);
+	    w_free(e);
+	}
+    w_free(sync->buckets);
+    for (level = 0; level <= JOBSYNC_DEPTH; level++)
+	w_free(sync->tree[level]);
+    w_free(sync);
+}
+
+jobsync_entry_t *jobsync_lookup(jobsync_t *sync, u_int64_t id)
+{
+    jobsync_entry_t *e;
+
+    for (e = sync->buckets[jobsync_index(id, JOBSYNC_DEPTH)]; e != NULL; e = e->next)
+	if (e->id == id)
+	    return e;
+    return NULL;
+}
+
+/* a job added locally, its id is the hash cronsrc gives to the line */
+jobsync_entry_t *jobsync_put(jobsync_t *sync, sview_t line)
+{
+    jobsync_entry_t *e;
+    u_int64_t id;
+
+    line = sview_trim(line);
+    if (sync == NULL || line.len == 0 || memchr(line.ptr, '\n', line.len) != NULL)
+	return NULL;
+
+    id = fnv_64_buf(line.ptr, line.len, FNV1_64_INIT);
+    if ((e = jobsync_lookup(sync, id)) != NULL && !e->deleted)
+	return e;
+    return jobsync_set(sync, id, e ? e->version + 1 : 1, 0, line);
+}
+
+/* a job removed locally, the tombstone carries the removal */
+int jobsync_delete(jobsync_t *sync, u_int64_t id)
+{
+    jobsync_entry_t *e;
+
+    if (sync == NULL || (e = jobsync_lookup(sync, id)) == NULL || e->deleted)
+	return -1;
+    jobsync_set(sync, id, e->version + 1, 1, sview_make(NULL, 0));
+    return 0;
+}
+
+/* refuse the pushes whose token fence does not accept */
+void jobsync_set_fence(jobsync_t *sync, jobsync_fence_t fence, void *arg)
+{
+    sync->fence = fence;
+    sync->fence_arg = arg;
+}
+
+u_int64_t jobsync_root(jobsync_t *sync)
+{
+    return sync->tree[0][0];
+}
+
+/* answer one request of a peer, returns -1 when it makes no sense */
+int jobsync_handle(jobsync_t *sync, sview_t req, sbuf_t *resp)
+{
+    jobsync_entry_t *e;
+    jobsync_remote_t *pushed;
+    sview_t line, tok;
+    u_int64_t v, level;
+    long n, i;
+    int applied;
+
+    if (sync == NULL || resp == NULL || !sview_cut(&req, '\n', &line) || !sview_token(&line, &tok))
+	goto bad;
+
+    if (sview_eq(tok, "R"))
+    {
+	if (!sview_token(&line, &tok) || jobsync_hex(tok, &v) < 0)
+	    goto bad;
+	if (v == jobsync_root(sync))
+	    sbuf_append(resp, "=\n", 2);
+	else
+	    jobsync_children(sync, 0, 0, resp);
+    }
+    else if (sview_eq(tok, "N"))
+    {
+	if (!sview_token(&line, &tok) || jobsync_hex(tok, &level) < 0 || level >= JOBSYNC_DEPTH)
+	    goto bad;
+	while (sview_token(&line, &tok))
+	{
+	    if (jobsync_hex(tok, &v) < 0)
+		goto bad;
+	    jobsync_children(sync, (int) level, (unsigned long) v, resp);
+	}
+    }
+    else if (sview_eq(tok, "B"))
+    {
+	while (sview_token(&line, &tok))
+	{
+	    if (jobsync_hex(tok, &v) < 0 || v >= JOBSYNC_LEAVES)
+		goto bad;
+	    for (e = sync->buckets[v]; e != NULL; e = e->next)
+		jobsync_entry_write(resp, e);
+	}
+    }
+    else if (sview_eq(tok, "P"))
+    {
+	/* no token is token 0, that no lease has */
+	v = 0;
+	if (sview_token(&line, &tok) && jobsync_hex(tok, &v) < 0)
+	    goto bad;
+	if (sync->fence != NULL && sync->fence(v, sync->fence_arg) != 0)
+	{
+	    message(MSG_WARN, 0, "jobsync: push with stale token %llx refused\n",
+		    (unsigned long long) v);
+	    goto bad;
+	}
+	if ((n = jobsync_entries_read(req, &pushed)) < 0)
+	    goto bad;
+	applied = 0;
+	for (i = 0; i < n; i++)
+	    applied += jobsync_merge(sync, &pushed[i]);
+	w_free(pushed);
+	sbuf_appendf(resp, "OK %x\n", applied);
+    }
+    else
+	goto bad;
+
+    return 0;
+
+bad:
+    if (resp != NULL)
+	sbuf_append(resp, "ERR\n", 4);
+    return -1;
+}
+
+/* One synchronization with a peer, both ways. Returns the number of
+   entries that changed on either side, -1 on error */
+int jobsync_round(jobsync_t *sync, jobsync_send_t send, void *arg)
+{
+    sbuf_t *req, *resp;
+    sview_t rest, line, tok;
+    jobsync_remote_t *remote, *found, key;
+    jobsync_entry_t *e;
+    unsigned long *diff, ndiff, i;
+    long nremote, j;
+    u_int64_t level, idx, hash;
+    int changed, pushed, ret;
+
+    if (sync == NULL || send == NULL)
+	return -1;
+
+    SBUF_NEW(req, 256);
+    SBUF_NEW(resp, 4096);
+    diff = NULL;
+    remote = NULL;
+    ret = -1;
+    sync->sent = sync->received = 0;
+
+    sbuf_appendf(req, "R %llx\n", (unsigned long long) jobsync_root(sync));
+
+    /* walk down the nodes that differ */
+    level = 0;
+    while (1)
+    {
+	sbuf_reset(resp);
+	if (send(req, resp, arg) < 0)
+	    goto end;
+	sync->sent += req->len;
+	sync->received += resp->len;
+	if (resp->len >= 1 && resp->buffer[0] == '=')
+	{
+	    ret = 0;
+	    goto end;
+	}
+
+	w_free(diff);
+	diff = (unsigned long *) w_malloc((resp->len / 8 + 1) * sizeof(unsigned long));
+	ndiff = 0;
+	rest = sbuf_view(resp);
+	while (sview_cut(&rest, '\n', &line))
+	{
+	    if (!sview_token(&line, &tok))
+		continue;
+	    if (!sview_eq(tok, "H") ||
+		!sview_token(&line, &tok) || jobsync_hex(tok, &level) < 0 || level > JOBSYNC_DEPTH ||
+		!sview_token(&line, &tok) || jobsync_hex(tok, &idx) < 0 ||
+		idx >= (1UL << (4 * level)) ||
+		!sview_token(&line, &tok) || jobsync_hex(tok, &hash) < 0)
+		goto end;
+	    if (sync->tree[level][idx] != hash)
+		diff[ndiff++] = (unsigned long) idx;
+	}
+	/* changed in between */
+	if (ndiff == 0)
+	{
+	    ret = 0;
+	    goto end;
+	}
+
+	sbuf_reset(req);
+	if (level == JOBSYNC_DEPTH)
+	    break;
+	sbuf_appendf(req, "N %llx", (unsigned long long) level);
+	for (i = 0; i < ndiff; i++)
+	    sbuf_appendf(req, " %lx", diff[i]);
+	sbuf_append(req, "\n", 1);
+    }
+
+    /* entries of the leaves that differ: take what is newer there */
+    sbuf_append(req, "B", 1);
+    for (i = 0; i < ndiff; i++)
+	sbuf_appendf(req, " %lx", diff[i]);
+    sbuf_append(req, "\n", 1);
+    sbuf_reset(resp);
+    if (send(req, resp, arg) < 0)
+	goto end;
+    sync->sent += req->len;
+    sync->received += resp->len;
+
+    if ((nremote = jobsync_entries_read(sbuf_view(resp), &remote)) < 0)
+	goto end;
+    changed = 0;
+    for (j = 0; j < nremote; j++)
+	changed += jobsync_merge(sync, &remote[j]);
+    qsort(remote, nremote, sizeof(jobsync_remote_t), jobsync_remote_cmp);
+
+    /* and give what is newer here */
+    sbuf_reset(req);
+    sbuf_appendf(req, "P %llx\n", (unsigned long long) sync->token);
+    pushed = 0;
+    for (i = 0; i < ndiff; i++)
+	for (e = sync->buckets[diff[i]]; e != NULL; e = e->next)
+	{
+	    key.id = e->id;
+	    found = (jobsync_remote_t *) bsearch(&key, remote, nremote, sizeof(jobsync_remote_t),
+						 jobsync_remote_cmp);
+	    if (found == NULL || jobsync_newer(e->version, e->deleted, found->version, found->deleted))
+	    {
+		jobsync_entry_write(req, e);
+		pushed++;
+	    }
+	}
+    if (pushed)
+    {
+	sbuf_reset(resp);
+	if (send(req, resp, arg) < 0)
+	    goto end;
+	sync->sent += req->len;
+	sync->received += resp->len;
+	if (resp->len < 3 || memcmp(resp->buffer, "OK ", 3) != 0)
+	{
+	    message(MSG_WARN, 0, "jobsync: push refused by the peer\n");
+	    goto end;
+	}
+    }
+    ret = changed + pushed;
+
+end:
+    if (ret < 0)
+	message(MSG_WARN, 0, "jobsync: round failed\n");
+    w_free(remote);
+    w_free(diff);
+    SBUF_FREE(req);
+    SBUF_FREE(resp);
+    return ret;
+}
@@ -0,0 +1,92 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __JOBSYNC_H__
+#define __JOBSYNC_H__
+
+#include "common.h"
+#include "xhash.h"
+
+/*
+ * Synchronization of the shared jobs between two nodes. Each job is an
+ * entry keyed by the FNV hash of its crontab line, with a version; a
+ * removed job stays as a tombstone so that removals spread too, the
+ * highest version wins. Entries are summarized by a hash tree of fixed
+ * shape: level L has 16^L nodes, a node covers the ids starting with
+ * its L hex digits and its hash is the sum of the digests of the
+ * entries it covers, so that a change updates one node per level.
+ *
+ * A round starts by comparing the roots: nodes in step are done after
+ * one small request. Otherwise the client walks down the nodes that
+ * differ and only the entries of the leaves that differ are sent, both
+ * ways. Requests and responses are lines of text, transport agnostic:
+ * jobsync_handle() answers a request body, the HTTP layer is meant to
+ * mount it as POST /sync.
+ *
+ * Pushes carry the fencing token of the lease of the pusher (lease.h),
+ * sync->token. A node given a fence applies a push only when the fence
+ * accepts its token, so a holder whose lease went to someone else
+ * cannot overwrite the shared crontab anymore.
+ */
+
+#define JOBSYNC_FANOUT 16
+#define JOBSYNC_DEPTH  4   /* leaves: 16^4 buckets */
+#define JOBSYNC_LEAVES (1UL << (4 * JOBSYNC_DEPTH))
+
+typedef struct jobsync_entry {
+    struct jobsync_entry *next; /* in its bucket */
+    u_int64_t id;
+    u_int64_t version;
+    int deleted;
+    char *line;
+} jobsync_entry_t;
+
+/* a remote change won over the local state, e is already updated */
+typedef void (*jobsync_apply_t)(const jobsync_entry_t *e, void *arg);
+
+/* give req to the peer, fill resp with its answer */
+typedef int (*jobsync_send_t)(sbuf_t *req, sbuf_t *resp, void *arg);
+
+/* may a push carrying token be applied: 0 when it may */
+typedef int (*jobsync_fence_t)(u_int64_t token, void *arg);
+
+typedef struct jobsync {
+    u_int64_t *tree[JOBSYNC_DEPTH + 1];
+    jobsync_entry_t **buckets;
+    unsigned long count;
+    jobsync_apply_t apply;
+    void *arg;
+    jobsync_fence_t fence;  /* NULL to take every push */
+    void *fence_arg;
+    u_int64_t token;        /* of our lease, sent with our pushes */
+    unsigned long sent;     /* bytes of requests of the last round */
+    unsigned long received;
+} jobsync_t;
+
+/* ------- API -------- */
+jobsync_t *jobsync_create(jobsync_apply_t apply, void *arg);
+void jobsync_destroy(jobsync_t *sync);
+jobsync_entry_t *jobsync_lookup(jobsync_t *sync, u_int64_t id);
+jobsync_entry_t *jobsync_put(jobsync_t *sync, sview_t line);
+int jobsync_delete(jobsync_t *sync, u_int64_t id);
+u_int64_t jobsync_root(jobsync_t *sync);
+void jobsync_set_fence(jobsync_t *sync, jobsync_fence_t fence, void *arg);
+int jobsync_handle(jobsync_t *sync, sview_t req, sbuf_t *resp);
+int jobsync_round(jobsync_t *sync, jobsync_send_t send, void *arg);
+
+#endif /* __JOBSYNC_H__ */
@@ -0,0 +1,438 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE /* pipe2, posix_spawn_file_actions_addchdir_np */
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "launcher.h"
+
+#define LAUNCH_PATH "/usr/local/bin:/usr/bin:/bin"
+
+/* The kernel sigset_t is 64 bits, glibc's is 1024 */
+#define LAUNCH_KSIGSET 8
+
+/* What rt_sigaction() takes, not the glibc struct sigaction: the
+   generic layout, used by x86, arm, riscv and most others */
+struct launch_ksigaction {
+    void (*handler)(int);
+    unsigned long flags;
+    void (*restorer)(void);
+    unsigned char mask[LAUNCH_KSIGSET];
+};
+
+static launch_user_t *launcher_user(launcher_t *launcher, const char *name);
+static void launch_user_free(launch_user_t *user);
+static int launch_env_set(launch_user_t *user, const char *name, const char *value);
+static int launch_pipes(int out[2], int err[2]);
+static pid_t launch_spawn(launch_user_t *user, const char *command, int out, int err);
+static pid_t launch_vfork(launch_user_t *user, const char *command, int out, int err);
+static int launcher_start(launcher_t *launcher, launch_user_t *user, launch_job_t *job);
+static int launcher_may_run(launcher_t *launcher, launch_user_t *user);
+
+/* the user and its environment, looked up once */
+static launch_user_t *launcher_user(launcher_t *launcher, const char *name)
+{
+    launch_user_t *user;
+    struct passwd pw, *res;
+    char buf[4096];
+    int ngroups;
+
+    if ((user = (launch_user_t *) xhash_value(launcher->users, (char *) name)) != NULL)
+	return user;
+
+    if (getpwnam_r(name, &pw, buf, sizeof(buf), &res) != 0 || res == NULL)
+    {
+	message(MSG_ERR, 0, "launcher: unknown user %s\n", name);
+	return NULL;
+    }
+
+    user = (launch_user_t *) w_malloc(sizeof(launch_user_t));
+    user->name = strdup(name);
+    user->uid = pw.pw_uid;
+    user->gid = pw.pw_gid;
+    user->home = strdup(pw.pw_dir);
+    user->shell = strdup("/bin/sh");
+
+    /* initgroups() is not possible between vfork and exec */
+    ngroups = 32;
+    user->groups = (gid_t *) w_malloc(ngroups * sizeof(gid_t));
+    if (getgrouplist(name, pw.pw_gid, user->groups, &ngroups) < 0)
+    {
+	user->groups = (gid_t *) w_realloc(user->groups, ngroups * sizeof(gid_t));
+	getgrouplist(name, pw.pw_gid, user->groups, &ngroups);
+    }
+    user->ngroups = ngroups;
+
+    user->envp = (char **) w_malloc(sizeof(char *));
+    launch_env_set(user, "HOME", user->home);
+    launch_env_set(user, "LOGNAME", name);
+    launch_env_set(user, "USER", name);
+    launch_env_set(user, "SHELL", user->shell);
+    launch_env_set(user, "PATH", LAUNCH_PATH);
+
+    xhash_add(launcher->users, strdup(name), user);
+    return user;
+}
+
+static void launch_user_free(launch_user_t *user)
+{
+    int i;
+
+    for (i = 0; i < user->nenv; i++)
+	w_free(user->envp[i]);
+    w_free(user->envp);
+    w_free(user->groups);
+    w_free(user->home);
+    w_free(user->shell);
+    w_free(user->name);
+}
+
+/* replace or append NAME=value */
+static int launch_env_set(launch_user_t *user, const char *name, const char *value)
+{
+    size_t nlen = strlen(name);
+    char *entry;
+    int i;
+
+    entry = (char *) w_malloc(nlen + strlen(value) + 2);
+    sprintf(entry, "%s=%s", name, value);
+
+    for (i = 0; i < user->nenv; i++)
+	if (!strncmp(user->envp[i], name, nlen) && user->envp[i][nlen] == '=')
+	{
+	    w_free(user->envp[i]);
+	    user->envp[i] = entry;
+	    return 0;
+	}
+
+    user->envp = (char **) w_realloc(user->envp, (user->nenv + 2) * sizeof(char *));
+    user->envp[user->nenv++] = entry;
+    user->envp[user->nenv] = NULL;
+    return 0;
+}
+
+/* the child writes in blocking mode, we read without blocking */
+static int launch_pipes(int out[2], int err[2])
+{
+    if (pipe2(out, O_CLOEXEC) < 0)
+	return -1;
+    if (pipe2(err, O_CLOEXEC) < 0)
+    {
+	close(out[0]);
+	close(out[1]);
+	return -1;
+    }
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/* same credentials as us, in a new process group so that the whole job
+   can be signaled */
+static pid_t launch_spawn(launch_user_t *user, const char *command, int out, int err)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t none, all;
+    char *argv[4];
+    pid_t pid;
+    int rc;
+
+    argv[0] = user->shell;
+    argv[1] = "-c";
+    argv[2] = (char *) command;
+    argv[3] = NULL;
+
+    sigemptyset(&none);
+    sigfillset(&all);
+    posix_spawnattr_init(&attr);
+    /* glibc spawns with CLONE_VM | CLONE_VFORK */
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+			     POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, out, 1);
+    posix_spawn_file_actions_adddup2(&fa, err, 2);
+    posix_spawn_file_actions_addchdir_np(&fa, user->home);
+
+    rc = posix_spawn(&pid, user->shell, &fa, &attr, argv, user->envp);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (rc != 0)
+    {
+	errno = rc;
+	return -1;
+    }
+    return pid;
+}
+
+/* Another user: posix_spawn cannot change credentials. The child only
+   makes raw syscalls, the libc wrappers of setuid() and friends would
+   signal the threads of the parent, whose memory the child shares */
+static pid_t launch_vfork(launch_user_t *user, const char *command, int out, int err)
+{
+    char *argv[4];
+    sigset_t none, old, all;
+    struct launch_ksigaction sa;
+    pid_t pid;
+    int fd, i;
+
+    argv[0] = user->shell;
+    argv[1] = "-c";
+    argv[2] = (char *) command;
+    argv[3] = NULL;
+
+    /* no handler of ours may run in the child */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    if ((pid = vfork()) == 0)
+    {
+	/* as POSIX_SPAWN_SETSIGDEF does, SIGKILL and SIGSTOP just fail */
+	memset(&sa, 0, sizeof(sa));
+	sa.handler = SIG_DFL;
+	for (i = 1; i <= LAUNCH_KSIGSET * 8; i++)
+	    syscall(SYS_rt_sigaction, i, &sa, NULL, LAUNCH_KSIGSET);
+
+	setpgid(0, 0);
+	if ((fd = open("/dev/null", O_RDONLY)) >= 0 && fd != 0)
+	{
+	    dup2(fd, 0);
+	    close(fd);
+	}
+	dup2(out, 1);
+	dup2(err, 2);
+
+	if (syscall(SYS_setgroups, user->ngroups, user->groups) < 0 ||
+	    syscall(SYS_setresgid, user->gid, user->gid, user->gid) < 0 ||
+	    syscall(SYS_setresuid, user->uid, user->uid, user->uid) < 0)
+	    _exit(126);
+	if (chdir(user->home) < 0 && chdir("/") < 0)
+	    _exit(126);
+
+	sigemptyset(&none);
+	syscall(SYS_rt_sigprocmask, SIG_SETMASK, &none, NULL, LAUNCH_KSIGSET);
+	execve(user->shell, argv, user->envp);
+	_exit(127);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return pid;
+}
+
+static int launcher_may_run(launcher_t *launcher, launch_user_t *user)
+{
+    return (launcher->max_total == 0 || launcher->running < launcher->max_total) &&
+	(launcher->max_user == 0 || user->running < launcher->max_user);
+}
+
+static int launcher_start(launcher_t *launcher, launch_user_t *user, launch_job_t *job)
+{
+    struct timespec ts;
+    int out[2], err[2], i;
+    long ms;
+
+    if (launch_pipes(out, err) < 0)
+    {
+	message(MSG_ERR, errno, "launcher: unable to create pipes");
+	launcher->failed++;
+	return -1;
+    }
+
+    if (user->uid == launcher->euid)
+	job->pid = launch_spawn(user, job->command, out[1], err[1]);
+    else
+	job->pid = launch_vfork(user, job->command, out[1], err[1]);
+
+    /* both return once the child called exec */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    close(out[1]);
+    close(err[1]);
+
+    if (job->pid < 0)
+    {
+	message(MSG_ERR, errno, "launcher: unable to start job of %s", user->name);
+	close(out[0]);
+	close(err[0]);
+	job->pid = 0;
+	launcher->failed++;
+	return -1;
+    }
+    job->out_fd = out[0];
+    job->err_fd = err[0];
+
+    user->running++;
+    launcher->running++;
+    launcher->started++;
+
+    ms = (ts.tv_sec - job->scheduled) * 1000 + ts.tv_nsec / 1000000;
+    job->latency_ms = (ms > 0) ? ms : 0;
+    if (job->latency_ms > launcher->latency_max)
+	launcher->latency_max = job->latency_ms;
+    for (i = 0; i < LAUNCH_HIST - 1 && job->latency_ms >= (1L << i); i++)
+	;
+    launcher->latency_hist[i]++;
+
+    message(MSG_DEBUG, 0, "launcher: job of %s started, pid %d, %ld ms late\n",
+	    user->name, (int) job->pid, job->latency_ms);
+    return 0;
+}
+
+launcher_t *launcher_create(int max_total, int max_user)
+{
+    launcher_t *launcher;
+
+    launcher = (launcher_t *) w_malloc(sizeof(launcher_t));
+    launcher->max_total = max_total;
+    launcher->max_user = max_user;
+    launcher->euid = geteuid();
+    launcher->users = xhash_init(NULL);
+    xdlist_init(&launcher->queue);
+    return launcher;
+}
+
+/* waiting jobs are dropped from the queue, they belong to the caller */
+void launcher_destroy(launcher_t *launcher)
+{
+    xhash_iter_t it;
+    launch_user_t *user;
+
+    if (launcher == NULL)
+	return;
+
+    while (!XDLIST_ISEMPTY(&launcher->queue))
+	xdlist_remove(XDLIST_FIRST(&launcher->queue));
+
+    xhash_iter_init(launcher->users, &it);
+    while (xhash_iter_next(&it, NULL, (void **)&user))
+	launch_user_free(user);
+    xhash_destroy(launcher->users);
+    w_free(launcher);
+}
+
+/* a variable set in the crontab of user, for its next jobs */
+int launcher_setenv(launcher_t *launcher, const char *user, const char *name, const char *value)
+{
+    launch_user_t *u;
+
+    if (launcher == NULL || name == NULL || value == NULL)
+	return -1;
+    if ((u = launcher_user(launcher, user)) == NULL)
+	return -1;
+
+    if (!strcmp(name, "SHELL"))
+    {
+	w_free(u->shell);
+	u->shell = strdup(value);
+    }
+    return launch_env_set(u, name, value);
+}
+
+/* Returns 1 when the job was started, 0 when it waits for a slot, -1 on
+   error */
+int launcher_submit(launcher_t *launcher, launch_job_t *job)
+{
+    launch_user_t *user;
+
+    if (launcher == NULL || job == NULL || job->user == NULL || job->command == NULL)
+	return -1;
+    if ((user = launcher_user(launcher, job->user)) == NULL)
+	return -1;
+
+    /* waiting jobs are all held by a limit that this one may not hit:
+       they do not hold it back */
+    if (!launcher_may_run(launcher, user))
+    {
+	xdlist_insert_tail(&launcher->queue, &job->node);
+	launcher->queued++;
+	return 0;
+    }
+
+    return (launcher_start(launcher, user, job) < 0) ? -1 : 1;
+}
+
+/* The process of job is gone: start the waiting jobs that now fit,
+   oldest first. Every job taken out of the queue goes to fn, with a pid
+   of 0 when it could not be started. Returns how many started */
+int launcher_done(launcher_t *launcher, launch_job_t *job, launch_fn_t fn, void *arg)
+{
+    launch_user_t *user;
+    xdlist_node_t *node, *tmp;
+    launch_job_t *next;
+    int started = 0;
+
+    if (launcher == NULL)
+	return -1;
+
+    if (job != NULL && job->pid > 0 &&
+	(user = (launch_user_t *) xhash_value(launcher->users, (char *) job->user)) != NULL)
+    {
+	user->running--;
+	launcher->running--;
+	job->pid = 0;
+    }
+
+    FOR_XDLIST_SAFE(node, tmp, &launcher->queue)
+    {
+	if (launcher->max_total && launcher->running >= launcher->max_total)
+	    break;
+
+	next = XDLIST_ENTRY(node, launch_job_t, node);
+	if ((user = launcher_user(launcher, next->user)) == NULL)
+	{
+	    xdlist_remove(node);
+	    launcher->queued--;
+	    launcher->failed++;
+	    if (fn != NULL)
+		fn(next, arg);
+	    continue;
+	}
+	if (!launcher_may_run(launcher, user))
+	    continue;
+
+	xdlist_remove(node);
+	launcher->queued--;
+	if (launcher_start(launcher, user, next) == 0)
+	    started++;
+	if (fn != NULL)
+	    fn(next, arg);
+    }
+    return started;
+}
+
+void launcher_report(launcher_t *launcher)
+{
+    int i;
+
+    message(MSG_INFO, 0, "launcher: %lu started, %lu failed, %d running, %lu waiting, "
+	    "max latency %ld ms\n", launcher->started, launcher->failed,
+	    launcher->running, launcher->queued, launcher->latency_max);
+    for (i = 0; i < LAUNCH_HIST; i++)
+	if (launcher->latency_hist[i])
+	    message(MSG_INFO, 0, "launcher:   < %ld ms: %lu\n", 1L << i, launcher->latency_hist[i]);
+}
@@ -0,0 +1,103 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __LAUNCHER_H__
+#define __LAUNCHER_H__
+
+#include <time.h>
+
+#include "common.h"
+#include "xhash.h"
+#include "xdlist.h"
+
+/*
+ * Start job commands with "$SHELL -c command". The parent is never
+ * copied: posix_spawn() when the job runs as ourselves, vfork() and raw
+ * credential syscalls otherwise, both share the memory of the daemon
+ * until exec, whatever its size. The environment of a user is built
+ * once and reused by every job. Jobs over the global or per user limit
+ * wait in a FIFO until launcher_done() frees a slot.
+ */
+
+#define LAUNCH_HIST 16 /* latency histogram, bucket i is < 2^i ms */
+
+typedef struct launch_user {
+    char *name;
+    uid_t uid;
+    gid_t gid;
+    int ngroups;
+    gid_t *groups;
+    char *home;
+    char *shell;
+    int nenv;
+    char **envp;        /* NULL terminated, for execve */
+    int running;
+} launch_user_t;
+
+typedef struct launch_job {
+    xdlist_node_t node; /* in the queue while waiting */
+    const char *user;
+    const char *command;
+    time_t scheduled;   /* when it should have started */
+    pid_t pid;          /* 0 until started */
+    int out_fd;         /* read ends of stdout and stderr, non blocking */
+    int err_fd;
+    long latency_ms;    /* exec time - scheduled time */
+    void *data;
+} launch_job_t;
+
+typedef struct launcher {
+    int max_total;      /* 0 for no limit */
+    int max_user;
+    int running;
+    uid_t euid;
+    xhash_t *users;     /* name -> launch_user_t */
+    xdlist_t queue;
+    unsigned long queued;
+    unsigned long started;
+    unsigned long failed;
+    long latency_max;
+    unsigned long latency_hist[LAUNCH_HIST];
+} launcher_t;
+
+static __inline void launch_job_init(launch_job_t *job, const char *user,
+				     const char *command, time_t scheduled, void *data)
+{
+    xdlist_node_init(&job->node);
+    job->user = user;
+    job->command = command;
+    job->scheduled = scheduled;
+    job->pid = 0;
+    job->out_fd = job->err_fd = -1;
+    job->latency_ms = 0;
+    job->data = data;
+}
+
+/* called for each job taken out of the queue: started when its pid is
+   above 0, else its user or its start failed and the job is given back */
+typedef void (*launch_fn_t)(launch_job_t *job, void *arg);
+
+/* ------- API -------- */
+launcher_t *launcher_create(int max_total, int max_user);
+void launcher_destroy(launcher_t *launcher);
+int launcher_setenv(launcher_t *launcher, const char *user, const char *name, const char *value);
+int launcher_submit(launcher_t *launcher, launch_job_t *job);
+int launcher_done(launcher_t *launcher, launch_job_t *job, launch_fn_t fn, void *arg);
+void launcher_report(launcher_t *launcher);
+
+#endif /* __LAUNCHER_H__ */
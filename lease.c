@@ -0,0 +1,587 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include "common.h"
+#include "lease.h"
+
+static u_int64_t lease_clock(void);
+static int lease_hex(sview_t tok, u_int64_t *value);
+static int lease_name_ok(const char *name);
+static u_int64_t lease_next_token(lease_table_t *table);
+static int lease_get(lease_table_t *table, const char *name, lease_t *copy);
+static void lease_copy(const char *name, void *value, void *arg);
+static void *lease_grant(const char *name, const void *value, void *arg);
+static void *lease_extend(const char *name, const void *value, void *arg);
+static void *lease_drop(const char *name, const void *value, void *arg);
+static int lease_answer(lease_client_t *lc, sview_t line, u_int64_t sent);
+
+static u_int64_t lease_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int lease_hex(sview_t tok, u_int64_t *value)
+{
+    unsigned long i;
+    int c;
+
+    if (tok.len == 0 || tok.len > 16)
+	return -1;
+    *value = 0;
+    for (i = 0; i < tok.len; i++)
+    {
+	c = tok.ptr[i];
+	if (c >= '0' && c <= '9')
+	    c -= '0';
+	else if (c >= 'a' && c <= 'f')
+	    c -= 'a' - 10;
+	else
+	    return -1;
+	*value = (*value << 4) | c;
+    }
+    return 0;
+}
+
+/* names and holders travel as tokens of a line */
+static int lease_name_ok(const char *name)
+{
+    const char *p;
+
+    if (name == NULL || *name == '\0' || strlen(name) >= LEASE_HOLDER_MAX)
+	return 0;
+    for (p = name; *p; p++)
+	if (*p <= ' ')
+	    return 0;
+    return 1;
+}
+
+/* what a change to a lease is asked, and what came out of it */
+typedef struct lease_op {
+    lease_table_t *table;
+    const char *holder;
+    u_int64_t token;
+    u_int64_t now;
+    int ttl;
+    int ret;
+} lease_op_t;
+
+/* 0 when the reservation cannot be saved: better no lock than a token
+   that could come back after a restart */
+static u_int64_t lease_next_token(lease_table_t *table)
+{
+    char tmp[PATH_MAX];
+    u_int64_t token = 0;
+    FILE *f;
+
+    pthread_mutex_lock(&table->lock);
+    if (table->token == table->reserved)
+    {
+	if (table->path != NULL)
+	{
+	    snprintf(tmp, sizeof(tmp), "%s.tmp", table->path);
+	    if ((f = fopen(tmp, "w")) == NULL)
+	    {
+		message(MSG_ERR, errno, "lease: unable to write %s", tmp);
+		goto out;
+	    }
+	    fprintf(f, "%llu\n", (unsigned long long) (table->reserved + LEASE_TOKEN_BLOCK));
+	    if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+	    {
+		message(MSG_ERR, errno, "lease: unable to save %s", table->path);
+		fclose(f);
+		unlink(tmp);
+		goto out;
+	    }
+	    if (fclose(f) != 0 || rename(tmp, table->path) < 0)
+	    {
+		message(MSG_ERR, errno, "lease: unable to save %s", table->path);
+		unlink(tmp);
+		goto out;
+	    }
+	}
+	table->reserved += LEASE_TOKEN_BLOCK;
+    }
+    token = ++table->token;
+out:
+    pthread_mutex_unlock(&table->lock);
+    return token;
+}
+
+static void lease_copy(const char *name, void *value, void *arg)
+{
+    memcpy(arg, value, sizeof(lease_t));
+}
+
+/* a copy, the lease may be replaced as soon as its shard is unlocked */
+static int lease_get(lease_table_t *table, const char *name, lease_t *copy)
+{
+    return xchash_apply(table->leases, (char *) name, lease_copy, copy) ? 0 : -1;
+}
+
+/* xchash_update_t of lease_acquire() */
+static void *lease_grant(const char *name, const void *value, void *arg)
+{
+    const lease_t *lease = (const lease_t *) value;
+    lease_op_t *op = (lease_op_t *) arg;
+    lease_t *new;
+    u_int64_t t;
+
+    op->ret = -1;
+    if (lease->expires > op->now)
+    {
+	if (strcmp(lease->holder, op->holder) != 0)
+	    return NULL;
+	t = lease->token;
+    }
+    else if ((t = lease_next_token(op->table)) == 0)
+	return NULL;
+
+    new = (lease_t *) w_malloc(sizeof(lease_t));
+    strcpy(new->holder, op->holder);
+    new->token = t;
+    new->expires = op->now + op->ttl;
+    op->token = t;
+    op->ret = 0;
+    return new;
+}
+
+/* xchash_update_t of lease_renew() */
+static void *lease_extend(const char *name, const void *value, void *arg)
+{
+    const lease_t *lease = (const lease_t *) value;
+    lease_op_t *op = (lease_op_t *) arg;
+    lease_t *new;
+
+    op->ret = -1;
+    if (lease->token != op->token || lease->expires <= op->now ||
+	strcmp(lease->holder, op->holder) != 0)
+	return NULL;
+    new = (lease_t *) w_malloc(sizeof(lease_t));
+    memcpy(new, lease, sizeof(lease_t));
+    new->expires = op->now + op->ttl;
+    op->ret = 0;
+    return new;
+}
+
+/* xchash_update_t of lease_release() */
+static void *lease_drop(const char *name, const void *value, void *arg)
+{
+    const lease_t *lease = (const lease_t *) value;
+    lease_op_t *op = (lease_op_t *) arg;
+    lease_t *new;
+
+    op->ret = -1;
+    if (lease->token != op->token)
+	return NULL;
+    new = (lease_t *) w_malloc(sizeof(lease_t));
+    memcpy(new, lease, sizeof(lease_t));
+    new->expires = 0;
+    op->ret = 0;
+    return new;
+}
+
+/* path keeps the highest token reserved, NULL for tokens that only
+   grow as long as the process lives */
+lease_table_t *lease_table_create(const char *path)
+{
+    lease_table_t *table;
+    unsigned long long reserved = 0;
+    FILE *f;
+
+    table = (lease_table_t *) w_malloc(sizeof(lease_table_t));
+    if (path != NULL)
+    {
+	if ((f = fopen(path, "r")) != NULL)
+	{
+	    if (fscanf(f, "%llu", &reserved) != 1)
+	    {
+		message(MSG_ERR, 0, "lease: %s is corrupted\n", path);
+		fclose(f);
+		w_free(table);
+		return NULL;
+	    }
+	    fclose(f);
+	}
+	else if (errno != ENOENT)
+	{
+	    message(MSG_ERR, errno, "lease: unable to read %s", path);
+	    w_free(table);
+	    return NULL;
+	}
+	table->path = strdup(path);
+    }
+    table->token = table->reserved = reserved;
+    pthread_mutex_init(&table->lock, NULL);
+    if ((table->leases = xchash_init(LEASE_SHARDS)) == NULL)
+    {
+	message(MSG_ERR, 0, "lease: unable to create the table\n");
+	pthread_mutex_destroy(&table->lock);
+	w_free(table->path);
+	w_free(table);
+	return NULL;
+    }
+    return table;
+}
+
+void lease_table_destroy(lease_table_t *table)
+{
+    if (table == NULL)
+	return;
+    xchash_destroy(table->leases);
+    pthread_mutex_destroy(&table->lock);
+    w_free(table->path);
+    w_free(table);
+}
+
+/* Grant name to holder for ttl ms. A holder asking again keeps its
+   token, so that a lost answer can be retried. Returns -1 when someone
+   else has it */
+int lease_acquire(lease_table_t *table, const char *name, const char *holder, int ttl,
+		  u_int64_t now, u_int64_t *token)
+{
+    lease_op_t op;
+    lease_t *lease;
+    u_int64_t t;
+    char *key;
+
+    if (!lease_name_ok(name) || !lease_name_ok(holder) || ttl <= 0)
+	return -1;
+
+    op.table = table;
+    op.holder = holder;
+    op.now = now;
+    op.ttl = ttl;
+    for (;;)
+    {
+	if (xchash_update(table->leases, (char *) name, lease_grant, &op))
+	{
+	    if (op.ret == 0)
+		*token = op.token;
+	    return op.ret;
+	}
+
+	/* first grant of name, unless another worker beats us to it */
+	if ((t = lease_next_token(table)) == 0)
+	    return -1;
+	lease = (lease_t *) w_malloc(sizeof(lease_t));
+	strcpy(lease->holder, holder);
+	lease->token = t;
+	lease->expires = now + ttl;
+	key = strdup(name);
+	if (xchash_add(table->leases, key, lease))
+	{
+	    *token = t;
+	    return 0;
+	}
+	w_free(key);
+	w_free(lease);
+    }
+}
+
+/* only for the current holder, before the lease expires */
+int lease_renew(lease_table_t *table, const char *name, const char *holder, u_int64_t token,
+		int ttl, u_int64_t now)
+{
+    lease_op_t op;
+
+    if (ttl <= 0)
+	return -1;
+    op.holder = holder;
+    op.token = token;
+    op.now = now;
+    op.ttl = ttl;
+    if (!xchash_update(table->leases, (char *) name, lease_extend, &op))
+	return -1;
+    return op.ret;
+}
+
+int lease_release(lease_table_t *table, const char *name, u_int64_t token)
+{
+    lease_op_t op;
+
+    op.token = token;
+    if (!xchash_update(table->leases, (char *) name, lease_drop, &op))
+	return -1;
+    return op.ret;
+}
+
+/* may a write carrying token change name now */
+int lease_fence(lease_table_t *table, const char *name, u_int64_t token, u_int64_t now)
+{
+    lease_t lease;
+
+    if (lease_get(table, name, &lease) < 0 || lease.token != token || lease.expires <= now)
+	return -1;
+    return 0;
+}
+
+/* a jobsync_fence_t, arg is a lease_guard_t. The times given to the
+   table must be CLOCK_MONOTONIC ms, like the client side uses */
+int lease_guard(u_int64_t token, void *arg)
+{
+    lease_guard_t *guard = (lease_guard_t *) arg;
+
+    return lease_fence(guard->table, guard->name, token, lease_clock());
+}
+
+/*
+ * Answer the lease lines at the start of req and move req past them:
+ *   L A name holder ttl        -> L G name token ttl | L D name holder left
+ *   L W name holder token ttl  -> L G name token ttl | L X name
+ *   L U name token             -> L K name
+ * Numbers are hex. Returns the number of lines, -1 on a bad one
+ */
+int lease_handle(lease_table_t *table, sview_t *req, sbuf_t *resp, u_int64_t now)
+{
+    sview_t rest, line, tok, op, name, holder;
+    char n[LEASE_HOLDER_MAX], h[LEASE_HOLDER_MAX];
+    u_int64_t token, ttl;
+    lease_t lease;
+    int count = 0;
+
+    rest = *req;
+    while (rest.len >= 2 && rest.ptr[0] == 'L' && rest.ptr[1] == ' ')
+    {
+	sview_cut(&rest, '\n', &line);
+	sview_token(&line, &tok);
+	if (!sview_token(&line, &op) || !sview_token(&line, &name) || name.len >= LEASE_HOLDER_MAX)
+	    goto bad;
+	memcpy(n, name.ptr, name.len);
+	n[name.len] = '\0';
+
+	if (sview_eq(op, "A") || sview_eq(op, "W"))
+	{
+	    if (!sview_token(&line, &holder) || holder.len >= LEASE_HOLDER_MAX)
+		goto bad;
+	    memcpy(h, holder.ptr, holder.len);
+	    h[holder.len] = '\0';
+	    token = 0;
+	    if (sview_eq(op, "W") && (!sview_token(&line, &tok) || lease_hex(tok, &token) < 0))
+		goto bad;
+	    if (!sview_token(&line, &tok) || lease_hex(tok, &ttl) < 0 || ttl == 0 || ttl > INT_MAX)
+		goto bad;
+
+	    if (sview_eq(op, "W") ? lease_renew(table, n, h, token, (int) ttl, now) == 0 :
+		lease_acquire(table, n, h, (int) ttl, now, &token) == 0)
+		sbuf_appendf(resp, "L G %s %llx %llx\n", n, (unsigned long long) token,
+			     (unsigned long long) ttl);
+	    else if (sview_eq(op, "W"))
+		sbuf_appendf(resp, "L X %s\n", n);
+	    else if (lease_get(table, n, &lease) == 0 && lease.expires > now)
+		sbuf_appendf(resp, "L D %s %s %llx\n", n, lease.holder,
+			     (unsigned long long) (lease.expires - now));
+	    else
+		goto bad; /* no token could be reserved */
+	}
+	else if (sview_eq(op, "U"))
+	{
+	    if (!sview_token(&line, &tok) || lease_hex(tok, &token) < 0)
+		goto bad;
+	    lease_release(table, n, token);
+	    sbuf_appendf(resp, "L K %s\n", n);
+	}
+	else
+	    goto bad;
+	count++;
+    }
+    *req = rest;
+    return count;
+
+bad:
+    sbuf_append(resp, "L E\n", 4);
+    return -1;
+}
+
+lease_client_t *lease_client_create(const char *holder, lease_send_t send, void *arg)
+{
+    lease_client_t *lc;
+
+    if (!lease_name_ok(holder) || send == NULL)
+	return NULL;
+    lc = (lease_client_t *) w_malloc(sizeof(lease_client_t));
+    lc->holder = strdup(holder);
+    lc->held = xhash_init(NULL);
+    lc->send = send;
+    lc->arg = arg;
+    SBUF_NEW(lc->req, 256);
+    return lc;
+}
+
+void lease_client_destroy(lease_client_t *lc)
+{
+    if (lc == NULL)
+	return;
+    xhash_destroy(lc->held);
+    SBUF_FREE(lc->req);
+    w_free(lc->holder);
+    w_free(lc);
+}
+
+/* an answer line to what we sent at sent */
+static int lease_answer(lease_client_t *lc, sview_t line, u_int64_t sent)
+{
+    sview_t tok, op, name;
+    char n[LEASE_HOLDER_MAX];
+    u_int64_t token, ttl;
+    lease_held_t *held;
+
+    sview_token(&line, &tok);
+    if (!sview_token(&line, &op) || sview_eq(op, "E"))
+	return -1;
+    if (!sview_token(&line, &name) || name.len >= LEASE_HOLDER_MAX)
+	return -1;
+    memcpy(n, name.ptr, name.len);
+    n[name.len] = '\0';
+
+    if (sview_eq(op, "G"))
+    {
+	if (!sview_token(&line, &tok) || lease_hex(tok, &token) < 0 ||
+	    !sview_token(&line, &tok) || lease_hex(tok, &ttl) < 0)
+	    return -1;
+	if ((held = (lease_held_t *) xhash_value(lc->held, n)) == NULL)
+	{
+	    held = (lease_held_t *) w_malloc(sizeof(lease_held_t));
+	    xhash_add(lc->held, strdup(n), held);
+	}
+	held->token = token;
+	held->ttl = (int) ttl;
+	/* the server started counting after we sent */
+	held->expires = sent + ttl;
+    }
+    else
+	xhash_remove(lc->held, n);
+    return 0;
+}
+
+/* One round trip. Returns -1 when the lease is held by another node or
+   the server could not be reached */
+int lease_client_acquire(lease_client_t *lc, const char *name, int ttl, u_int64_t *token)
+{
+    lease_held_t *held;
+    sbuf_t *req, *resp;
+    int ret;
+
+    if (!lease_name_ok(name) || ttl <= 0)
+	return -1;
+    SBUF_NEW(req, 256);
+    SBUF_NEW(resp, 256);
+    sbuf_appendf(req, "L A %s %s %x\n", name, lc->holder, ttl);
+    ret = lease_client_send(req, resp, lc);
+    SBUF_FREE(req);
+    SBUF_FREE(resp);
+    if (ret < 0 || (held = (lease_held_t *) xhash_value(lc->held, (char *) name)) == NULL)
+	return -1;
+    *token = held->token;
+    return 0;
+}
+
+int lease_client_release(lease_client_t *lc, const char *name)
+{
+    lease_held_t *held;
+    sbuf_t *req, *resp;
+    int ret;
+
+    if ((held = (lease_held_t *) xhash_value(lc->held, (char *) name)) == NULL)
+	return -1;
+    SBUF_NEW(req, 256);
+    SBUF_NEW(resp, 256);
+    sbuf_appendf(req, "L U %s %llx\n", name, (unsigned long long) held->token);
+    xhash_remove(lc->held, (char *) name);
+    ret = lease_client_send(req, resp, lc);
+    SBUF_FREE(req);
+    SBUF_FREE(resp);
+    return ret;
+}
+
+/* the token to put on a write, 0 when the lease may be gone */
+u_int64_t lease_client_token(lease_client_t *lc, const char *name)
+{
+    lease_held_t *held;
+
+    if ((held = (lease_held_t *) xhash_value(lc->held, (char *) name)) == NULL ||
+	held->expires <= lease_clock())
+	return 0;
+    return held->token;
+}
+
+/* renew what is due without waiting for sync traffic */
+int lease_client_renew(lease_client_t *lc)
+{
+    sbuf_t *req, *resp;
+    int ret;
+
+    SBUF_NEW(req, 256);
+    SBUF_NEW(resp, 256);
+    ret = lease_client_send(req, resp, lc);
+    SBUF_FREE(req);
+    SBUF_FREE(resp);
+    return ret;
+}
+
+/* A jobsync_send_t taking the client as arg: leases past half of their
+   ttl are renewed in front of req, and the answers taken off resp */
+int lease_client_send(sbuf_t *req, sbuf_t *resp, void *arg)
+{
+    lease_client_t *lc = (lease_client_t *) arg;
+    lease_held_t *held;
+    xhash_iter_t it;
+    sview_t rest, line;
+    u_int64_t sent;
+    char *name;
+    int ret;
+
+    sent = lease_clock();
+    sbuf_reset(lc->req);
+    xhash_iter_init(lc->held, &it);
+    while (xhash_iter_next(&it, &name, (void **) &held))
+    {
+	if (held->expires <= sent)
+	    xhash_remove(lc->held, name);
+	else if (held->expires - sent < (u_int64_t) held->ttl / 2)
+	    sbuf_appendf(lc->req, "L W %s %s %llx %x\n", name, lc->holder,
+			 (unsigned long long) held->token, held->ttl);
+    }
+    if (lc->req->len == 0 && req->len == 0)
+	return 0;
+    sbuf_append(lc->req, req->buffer, req->len);
+
+    sbuf_reset(resp);
+    if ((ret = lc->send(lc->req, resp, lc->arg)) < 0)
+	return ret;
+
+    rest = sbuf_view(resp);
+    while (rest.len >= 2 && rest.ptr[0] == 'L' && rest.ptr[1] == ' ')
+    {
+	sview_cut(&rest, '\n', &line);
+	if (lease_answer(lc, line, sent) < 0)
+	    ret = -1;
+    }
+    memmove(resp->buffer, rest.ptr, rest.len);
+    resp->len = rest.len;
+    resp->buffer[resp->len] = '\0';
+    return ret;
+}
@@ -0,0 +1,115 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __LEASE_H__
+#define __LEASE_H__
+
+#include "common.h"
+#include <pthread.h>
+
+#include "xhash.h"
+#include "xchash.h"
+
+/*
+ * Edit locks on shared crontabs. The node keeping the crontabs grants
+ * leases: a name belongs to one holder until ttl ms after the last
+ * grant or renewal. Each grant gets a fencing token higher than every
+ * token given before, across restarts too when a state file is given,
+ * tokens being reserved on disk by blocks. A write to a crontab carries
+ * the token of its lease and lease_fence() refuses it unless that lease
+ * is still the current one, so that a holder that stalled past its
+ * expiry cannot overwrite the work of the next one.
+ *
+ * lease_guard() plugs lease_fence() into jobsync_set_fence(), for the
+ * pushes of jobs to the shared crontab.
+ *
+ * The table is shared by the workers of the server: leases live in an
+ * xchash and are never changed in place, a grant or a renewal replaces
+ * the lease of the name under the lock of its shard. Fences, run for
+ * every write, only take that lock for reading.
+ *
+ * Requests are lines starting with "L ", answered by one line each, and
+ * may lead the body of any other request: lease_handle() eats them and
+ * leaves the rest to jobsync_handle(). On the client side,
+ * lease_client_send() wraps a jobsync_send_t and puts the due renewals
+ * in front of the sync requests, so a busy node renews for free.
+ */
+
+#define LEASE_HOLDER_MAX  64
+#define LEASE_TOKEN_BLOCK 1024
+#define LEASE_SHARDS      16
+
+typedef struct lease {
+    char holder[LEASE_HOLDER_MAX];
+    u_int64_t token;
+    u_int64_t expires;  /* ms, server clock */
+} lease_t;
+
+typedef struct lease_table {
+    xchash_t *leases;   /* name -> lease_t, expired ones are reused */
+    pthread_mutex_t lock; /* token and reserved */
+    u_int64_t token;    /* last given */
+    u_int64_t reserved; /* on disk: tokens up to it may have been given */
+    char *path;
+} lease_table_t;
+
+/* arg of lease_guard(): the lease that protects the shared jobs */
+typedef struct lease_guard {
+    lease_table_t *table;
+    const char *name;
+} lease_guard_t;
+
+/* same as jobsync_send_t */
+typedef int (*lease_send_t)(sbuf_t *req, sbuf_t *resp, void *arg);
+
+typedef struct lease_held {
+    u_int64_t token;
+    u_int64_t expires;  /* ms, client clock, counted from the request */
+    int ttl;
+} lease_held_t;
+
+typedef struct lease_client {
+    char *holder;
+    xhash_t *held;      /* name -> lease_held_t */
+    lease_send_t send;
+    void *arg;
+    sbuf_t *req;
+} lease_client_t;
+
+/* ------- API -------- */
+lease_table_t *lease_table_create(const char *path);
+void lease_table_destroy(lease_table_t *table);
+int lease_acquire(lease_table_t *table, const char *name, const char *holder, int ttl,
+		  u_int64_t now, u_int64_t *token);
+int lease_renew(lease_table_t *table, const char *name, const char *holder, u_int64_t token,
+		int ttl, u_int64_t now);
+int lease_release(lease_table_t *table, const char *name, u_int64_t token);
+int lease_fence(lease_table_t *table, const char *name, u_int64_t token, u_int64_t now);
+int lease_guard(u_int64_t token, void *arg);
+int lease_handle(lease_table_t *table, sview_t *req, sbuf_t *resp, u_int64_t now);
+
+lease_client_t *lease_client_create(const char *holder, lease_send_t send, void *arg);
+void lease_client_destroy(lease_client_t *lc);
+int lease_client_acquire(lease_client_t *lc, const char *name, int ttl, u_int64_t *token);
+int lease_client_release(lease_client_t *lc, const char *name);
+u_int64_t lease_client_token(lease_client_t *lc, const char *name);
+int lease_client_renew(lease_client_t *lc);
+int lease_client_send(sbuf_t *req, sbuf_t *resp, void *arg);
+
+#endif /* __LEASE_H__ */
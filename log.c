@@ -0,0 +1,442 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Asynchronous logging.
+ *
+ * Every thread calling message() gets a ring of records of its own. The
+ * thread formats its message in the next free slot and publishes it by
+ * moving the head of the ring: there is one writer and one reader per
+ * ring, so no lock is needed. A single log thread drains all the rings
+ * and writes them to the sink in big chunks. It sleeps on an eventfd,
+ * which is written only by the first message after a drain. With
+ * LP_BLOCK, a thread finding its ring full sleeps on a condition until
+ * the log thread has drained it.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "log.h"
+
+/* written by the log thread in one go */
+#define LOG_BATCH_SIZE (64 * 1024)
+
+msg_level_t general_msg_level = MSG_DEBUG;
+volatile int log_running = 0;
+const char *msg_tags[] = { "[DEBUG]", "[INFO]", "[NOTICE]",
+			   "[WARNING]", "[ERROR]", "[CRITICAL]",
+			   "[ALERT]", "[FATAL]" };
+
+typedef struct log_record
+{
+    msg_level_t level;
+    int len;
+    char text[LOG_RECORD_MAX];
+} log_record_t;
+
+typedef struct log_ring
+{
+    unsigned long head; /* next slot to write, owner thread only */
+    unsigned long tail __attribute__((aligned(64))); /* next slot to read, log thread only */
+    unsigned long dropped;
+    unsigned long reported;
+    int orphan; /* owner thread has exited */
+    struct log_ring *next;
+    log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t mutex; /* protects the list of rings */
+    pthread_cond_t room; /* a ring was drained, for LP_BLOCK */
+    int waiting; /* threads sleeping on room, under mutex */
+    pthread_key_t key;
+    log_ring_t *rings;
+    unsigned int gen; /* one per log_start, to forget rings of a previous run */
+    int efd;
+    int wake;
+    int stop;
+    log_sink_t sink;
+    log_policy_t policy;
+    int fd;
+    unsigned long dropped;
+} logger = { .mutex = PTHREAD_MUTEX_INITIALIZER, .room = PTHREAD_COND_INITIALIZER,
+	     .efd = -1, .fd = -1 };
+
+static __thread log_ring_t *thread_ring = NULL;
+static __thread unsigned int thread_ring_gen = 0;
+
+static const int syslog_prio[] = { LOG_DEBUG, LOG_INFO, LOG_NOTICE,
+				   LOG_WARNING, LOG_ERR, LOG_CRIT,
+				   LOG_ALERT, LOG_EMERG };
+
+static void log_ring_orphan(void *arg);
+static log_ring_t *log_ring_get(void);
+static void log_wakeup(void);
+static int log_drain(char *batch);
+static void *log_thread_routine(void *arg);
+
+/* thread exit: the log thread frees the ring once drained */
+static void log_ring_orphan(void *arg)
+{
+    log_ring_t *ring = (log_ring_t *)arg;
+
+    __atomic_store_n(&ring->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static log_ring_t *log_ring_get(void)
+{
+    log_ring_t *ring;
+
+    if (thread_ring != NULL && thread_ring_gen == logger.gen)
+	return thread_ring;
+
+    if ((ring = (log_ring_t *) malloc(sizeof(log_ring_t))) == NULL)
+	return NULL;
+    ring->head = ring->tail = 0;
+    ring->dropped = ring->reported = 0;
+    ring->orphan = 0;
+
+    pthread_mutex_lock(&logger.mutex);
+    ring->next = logger.rings;
+    logger.rings = ring;
+    pthread_mutex_unlock(&logger.mutex);
+
+    pthread_setspecific(logger.key, ring);
+    thread_ring = ring;
+    thread_ring_gen = logger.gen;
+    return ring;
+}
+
+static void log_wakeup(void)
+{
+    u_int64_t one = 1;
+
+    /* pairs with the exchange in the log thread: either it sees our
+       record, or we see wake at 0 and write the eventfd */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logger.wake, __ATOMIC_RELAXED))
+	return;
+    if (__atomic_exchange_n(&logger.wake, 1, __ATOMIC_SEQ_CST))
+	return;
+    if (write(logger.efd, &one, sizeof(one)) < 0)
+	return; /* the log thread still drains on stop */
+}
+
+void log_vmessage(msg_level_t level, int err_code, const char *fmt, va_list va)
+{
+    log_ring_t *ring;
+    log_record_t *rec;
+    unsigned long h, t;
+    char errbuf[128];
+    int n;
+
+    if ((ring = log_ring_get()) == NULL)
+	return;
+
+    h = ring->head;
+    t = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (h - t >= LOG_RING_SIZE)
+    {
+	if (logger.policy == LP_DROP || !log_running)
+	{
+	    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+	    log_wakeup();
+	    return;
+	}
+	/* sleep until the log thread moved our tail, it does so with the
+	   mutex held and signals room before releasing it */
+	pthread_mutex_lock(&logger.mutex);
+	logger.waiting++;
+	log_wakeup();
+	while (h - ring->tail >= LOG_RING_SIZE && log_running)
+	    pthread_cond_wait(&logger.room, &logger.mutex);
+	logger.waiting--;
+	pthread_mutex_unlock(&logger.mutex);
+	t = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+
+    rec = &ring->records[h % LOG_RING_SIZE];
+    rec->level = level;
+    n = vsnprintf(rec->text, LOG_RECORD_MAX, fmt, va);
+    if (n < 0)
+	n = 0;
+    else if (n >= LOG_RECORD_MAX)
+	n = LOG_RECORD_MAX - 1;
+
+    if (err_code)
+    {
+	if (strerror_r(err_code, errbuf, sizeof(errbuf)))
+	    snprintf(errbuf, sizeof(errbuf), "error %d", err_code);
+	n += snprintf(rec->text + n, LOG_RECORD_MAX - n, ": %s\n", errbuf);
+	if (n >= LOG_RECORD_MAX)
+	    n = LOG_RECORD_MAX - 1;
+    }
+    rec->len = n;
+
+    __atomic_store_n(&ring->head, h + 1, __ATOMIC_RELEASE);
+    log_wakeup();
+}
+
+static void log_write_batch(const char *batch, size_t len)
+{
+    ssize_t w;
+
+    while (len > 0)
+    {
+	if ((w = write(logger.fd, batch, len)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return; /* nowhere to complain */
+	}
+	batch += w;
+	len -= w;
+    }
+}
+
+/* empty all rings, returns the number of records written */
+static int log_drain(char *batch)
+{
+    log_ring_t *ring, **prev;
+    log_record_t *rec;
+    unsigned long h, t, dropped;
+    size_t len, need;
+    char note[64];
+    int count;
+
+    len = 0;
+    count = 0;
+    dropped = 0;
+
+    pthread_mutex_lock(&logger.mutex);
+    prev = &logger.rings;
+    while ((ring = *prev) != NULL)
+    {
+	t = ring->tail;
+	h = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	for (; t != h; t++)
+	{
+	    rec = &ring->records[t % LOG_RING_SIZE];
+	    if (logger.sink == LS_SYSLOG)
+	    {
+		syslog(syslog_prio[rec->level], "%.*s", rec->len, rec->text);
+	    }
+	    else
+	    {
+		need = strlen(msg_tags[rec->level]) + 1 + rec->len;
+		if (len + need > LOG_BATCH_SIZE)
+		{
+		    log_write_batch(batch, len);
+		    len = 0;
+		}
+		len += sprintf(batch + len, "%s ", msg_tags[rec->level]);
+		memcpy(batch + len, rec->text, rec->len);
+		len += rec->len;
+	    }
+	    count++;
+	}
+	__atomic_store_n(&ring->tail, t, __ATOMIC_RELEASE);
+
+	h = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	dropped += h - ring->reported;
+	ring->reported = h;
+
+	/* the owner is gone and cannot write anymore */
+	if (__atomic_load_n(&ring->orphan, __ATOMIC_ACQUIRE) &&
+	    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == t)
+	{
+	    *prev = ring->next;
+	    free(ring);
+	    continue;
+	}
+	prev = &ring->next;
+    }
+    if (logger.waiting)
+	pthread_cond_broadcast(&logger.room);
+    pthread_mutex_unlock(&logger.mutex);
+
+    if (dropped)
+    {
+	logger.dropped += dropped;
+	if (logger.sink == LS_SYSLOG)
+	    syslog(LOG_WARNING, "log: %lu messages dropped", dropped);
+	else
+	{
+	    need = snprintf(note, sizeof(note), "%s log: %lu messages dropped\n",
+			    msg_tags[MSG_WARN], dropped);
+	    if (len + need > LOG_BATCH_SIZE)
+	    {
+		log_write_batch(batch, len);
+		len = 0;
+	    }
+	    memcpy(batch + len, note, need);
+	    len += need;
+	}
+    }
+
+    if (len > 0)
+	log_write_batch(batch, len);
+
+    return count;
+}
+
+static void *log_thread_routine(void *arg)
+{
+    char *batch;
+    u_int64_t v;
+
+    batch = (char *) w_malloc(LOG_BATCH_SIZE);
+
+    while (1)
+    {
+	if (read(logger.efd, &v, sizeof(v)) < 0 && errno != EINTR)
+	    break;
+
+	/* messages published after this are followed by a new wakeup */
+	__atomic_exchange_n(&logger.wake, 0, __ATOMIC_SEQ_CST);
+	log_drain(batch);
+
+	if (__atomic_load_n(&logger.stop, __ATOMIC_ACQUIRE))
+	{
+	    log_drain(batch);
+	    break;
+	}
+    }
+
+    w_free(batch);
+    pthread_exit(NULL);
+
+    return (void *)NULL;
+}
+
+/* path is only used with LS_FILE */
+int log_start(log_sink_t sink, const char *path, log_policy_t policy)
+{
+    int err;
+
+    if (log_running)
+	return -1;
+
+    logger.sink = sink;
+    logger.policy = policy;
+    logger.stop = 0;
+    logger.wake = 0;
+    logger.dropped = 0;
+
+    switch (sink)
+    {
+    case LS_FILE:
+	if (path == NULL)
+	    return -1;
+	if ((logger.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0640)) < 0)
+	{
+	    print_err(errno, "Unable to open log file %s", path);
+	    return -1;
+	}
+	break;
+    case LS_SYSLOG:
+	openlog("cornet", LOG_PID | LOG_NDELAY, LOG_CRON);
+	logger.fd = -1;
+	break;
+    case LS_STDERR:
+    default:
+	logger.fd = STDERR_FILENO;
+	break;
+    }
+
+    if ((logger.efd = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+	print_err(errno, "Unable to create log eventfd");
+	goto error;
+    }
+
+    if ((err = pthread_key_create(&logger.key, log_ring_orphan)) != 0)
+    {
+	print_err(err, "Unable to create log thread key");
+	close(logger.efd);
+	goto error;
+    }
+    logger.gen++;
+
+    if ((err = pthread_create(&logger.thread, NULL, log_thread_routine, NULL)) != 0)
+    {
+	print_err(err, "Unable to create log thread");
+	pthread_key_delete(logger.key);
+	close(logger.efd);
+	goto error;
+    }
+
+    log_running = 1;
+    return 0;
+
+error:
+    if (sink == LS_FILE)
+	close(logger.fd);
+    logger.fd = -1;
+    logger.efd = -1;
+    return -1;
+}
+
+/* flush everything queued and go back to synchronous messages. Threads
+   must not be in the middle of a message() call */
+int log_stop(void)
+{
+    log_ring_t *ring, *next;
+    u_int64_t one = 1;
+
+    if (!log_running)
+	return -1;
+
+    log_running = 0;
+    __atomic_store_n(&logger.stop, 1, __ATOMIC_RELEASE);
+    if (write(logger.efd, &one, sizeof(one)) < 0)
+	print_err(errno, "Unable to wake up log thread");
+    pthread_join(logger.thread, NULL);
+
+    pthread_key_delete(logger.key);
+    pthread_mutex_lock(&logger.mutex);
+    for (ring = logger.rings; ring != NULL; ring = next)
+    {
+	next = ring->next;
+	free(ring);
+    }
+    logger.rings = NULL;
+    pthread_mutex_unlock(&logger.mutex);
+
+    close(logger.efd);
+    logger.efd = -1;
+    if (logger.sink == LS_FILE)
+	close(logger.fd);
+    else if (logger.sink == LS_SYSLOG)
+	closelog();
+    logger.fd = -1;
+
+    return 0;
+}
+
+/* total of messages lost because of LP_DROP */
+unsigned long log_dropped(void)
+{
+    return logger.dropped;
+}
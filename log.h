@@ -0,0 +1,44 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "common.h"
+
+/* Where the log thread writes */
+typedef enum {
+    LS_STDERR, LS_FILE, LS_SYSLOG
+} log_sink_t;
+
+/* What a thread does when its ring is full */
+typedef enum {
+    LP_DROP, /* lose the message, count it, report the count later */
+    LP_BLOCK /* wait for the log thread to make room */
+} log_policy_t;
+
+/* number of records per thread and max length of a formatted message */
+#define LOG_RING_SIZE 256
+#define LOG_RECORD_MAX 512
+
+/* ------- API -------- */
+int log_start(log_sink_t sink, const char *path, log_policy_t policy);
+int log_stop(void);
+unsigned long log_dropped(void);
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,163 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "owner.h"
+
+static int owner_find(owner_t *owner, u_int64_t hash);
+static void owner_name(const struct sockaddr_in *addr, char *name);
+
+/* nodes are kept sorted by hash, ties between weights go to the lower
+   hash the same way everywhere */
+static int owner_find(owner_t *owner, u_int64_t hash)
+{
+    int lo = 0, hi = owner->count;
+
+    while (lo < hi)
+    {
+	int mid = (lo + hi) / 2;
+
+	if (owner->nodes[mid].hash < hash)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* nodes are named "address:port" after their gossip address, the same
+   way on every node */
+static void owner_name(const struct sockaddr_in *addr, char *name)
+{
+    char ip[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    snprintf(name, OWNER_NAME_MAX, "%s:%d", ip, ntohs(addr->sin_port));
+}
+
+/* this node is named after the address g advertises, as the others
+   see it through owner_follow(). It takes part from the start */
+owner_t *owner_create(const gossip_t *g)
+{
+    char self[OWNER_NAME_MAX];
+    owner_t *owner;
+
+    owner_name(&g->self, self);
+    owner = (owner_t *) w_malloc(sizeof(owner_t));
+    owner->self = xhash_wyhash(self, strlen(self), 0);
+    if (owner_add(owner, self) < 0)
+    {
+	w_free(owner);
+	return NULL;
+    }
+    return owner;
+}
+
+void owner_destroy(owner_t *owner)
+{
+    if (owner == NULL)
+	return;
+    w_free(owner->nodes);
+    w_free(owner);
+}
+
+/* returns 1 when added, 0 when already there */
+int owner_add(owner_t *owner, const char *name)
+{
+    u_int64_t hash;
+    int i;
+
+    if (name == NULL || strlen(name) >= OWNER_NAME_MAX)
+	return -1;
+    hash = xhash_wyhash(name, strlen(name), 0);
+    i = owner_find(owner, hash);
+    if (i < owner->count && owner->nodes[i].hash == hash)
+	return 0;
+
+    if (owner->count == owner->size)
+    {
+	owner->size = owner->size ? owner->size * 2 : 16;
+	owner->nodes = (owner_node_t *) w_realloc(owner->nodes, owner->size * sizeof(owner_node_t));
+    }
+    memmove(&owner->nodes[i + 1], &owner->nodes[i], (owner->count - i) * sizeof(owner_node_t));
+    owner->nodes[i].hash = hash;
+    strcpy(owner->nodes[i].name, name);
+    owner->count++;
+    return 1;
+}
+
+/* we never remove ourselves: a node that runs jobs takes part */
+int owner_remove(owner_t *owner, const char *name)
+{
+    u_int64_t hash;
+    int i;
+
+    if (name == NULL)
+	return -1;
+    hash = xhash_wyhash(name, strlen(name), 0);
+    i = owner_find(owner, hash);
+    if (i == owner->count || owner->nodes[i].hash != hash || hash == owner->self)
+	return 0;
+    memmove(&owner->nodes[i], &owner->nodes[i + 1], (owner->count - i - 1) * sizeof(owner_node_t));
+    owner->count--;
+    return 1;
+}
+
+/* the node running job, the id of jobsync */
+const owner_node_t *owner_lookup(owner_t *owner, u_int64_t job)
+{
+    const owner_node_t *best;
+    u_int64_t w, max;
+    int i;
+
+    best = &owner->nodes[0];
+    max = owner_weight(job, best->hash);
+    for (i = 1; i < owner->count; i++)
+    {
+	if ((w = owner_weight(job, owner->nodes[i].hash)) > max)
+	{
+	    max = w;
+	    best = &owner->nodes[i];
+	}
+    }
+    return best;
+}
+
+int owner_mine(owner_t *owner, u_int64_t job)
+{
+    return owner_lookup(owner, job)->hash == owner->self;
+}
+
+/* A gossip_change_t taking the owner as arg. A suspect keeps its jobs,
+   they move once it is declared dead, so that a slow node does not make
+   them flap */
+void owner_follow(const gossip_member_t *member, void *arg)
+{
+    char name[OWNER_NAME_MAX];
+
+    owner_name(&member->addr, name);
+    if (member->state == GS_ALIVE)
+	owner_add((owner_t *) arg, name);
+    else if (member->state == GS_DEAD)
+	owner_remove((owner_t *) arg, name);
+}
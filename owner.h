@@ -0,0 +1,67 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __OWNER_H__
+#define __OWNER_H__
+
+#include "common.h"
+#include "xhash.h"
+#include "gossip.h"
+
+/*
+ * Which node runs a shared job: rendezvous hashing over the live nodes.
+ * Each (job, node) pair gets a weight mixing the job id with the hash of
+ * the node name, and the node of highest weight owns the job. Every node
+ * computes the same answer from its own view of the membership, nothing
+ * is exchanged when a job fires. Names and weights are hashed with
+ * wyhash under a fixed seed, not a random one, so that all nodes agree.
+ * When a node joins or leaves, only the jobs it wins or owned change
+ * hands, about 1/N of them.
+ */
+
+#define OWNER_NAME_MAX 64
+
+typedef struct owner_node {
+    u_int64_t hash;
+    char name[OWNER_NAME_MAX];
+} owner_node_t;
+
+typedef struct owner {
+    owner_node_t *nodes;
+    int count;
+    int size;
+    u_int64_t self;     /* hash of our own name */
+} owner_t;
+
+/* the weight of a node for a job */
+static __inline u_int64_t owner_weight(u_int64_t job, u_int64_t node)
+{
+    return _xhash_wymix(job ^ _xhash_wysecret[0], node ^ _xhash_wysecret[1]);
+}
+
+/* ------- API -------- */
+owner_t *owner_create(const gossip_t *g);
+void owner_destroy(owner_t *owner);
+int owner_add(owner_t *owner, const char *name);
+int owner_remove(owner_t *owner, const char *name);
+const owner_node_t *owner_lookup(owner_t *owner, u_int64_t job);
+int owner_mine(owner_t *owner, u_int64_t job);
+void owner_follow(const gossip_member_t *member, void *arg);
+
+#endif /* __OWNER_H__ */
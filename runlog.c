@@ -0,0 +1,487 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "common.h"
+#include "runlog.h"
+
+#define RUNLOG_VERSION 1
+#define RUNLOG_POS(SEQ, I) (((u_int64_t) (SEQ) << 32) | (u_int64_t) (I))
+
+static void runlog_path(runlog_t *log, u_int64_t seq, char *path, size_t len);
+static int runlog_segment_map(runlog_t *log, u_int64_t seq, int create);
+static void runlog_segment_unmap(runlog_segment_t *seg);
+static void runlog_rehash(runlog_t *log, unsigned long size);
+static runlog_runs_t *runlog_runs(runlog_t *log, u_int64_t job, int create);
+static void runlog_index(runlog_t *log, u_int64_t pos, const run_record_t *rec);
+static const run_record_t *runlog_record(runlog_t *log, u_int64_t pos);
+static void runlog_forget(runlog_t *log, u_int64_t first);
+static void runlog_trim(runlog_t *log);
+static int runlog_seq_cmp(const void *a, const void *b);
+
+static void runlog_path(runlog_t *log, u_int64_t seq, char *path, size_t len)
+{
+    snprintf(path, len, "%s/runlog.%016llx", log->dir, (unsigned long long) seq);
+}
+
+/* map a segment at the end of the list */
+static int runlog_segment_map(runlog_t *log, u_int64_t seq, int create)
+{
+    char path[PATH_MAX];
+    runlog_segment_t *seg;
+    sbuf_t *map;
+
+    runlog_path(log, seq, path, sizeof(path));
+    if ((map = file_map_write(path, create ? (int) log->segment_size : 0)) == NULL)
+	return -1;
+    if (map->size < sizeof(runlog_header_t) + sizeof(run_record_t))
+    {
+	message(MSG_ERR, 0, "runlog: %s is too small\n", path);
+	file_map_unload(map);
+	return -1;
+    }
+
+    if (log->nsegments == log->size)
+    {
+	log->size = log->size ? log->size * 2 : 8;
+	log->segments = (runlog_segment_t *) w_realloc(log->segments,
+							log->size * sizeof(runlog_segment_t));
+    }
+    seg = &log->segments[log->nsegments];
+    seg->seq = seq;
+    seg->map = map;
+    seg->header = (runlog_header_t *) map->buffer;
+    seg->records = (run_record_t *) (map->buffer + sizeof(runlog_header_t));
+    seg->capacity = (map->size - sizeof(runlog_header_t)) / sizeof(run_record_t);
+
+    if (create)
+    {
+	memcpy(seg->header->magic, RUNLOG_MAGIC, 8);
+	seg->header->version = RUNLOG_VERSION;
+	seg->header->record_size = sizeof(run_record_t);
+	seg->header->seq = seq;
+	seg->header->count = 0;
+    }
+    else if (memcmp(seg->header->magic, RUNLOG_MAGIC, 8) != 0 ||
+	     seg->header->version != RUNLOG_VERSION ||
+	     seg->header->record_size != sizeof(run_record_t) ||
+	     seg->header->seq != seq || seg->header->count > seg->capacity)
+    {
+	message(MSG_ERR, 0, "runlog: %s is not a valid segment\n", path);
+	file_map_unload(map);
+	return -1;
+    }
+    log->nsegments++;
+    return 0;
+}
+
+static void runlog_segment_unmap(runlog_segment_t *seg)
+{
+    file_map_unload(seg->map);
+    seg->map = NULL;
+}
+
+/* move the jobs to a table of size slots, the emptied ones are left out */
+static void runlog_rehash(runlog_t *log, unsigned long size)
+{
+    runlog_runs_t *old, *r;
+    unsigned long i, n, mask;
+
+    old = log->jobs;
+    n = log->jobs_size;
+    log->jobs_size = size;
+    log->jobs = (runlog_runs_t *) w_malloc(log->jobs_size * sizeof(runlog_runs_t));
+    mask = log->jobs_size - 1;
+    for (i = 0; i < n; i++)
+    {
+	if (old[i].size == 0)
+	    continue;
+	for (r = &log->jobs[(old[i].job * 0x9e3779b97f4a7c15ULL >> 20) & mask]; r->size != 0;
+	     r = &log->jobs[(r - log->jobs + 1) & mask])
+	    ;
+	*r = old[i];
+    }
+    w_free(old);
+}
+
+static runlog_runs_t *runlog_runs(runlog_t *log, u_int64_t job, int create)
+{
+    runlog_runs_t *r;
+    unsigned long i, mask;
+
+    if (create && (log->njobs + 1) * 2 > log->jobs_size)
+	runlog_rehash(log, log->jobs_size ? log->jobs_size * 2 : 1024);
+    if (log->jobs_size == 0)
+	return NULL;
+
+    mask = log->jobs_size - 1;
+    for (i = (job * 0x9e3779b97f4a7c15ULL >> 20) & mask; log->jobs[i].size != 0; i = (i + 1) & mask)
+	if (log->jobs[i].job == job)
+	    return &log->jobs[i];
+    if (!create)
+	return NULL;
+
+    r = &log->jobs[i];
+    r->job = job;
+    r->size = 4;
+    r->pos = (u_int64_t *) w_malloc(r->size * sizeof(u_int64_t));
+    log->njobs++;
+    return r;
+}
+
+static void runlog_index(runlog_t *log, u_int64_t pos, const run_record_t *rec)
+{
+    runlog_runs_t *r;
+    runlog_mark_t *m;
+
+    if (rec->end > log->last_time)
+	log->last_time = rec->end;
+    if (log->appended++ % RUNLOG_SPARSE == 0)
+    {
+	if (log->nmarks == log->marks_size)
+	{
+	    /* reuse the room of the marks of removed segments */
+	    if (log->first_mark > log->nmarks / 2)
+	    {
+		memmove(log->marks, log->marks + log->first_mark,
+			(log->nmarks - log->first_mark) * sizeof(runlog_mark_t));
+		log->nmarks -= log->first_mark;
+		log->first_mark = 0;
+	    }
+	    else
+	    {
+		log->marks_size = log->marks_size ? log->marks_size * 2 : 256;
+		log->marks = (runlog_mark_t *) w_realloc(log->marks,
+							 log->marks_size * sizeof(runlog_mark_t));
+	    }
+	}
+	m = &log->marks[log->nmarks++];
+	m->time = log->last_time;
+	m->pos = pos;
+    }
+
+    r = runlog_runs(log, rec->job, 1);
+    if (r->count == r->size)
+    {
+	if (r->first > r->count / 2)
+	{
+	    memmove(r->pos, r->pos + r->first, (r->count - r->first) * sizeof(u_int64_t));
+	    r->count -= r->first;
+	    r->first = 0;
+	}
+	else
+	{
+	    r->size *= 2;
+	    r->pos = (u_int64_t *) w_realloc(r->pos, r->size * sizeof(u_int64_t));
+	}
+    }
+    r->pos[r->count++] = pos;
+}
+
+/* NULL once its segment is gone */
+static const run_record_t *runlog_record(runlog_t *log, u_int64_t pos)
+{
+    runlog_segment_t *seg;
+    u_int64_t seq;
+
+    seq = pos >> 32;
+    if (log->nsegments == 0 || seq < log->segments[0].seq ||
+	seq - log->segments[0].seq >= (u_int64_t) log->nsegments)
+	return NULL;
+    seg = &log->segments[seq - log->segments[0].seq];
+    if ((pos & 0xffffffffULL) >= seg->header->count)
+	return NULL;
+    return &seg->records[pos & 0xffffffffULL];
+}
+
+/* Forget the runs before first, in removed segments. A job left with
+   none is dropped and the table shrinks with the jobs, so that the index
+   follows the budget of the disk and not every job ever seen */
+static void runlog_forget(runlog_t *log, u_int64_t first)
+{
+    runlog_runs_t *r;
+    unsigned long i, size, dropped = 0;
+
+    for (i = 0; i < log->jobs_size; i++)
+    {
+	r = &log->jobs[i];
+	if (r->size == 0)
+	    continue;
+	/* positions only grow */
+	while (r->first < r->count && r->pos[r->first] < first)
+	    r->first++;
+	if (r->first == r->count)
+	{
+	    w_free(r->pos);
+	    memset(r, 0, sizeof(runlog_runs_t));
+	    log->njobs--;
+	    dropped++;
+	    continue;
+	}
+	if (r->first > 0)
+	{
+	    memmove(r->pos, r->pos + r->first, (r->count - r->first) * sizeof(u_int64_t));
+	    r->count -= r->first;
+	    r->first = 0;
+	}
+	if (r->size > 4 && r->count * 4 <= r->size)
+	{
+	    r->size /= 2;
+	    r->pos = (u_int64_t *) w_realloc(r->pos, r->size * sizeof(u_int64_t));
+	}
+    }
+
+    /* the probe chains of the kept jobs may go through the dropped ones */
+    if (dropped)
+    {
+	for (size = log->jobs_size; size > 1024 && log->njobs * 4 < size; size /= 2)
+	    ;
+	runlog_rehash(log, size);
+    }
+}
+
+/* drop the oldest segments over the budget, the current one stays */
+static void runlog_trim(runlog_t *log)
+{
+    char path[PATH_MAX];
+    u_int64_t first;
+    int removed = 0;
+
+    while (log->nsegments > 1 && (unsigned long) log->nsegments * log->segment_size > log->budget)
+    {
+	runlog_path(log, log->segments[0].seq, path, sizeof(path));
+	runlog_segment_unmap(&log->segments[0]);
+	if (unlink(path) < 0)
+	    message(MSG_ERR, errno, "runlog: unable to remove %s", path);
+	log->nsegments--;
+	memmove(log->segments, log->segments + 1, log->nsegments * sizeof(runlog_segment_t));
+	removed++;
+    }
+    if (!removed)
+	return;
+
+    first = RUNLOG_POS(log->segments[0].seq, 0);
+    while (log->first_mark < log->nmarks && log->marks[log->first_mark].pos < first)
+	log->first_mark++;
+    runlog_forget(log, first);
+}
+
+static int runlog_seq_cmp(const void *a, const void *b)
+{
+    u_int64_t x = *(const u_int64_t *) a, y = *(const u_int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Open the log kept in dir, a segment_size of 0 is RUNLOG_SEGMENT_SIZE.
+   Existing segments are indexed again and checked, a segment that does
+   not follow the previous one ends the log there */
+runlog_t *runlog_open(const char *dir, unsigned long segment_size, unsigned long budget)
+{
+    runlog_t *log;
+    DIR *d;
+    struct dirent *de;
+    unsigned long long seq;
+    u_int64_t *seqs = NULL, i, j;
+    unsigned long nseqs = 0, size = 0;
+    runlog_segment_t *seg;
+
+    if ((d = opendir(dir)) == NULL)
+    {
+	message(MSG_ERR, errno, "runlog: unable to open %s", dir);
+	return NULL;
+    }
+    while ((de = readdir(d)) != NULL)
+    {
+	if (sscanf(de->d_name, "runlog.%16llx", &seq) != 1 || strlen(de->d_name) != 23)
+	    continue;
+	if (nseqs == size)
+	{
+	    size = size ? size * 2 : 16;
+	    seqs = (u_int64_t *) w_realloc(seqs, size * sizeof(u_int64_t));
+	}
+	seqs[nseqs++] = seq;
+    }
+    closedir(d);
+    if (nseqs)
+	qsort(seqs, nseqs, sizeof(u_int64_t), runlog_seq_cmp);
+
+    log = (runlog_t *) w_malloc(sizeof(runlog_t));
+    log->dir = strdup(dir);
+    log->segment_size = segment_size ? segment_size : RUNLOG_SEGMENT_SIZE;
+    log->budget = budget;
+    log->last_time = INT64_MIN;
+
+    for (i = 0; i < nseqs; i++)
+    {
+	if (log->nsegments && seqs[i] != log->segments[log->nsegments - 1].seq + 1)
+	{
+	    message(MSG_ERR, 0, "runlog: segment %llx is missing, the log ends before\n",
+		    (unsigned long long) log->segments[log->nsegments - 1].seq + 1);
+	    break;
+	}
+	if (runlog_segment_map(log, seqs[i], 0) < 0)
+	    break;
+	seg = &log->segments[log->nsegments - 1];
+	for (j = 0; j < seg->header->count; j++)
+	    runlog_index(log, RUNLOG_POS(seg->seq, j), &seg->records[j]);
+    }
+    w_free(seqs);
+
+    if (log->nsegments == 0 && runlog_segment_map(log, 0, 1) < 0)
+    {
+	runlog_close(log);
+	return NULL;
+    }
+    runlog_trim(log);
+    return log;
+}
+
+void runlog_close(runlog_t *log)
+{
+    unsigned long i;
+    int s;
+
+    if (log == NULL)
+	return;
+    for (s = 0; s < log->nsegments; s++)
+	runlog_segment_unmap(&log->segments[s]);
+    for (i = 0; i < log->jobs_size; i++)
+	w_free(log->jobs[i].pos);
+    w_free(log->jobs);
+    w_free(log->marks);
+    w_free(log->segments);
+    w_free(log->dir);
+    w_free(log);
+}
+
+int runlog_append(runlog_t *log, const run_record_t *rec)
+{
+    runlog_segment_t *seg;
+    u_int64_t n;
+
+    seg = &log->segments[log->nsegments - 1];
+    if (seg->header->count == seg->capacity)
+    {
+	if (runlog_segment_map(log, seg->seq + 1, 1) < 0)
+	    return -1;
+	runlog_trim(log);
+	seg = &log->segments[log->nsegments - 1];
+    }
+
+    n = seg->header->count;
+    seg->records[n] = *rec;
+    /* the record is in before it is counted */
+    __atomic_store_n(&seg->header->count, n + 1, __ATOMIC_RELEASE);
+    runlog_index(log, RUNLOG_POS(seg->seq, n), rec);
+    return 0;
+}
+
+/* the last runs of job, newest first, returns how many */
+int runlog_last(runlog_t *log, u_int64_t job, run_record_t *recs, int max)
+{
+    runlog_runs_t *r;
+    const run_record_t *rec;
+    unsigned long i;
+    int n = 0;
+
+    if ((r = runlog_runs(log, job, 0)) == NULL)
+	return 0;
+    for (i = r->count; i > r->first && n < max; i--)
+    {
+	if ((rec = runlog_record(log, r->pos[i - 1])) == NULL)
+	{
+	    r->first = i;
+	    break;
+	}
+	recs[n++] = *rec;
+    }
+    return n;
+}
+
+/* Runs that ended in [from, to) ms, oldest first. Returns how many */
+long runlog_range(runlog_t *log, int64_t from, int64_t to, runlog_fn_t fn, void *arg)
+{
+    unsigned long lo, hi, mid;
+    u_int64_t pos, stop;
+    const run_record_t *rec;
+    runlog_segment_t *seg;
+    long n = 0;
+    int s;
+
+    /* the last mark before from, the first at or after to */
+    lo = log->first_mark;
+    hi = log->nmarks;
+    while (lo < hi)
+    {
+	mid = (lo + hi) / 2;
+	if (log->marks[mid].time < from)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    pos = (lo > log->first_mark) ? log->marks[lo - 1].pos : RUNLOG_POS(log->segments[0].seq, 0);
+    hi = log->nmarks;
+    while (lo < hi)
+    {
+	mid = (lo + hi) / 2;
+	if (log->marks[mid].time < to)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    stop = (lo < log->nmarks) ? log->marks[lo].pos : ~0ULL;
+
+    for (s = (int) ((pos >> 32) - log->segments[0].seq); s < log->nsegments; s++)
+    {
+	seg = &log->segments[s];
+	if (RUNLOG_POS(seg->seq, 0) > pos)
+	    pos = RUNLOG_POS(seg->seq, 0);
+	for (; (pos & 0xffffffffULL) < seg->header->count && pos < stop; pos++)
+	{
+	    rec = &seg->records[pos & 0xffffffffULL];
+	    if (rec->end >= from && rec->end < to)
+	    {
+		fn(rec, arg);
+		n++;
+	    }
+	}
+	if (pos >= stop)
+	    break;
+    }
+    return n;
+}
+
+/* to the disk, the page cache already survives a crash of the daemon */
+int runlog_sync(runlog_t *log)
+{
+    int s;
+
+    for (s = 0; s < log->nsegments; s++)
+	if (msync(log->segments[s].map->buffer, log->segments[s].map->size, MS_SYNC) < 0)
+	{
+	    message(MSG_ERR, errno, "runlog: unable to sync");
+	    return -1;
+	}
+    return 0;
+}
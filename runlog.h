@@ -0,0 +1,113 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __RUNLOG_H__
+#define __RUNLOG_H__
+
+#include "common.h"
+
+/*
+ * History of the job runs: fixed size binary records appended to
+ * segment files mapped in memory, runlog.<seq> in a directory. A
+ * segment is created at its full size and filled in place; the count
+ * in its header is updated after the record, so a record is there once
+ * it is counted. When a segment is full the next one is created, and
+ * the oldest ones are removed to keep the whole under a size budget.
+ *
+ * Two indexes are rebuilt in memory when the log is opened: a sparse
+ * one on the end time, a mark every RUNLOG_SPARSE records, and the list
+ * of the runs of each job. Records are appended as runs end, a clock
+ * step backwards does not reorder them: marks use the latest end time
+ * seen so far.
+ */
+
+#define RUNLOG_MAGIC  "CRNRLOG1"
+#define RUNLOG_SPARSE 64
+#define RUNLOG_SEGMENT_SIZE (4 * 1024 * 1024)
+
+typedef struct run_record {
+    u_int64_t job;          /* the id of jobsync */
+    int64_t scheduled;      /* s, when it was due */
+    int64_t start;          /* ms */
+    int64_t end;            /* ms */
+    u_int64_t out_offset;   /* where its output was kept */
+    u_int32_t out_len;
+    int32_t status;         /* as waitpid() gives it */
+} run_record_t;
+
+typedef struct runlog_header {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t record_size;
+    u_int64_t seq;
+    u_int64_t count;
+    u_int64_t unused[4];
+} runlog_header_t;
+
+typedef struct runlog_segment {
+    u_int64_t seq;
+    sbuf_t *map;
+    runlog_header_t *header;
+    run_record_t *records;
+    u_int64_t capacity;
+} runlog_segment_t;
+
+/* positions are (seq << 32 | index in the segment) */
+typedef struct runlog_mark {
+    int64_t time;
+    u_int64_t pos;
+} runlog_mark_t;
+
+typedef struct runlog_runs {
+    u_int64_t job;
+    u_int64_t *pos;     /* oldest first, from first on */
+    unsigned long first;
+    unsigned long count;
+    unsigned long size;
+} runlog_runs_t;
+
+typedef struct runlog {
+    char *dir;
+    unsigned long segment_size;
+    unsigned long budget;
+    runlog_segment_t *segments; /* oldest first, seqs follow each other */
+    int nsegments;
+    int size;
+    runlog_mark_t *marks;
+    unsigned long first_mark;
+    unsigned long nmarks;
+    unsigned long marks_size;
+    runlog_runs_t *jobs;    /* open addressing on the job id */
+    unsigned long njobs;
+    unsigned long jobs_size;
+    int64_t last_time;
+    u_int64_t appended;     /* records since the last mark */
+} runlog_t;
+
+typedef void (*runlog_fn_t)(const run_record_t *rec, void *arg);
+
+/* ------- API -------- */
+runlog_t *runlog_open(const char *dir, unsigned long segment_size, unsigned long budget);
+void runlog_close(runlog_t *log);
+int runlog_append(runlog_t *log, const run_record_t *rec);
+int runlog_last(runlog_t *log, u_int64_t job, run_record_t *recs, int max);
+long runlog_range(runlog_t *log, int64_t from, int64_t to, runlog_fn_t fn, void *arg);
+int runlog_sync(runlog_t *log);
+
+#endif /* __RUNLOG_H__ */
@@ -0,0 +1,503 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "common.h"
+#include "scheduler.h"
+#include "cronbatch.h"
+
+/* below this many entries, one by one is as fast as a batch */
+#define SCHED_BATCH_MIN 1024
+/* s walked by a batch for next times, the entries left go one by one */
+#define SCHED_BATCH_HORIZON 3600
+/* s walked by a batch for counts, a longer span is counted one by one */
+#define SCHED_BATCH_SPAN (3 * 3600)
+
+/* what the cron_batch callbacks work on */
+typedef struct sched_batch {
+    scheduler_t *sched;
+    cron_batch_t *batch;
+    sched_entry_t **entries;    /* in the order of the batch */
+    time_t from;
+    time_t to;
+    long *counts;
+    time_t *last;
+    unsigned long found;
+} sched_batch_t;
+
+static void sched_place(scheduler_t *sched, sched_entry_t *entry, unsigned long slot);
+static void sched_sift_up(scheduler_t *sched, unsigned long slot);
+static void sched_sift_down(scheduler_t *sched, unsigned long slot);
+static void sched_push(scheduler_t *sched, sched_entry_t *entry);
+static time_t sched_next(scheduler_t *sched, sched_entry_t *entry, time_t now);
+static void sched_batch_next(unsigned long idx, time_t t, void *arg);
+static void sched_next_all(scheduler_t *sched, sched_entry_t **entries, unsigned long n, time_t now);
+static void sched_batch_count(unsigned long idx, time_t t, void *arg);
+
+static void sched_place(scheduler_t *sched, sched_entry_t *entry, unsigned long slot)
+{
+    sched->heap[slot] = entry;
+    entry->slot = slot;
+}
+
+static void sched_sift_up(scheduler_t *sched, unsigned long slot)
+{
+    sched_entry_t *entry = sched->heap[slot];
+    unsigned long parent;
+
+    while (slot > 0)
+    {
+	parent = (slot - 1) / 2;
+	if (sched->heap[parent]->next <= entry->next)
+	    break;
+	sched_place(sched, sched->heap[parent], slot);
+	slot = parent;
+    }
+    sched_place(sched, entry, slot);
+}
+
+static void sched_sift_down(scheduler_t *sched, unsigned long slot)
+{
+    sched_entry_t *entry = sched->heap[slot];
+    unsigned long child;
+
+    while ((child = 2 * slot + 1) < sched->count)
+    {
+	if (child + 1 < sched->count && sched->heap[child + 1]->next < sched->heap[child]->next)
+	    child++;
+	if (entry->next <= sched->heap[child]->next)
+	    break;
+	sched_place(sched, sched->heap[child], slot);
+	slot = child;
+    }
+    sched_place(sched, entry, slot);
+}
+
+static void sched_push(scheduler_t *sched, sched_entry_t *entry)
+{
+    if (sched->count == sched->size)
+    {
+	sched->size = sched->size ? sched->size * 2 : 64;
+	sched->heap = (sched_entry_t **) w_realloc(sched->heap, sched->size * sizeof(sched_entry_t *));
+    }
+    sched_place(sched, entry, sched->count++);
+    sched_sift_up(sched, entry->slot);
+}
+
+/* the first match after now, moved by the offset of the entry */
+static time_t sched_next(scheduler_t *sched, sched_entry_t *entry, time_t now)
+{
+    time_t next;
+    int offset;
+
+    offset = scheduler_offset(sched, entry);
+    if ((next = cron_sched_next(entry->sched, now - offset)) < 0)
+	return -1;
+    return next + offset;
+}
+
+/* the first match after from - offset of the entry, which then leaves
+   the batch */
+static void sched_batch_next(unsigned long idx, time_t t, void *arg)
+{
+    sched_batch_t *b = (sched_batch_t *) arg;
+    sched_entry_t *entry = b->entries[idx];
+    int offset;
+
+    offset = scheduler_offset(b->sched, entry);
+    if (t <= b->from - offset)
+	return;
+    entry->next = t + offset;
+    cron_batch_set(b->batch, idx, NULL);
+    b->found++;
+}
+
+/* The next time after now of n entries, as sched_next() gives it. Many
+   entries are matched together against the minutes ahead, an hour at a
+   time, those found leaving the batch; the few left after
+   SCHED_BATCH_HORIZON, weekly jobs and the like, are searched one by
+   one */
+static void sched_next_all(scheduler_t *sched, sched_entry_t **entries, unsigned long n, time_t now)
+{
+    sched_batch_t b;
+    unsigned long i, k, left, old;
+    time_t from;
+
+    if (n < SCHED_BATCH_MIN)
+    {
+	for (i = 0; i < n; i++)
+	    entries[i]->next = sched_next(sched, entries[i], now);
+	return;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.sched = sched;
+    b.from = now;
+    b.entries = (sched_entry_t **) w_malloc(n * sizeof(sched_entry_t *));
+    b.batch = cron_batch_create(n);
+    for (i = 0; i < n; i++)
+    {
+	entries[i]->next = -1;
+	b.entries[i] = entries[i];
+	cron_batch_add(b.batch, entries[i]->sched);
+    }
+
+    /* with an offset, the match may be up to a window before now */
+    left = n;
+    for (from = now - ((sched->window > 1) ? sched->window : 0);
+	 from < now + SCHED_BATCH_HORIZON && left > 0; from += 3600)
+    {
+	b.found = 0;
+	cron_batch_scan(b.batch, from, from + 3600, sched_batch_next, &b);
+	left -= b.found;
+
+	/* a walk costs the whole batch, found entries or not */
+	if (left > 0 && left <= b.batch->count / 2)
+	{
+	    old = b.batch->count;
+	    cron_batch_destroy(b.batch);
+	    b.batch = cron_batch_create(left);
+	    for (i = 0, k = 0; i < old; i++)
+	    {
+		if (b.entries[i]->next >= 0)
+		    continue;
+		b.entries[k++] = b.entries[i];
+		cron_batch_add(b.batch, b.entries[i]->sched);
+	    }
+	}
+    }
+    cron_batch_destroy(b.batch);
+    w_free(b.entries);
+
+    for (i = 0; i < n && left > 0; i++)
+	if (entries[i]->next < 0)
+	    entries[i]->next = sched_next(sched, entries[i], now);
+}
+
+/* a match in ]from, to] once shifted by the offset of the entry */
+static void sched_batch_count(unsigned long idx, time_t t, void *arg)
+{
+    sched_batch_t *b = (sched_batch_t *) arg;
+    int offset;
+
+    offset = scheduler_offset(b->sched, b->entries[idx]);
+    if (t <= b->from - offset || t > b->to - offset)
+	return;
+    b->counts[idx]++;
+    b->last[idx] = t + offset;
+    b->found++;
+}
+
+scheduler_t *scheduler_create(unsigned long hint)
+{
+    scheduler_t *sched;
+
+    sched = (scheduler_t *) w_malloc(sizeof(scheduler_t));
+    sched->count = 0;
+    sched->size = hint;
+    sched->window = 0;
+    sched->salt = 0;
+    sched->heap = hint ? (sched_entry_t **) w_malloc(hint * sizeof(sched_entry_t *)) : NULL;
+    return sched;
+}
+
+/* entries are left to the caller */
+void scheduler_destroy(scheduler_t *sched)
+{
+    unsigned long i;
+
+    if (sched == NULL)
+	return;
+    for (i = 0; i < sched->count; i++)
+	sched->heap[i]->slot = SCHED_NONE;
+    w_free(sched->heap);
+    w_free(sched);
+}
+
+/* Queue entry for its first time after now. An entry that never fires
+   is not queued. Adding a queued entry reschedules it */
+int scheduler_add(scheduler_t *sched, sched_entry_t *entry, time_t now)
+{
+    if (sched == NULL || entry == NULL || entry->sched == NULL)
+	return -1;
+
+    scheduler_remove(sched, entry);
+    if ((entry->next = sched_next(sched, entry, now)) < 0)
+	return 0;
+    sched_push(sched, entry);
+    return 0;
+}
+
+/* Queue n entries at once, in O(n). They are not queued yet and their
+   next match after now is already set, from a snapshot, or SCHED_UNSET
+   to have it computed, all of them together. An entry with an offset
+   searches again from now - offset, a match a little before now may
+   still have its run ahead. Entries that never match, -1, are skipped */
+int scheduler_load(scheduler_t *sched, sched_entry_t *entries, unsigned long n, time_t now)
+{
+    sched_entry_t **todo;
+    unsigned long i, k;
+
+    if (sched == NULL || (entries == NULL && n > 0))
+	return -1;
+
+    if (sched->count + n > sched->size)
+    {
+	sched->size = sched->count + n;
+	sched->heap = (sched_entry_t **) w_realloc(sched->heap, sched->size * sizeof(sched_entry_t *));
+    }
+
+    todo = (sched_entry_t **) w_malloc((n ? n : 1) * sizeof(sched_entry_t *));
+    for (i = 0, k = 0; i < n; i++)
+    {
+	if (entries[i].slot != SCHED_NONE)
+	    continue;
+	if (entries[i].next == SCHED_UNSET ||
+	    (entries[i].next >= 0 && scheduler_offset(sched, &entries[i]) > 0))
+	    todo[k++] = &entries[i];
+    }
+    sched_next_all(sched, todo, k, now);
+    w_free(todo);
+
+    for (i = 0; i < n; i++)
+    {
+	if (entries[i].slot == SCHED_NONE && entries[i].next >= 0)
+	    sched_place(sched, &entries[i], sched->count++);
+    }
+
+    for (i = sched->count / 2; i-- > 0; )
+	sched_sift_down(sched, i);
+    return 0;
+}
+
+int scheduler_remove(scheduler_t *sched, sched_entry_t *entry)
+{
+    unsigned long slot;
+    sched_entry_t *last;
+
+    if (sched == NULL || entry == NULL || entry->slot == SCHED_NONE)
+	return -1;
+
+    slot = entry->slot;
+    entry->slot = SCHED_NONE;
+    last = sched->heap[--sched->count];
+    if (last == entry)
+	return 0;
+
+    /* the last entry fills the hole, then goes where it belongs */
+    sched_place(sched, last, slot);
+    if (slot > 0 && sched->heap[(slot - 1) / 2]->next > last->next)
+	sched_sift_up(sched, slot);
+    else
+	sched_sift_down(sched, slot);
+    return 0;
+}
+
+/* Compute every next time again from now, after the clock moved too
+   much for the queued ones to make sense. Returns the number of entries
+   that were due and will not fire */
+int scheduler_reschedule(scheduler_t *sched, time_t now)
+{
+    sched_entry_t *entry;
+    unsigned long i, kept;
+    int due;
+
+    if (sched == NULL)
+	return -1;
+
+    due = 0;
+    for (i = 0; i < sched->count; i++)
+	if (sched->heap[i]->next <= now)
+	    due++;
+    sched_next_all(sched, sched->heap, sched->count, now);
+
+    kept = 0;
+    for (i = 0; i < sched->count; i++)
+    {
+	entry = sched->heap[i];
+	if (entry->next < 0)
+	    entry->slot = SCHED_NONE;
+	else
+	    sched_place(sched, entry, kept++);
+    }
+    sched->count = kept;
+
+    /* bottom-up heap construction, O(n) */
+    for (i = sched->count / 2; i-- > 0; )
+	sched_sift_down(sched, i);
+    return due;
+}
+
+/* Spread keyed entries over window seconds, 0 to stop. The salt tells
+   this node from the others, the hash of its name for instance. Queued
+   entries keep the match they wait for, only its offset changes: a run
+   already done is not done again and a run waiting out its offset is
+   not lost */
+int scheduler_smooth(scheduler_t *sched, int window, u_int64_t salt)
+{
+    unsigned long i;
+
+    if (sched == NULL || window < 0)
+	return -1;
+
+    for (i = 0; i < sched->count; i++)
+	sched->heap[i]->next -= scheduler_offset(sched, sched->heap[i]);
+    sched->window = window;
+    sched->salt = salt;
+    for (i = 0; i < sched->count; i++)
+	sched->heap[i]->next += scheduler_offset(sched, sched->heap[i]);
+
+    for (i = sched->count / 2; i-- > 0; )
+	sched_sift_down(sched, i);
+    return 0;
+}
+
+/* seconds between a match of the schedule of entry and its run */
+int scheduler_offset(scheduler_t *sched, const sched_entry_t *entry)
+{
+    u_int64_t z;
+
+    if (sched->window <= 1 || entry->key == 0)
+	return 0;
+    /* splitmix64 finalizer */
+    z = entry->key ^ sched->salt;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (int) (z % (u_int64_t) sched->window);
+}
+
+/* earliest fire time, -1 when nothing is queued */
+time_t scheduler_next(scheduler_t *sched)
+{
+    if (sched == NULL || sched->count == 0)
+	return -1;
+    return sched->heap[0]->next;
+}
+
+/* Fire every entry due at now. Each one is queued again for its next
+   time after now before the callback, which may remove it. Returns the
+   number of entries fired */
+int scheduler_run(scheduler_t *sched, time_t now, sched_fire_t fire, void *arg)
+{
+    sched_entry_t *entry;
+    time_t when;
+    int fired;
+
+    if (sched == NULL || fire == NULL)
+	return -1;
+
+    fired = 0;
+    while (sched->count > 0 && sched->heap[0]->next <= now)
+    {
+	entry = sched->heap[0];
+	when = entry->next;
+
+	if ((entry->next = sched_next(sched, entry, now)) < 0)
+	    scheduler_remove(sched, entry);
+	else
+	    sched_sift_down(sched, 0);
+
+	fire(entry, when, arg);
+	fired++;
+    }
+    return fired;
+}
+
+/* After a downtime from since to now, give each queued entry that does
+   not skip its missed runs to the callback, which must not remove
+   entries. The runs are counted, not walked, so a week costs the same
+   as a minute. Returns the number of entries that missed runs */
+int scheduler_catchup(scheduler_t *sched, time_t since, time_t now, sched_missed_t missed, void *arg)
+{
+    sched_entry_t **entries;
+    unsigned long i, n;
+    long *counts;
+    time_t *last;
+    int done;
+
+    if (sched == NULL || missed == NULL)
+	return -1;
+
+    /* missed may not remove entries, the heap is walked in place */
+    n = sched->count;
+    entries = sched->heap;
+    counts = (long *) w_malloc((n ? n : 1) * sizeof(long));
+    last = (time_t *) w_malloc((n ? n : 1) * sizeof(time_t));
+    scheduler_count(sched, since, now, counts, last);
+
+    done = 0;
+    for (i = 0; i < n; i++)
+    {
+	if (entries[i]->policy == SP_SKIP || counts[i] == 0)
+	    continue;
+	missed(entries[i], last[i], (entries[i]->policy == SP_ONCE) ? 1 : counts[i], arg);
+	done++;
+    }
+    w_free(counts);
+    w_free(last);
+    return done;
+}
+
+/* Runs of each queued entry in ]since, now], shifted by its offset and
+   counted on the wall clock like cron_sched_count(): counts[i] for
+   sched->heap[i] and last[i], the latest one, set when counts[i] is not
+   0. Many entries over a short span are walked minute by minute
+   together, a long span is counted entry by entry, which then costs the
+   same for a week as for a minute. Returns the total */
+long scheduler_count(scheduler_t *sched, time_t since, time_t now, long *counts, time_t *last)
+{
+    sched_batch_t b;
+    sched_entry_t *entry;
+    unsigned long i;
+    long total;
+    int offset, window;
+
+    if (sched == NULL || counts == NULL || last == NULL)
+	return -1;
+
+    memset(counts, 0, sched->count * sizeof(long));
+    window = (sched->window > 1) ? sched->window : 0;
+    if (sched->count >= SCHED_BATCH_MIN && now - since + window <= SCHED_BATCH_SPAN)
+    {
+	memset(&b, 0, sizeof(b));
+	b.sched = sched;
+	b.entries = sched->heap;
+	b.from = since;
+	b.to = now;
+	b.counts = counts;
+	b.last = last;
+	b.batch = cron_batch_create(sched->count);
+	for (i = 0; i < sched->count; i++)
+	    cron_batch_add(b.batch, sched->heap[i]->sched);
+	cron_batch_scan(b.batch, since - window, now, sched_batch_count, &b);
+	cron_batch_destroy(b.batch);
+	return (long) b.found;
+    }
+
+    total = 0;
+    for (i = 0; i < sched->count; i++)
+    {
+	entry = sched->heap[i];
+	offset = scheduler_offset(sched, entry);
+	if ((counts[i] = cron_sched_count(entry->sched, since - offset, now - offset)) == 0)
+	    continue;
+	last[i] = cron_sched_prev(entry->sched, now - offset + 1) + offset;
+	total += counts[i];
+    }
+    return total;
+}
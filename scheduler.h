@@ -0,0 +1,99 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <time.h>
+
+#include "common.h"
+#include "crontab.h"
+
+/*
+ * Jobs waiting for their next fire time, in a binary min-heap. Each
+ * entry knows its slot in the heap, so that removing or rescheduling a
+ * job is O(log n) without searching for it. The caller sleeps until
+ * scheduler_next() and scheduler_run() only touches the jobs that fire.
+ *
+ * Smoothing is opt-in: with a window of w seconds, an entry with a key
+ * fires a fixed offset after each time its schedule matches, a hash of
+ * its key and of the node salt modulo w. Jobs sharing a minute are
+ * spread over the window, and so are the same jobs on other nodes,
+ * while each one keeps the same run time from one period to the next.
+ */
+
+#define SCHED_NONE ((unsigned long) -1) /* slot of an entry not queued */
+#define SCHED_UNSET ((time_t) -2)       /* next time left to scheduler_load() */
+
+/* what to do with the runs missed while the daemon was down */
+typedef enum {
+    SP_SKIP,    /* like cron: nothing */
+    SP_ONCE,    /* like anacron: one run for all of them */
+    SP_ALL      /* one run each */
+} sched_policy_t;
+
+/* entries belong to the caller, the heap only points to them */
+typedef struct sched_entry {
+    const cron_sched_t *sched;
+    time_t next;            /* -1 when it never fires */
+    unsigned long slot;
+    u_int64_t key;          /* hash of the job for smoothing, 0 for none */
+    sched_policy_t policy;
+    void *data;
+} sched_entry_t;
+
+typedef struct scheduler {
+    sched_entry_t **heap;
+    unsigned long count;
+    unsigned long size;
+    int window;             /* s, 0 when smoothing is off */
+    u_int64_t salt;         /* of this node */
+} scheduler_t;
+
+/* called once per entry due, after it was queued for its next time */
+typedef void (*sched_fire_t)(sched_entry_t *entry, time_t when, void *arg);
+
+/* runs missed by an entry, to do as its policy says: count is 1 for
+   SP_ONCE, last is the time of the latest one */
+typedef void (*sched_missed_t)(sched_entry_t *entry, time_t last, long count, void *arg);
+
+static __inline void sched_entry_init(sched_entry_t *entry, const cron_sched_t *sched, void *data)
+{
+    entry->sched = sched;
+    entry->next = -1;
+    entry->slot = SCHED_NONE;
+    entry->key = 0;
+    entry->policy = SP_SKIP;
+    entry->data = data;
+}
+
+/* ------- API -------- */
+scheduler_t *scheduler_create(unsigned long hint);
+void scheduler_destroy(scheduler_t *sched);
+int scheduler_add(scheduler_t *sched, sched_entry_t *entry, time_t now);
+int scheduler_load(scheduler_t *sched, sched_entry_t *entries, unsigned long n, time_t now);
+int scheduler_remove(scheduler_t *sched, sched_entry_t *entry);
+int scheduler_reschedule(scheduler_t *sched, time_t now);
+int scheduler_smooth(scheduler_t *sched, int window, u_int64_t salt);
+int scheduler_offset(scheduler_t *sched, const sched_entry_t *entry);
+time_t scheduler_next(scheduler_t *sched);
+int scheduler_run(scheduler_t *sched, time_t now, sched_fire_t fire, void *arg);
+int scheduler_catchup(scheduler_t *sched, time_t since, time_t now, sched_missed_t missed, void *arg);
+long scheduler_count(scheduler_t *sched, time_t since, time_t now, long *counts, time_t *last);
+
+#endif /* __SCHEDULER_H__ */
@@ -0,0 +1,375 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "supervisor.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define SUP_EVENTS 256
+#define SUP_READ   16384
+
+static int sup_pidfd_open(pid_t pid);
+static int sup_watch(supervisor_t *sup, int fd, sup_watch_t *w);
+static void sup_unwatch(supervisor_t *sup, int fd);
+static int sup_drain(supervisor_t *sup, sup_job_t *sj, sup_kind_t kind);
+static void sup_finish(supervisor_t *sup, sup_job_t *sj, int status);
+static int sup_reap(supervisor_t *sup, sup_job_t *sj);
+static int sup_reap_all(supervisor_t *sup);
+static void sup_poll(supervisor_t *sup, sup_job_t *sj);
+static int sup_reap_polled(supervisor_t *sup);
+
+static int sup_pidfd_open(pid_t pid)
+{
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int sup_watch(supervisor_t *sup, int fd, sup_watch_t *w)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    return epoll_ctl(sup->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* close() alone leaves the watch while a forked child holds a copy of
+   the fd, its events would then point to a freed job */
+static void sup_unwatch(supervisor_t *sup, int fd)
+{
+    epoll_ctl(sup->epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+/* Read what is there, keep it up to the limit. A few reads per call so
+   that a chatty job does not starve the others. Returns 1 on EOF */
+static int sup_drain(supervisor_t *sup, sup_job_t *sj, sup_kind_t kind)
+{
+    char buf[SUP_READ];
+    sbuf_t *sb;
+    int *fd, i;
+    ssize_t r;
+    unsigned long keep;
+
+    fd = (kind == SUP_OUT) ? &sj->job->out_fd : &sj->job->err_fd;
+    sb = (kind == SUP_OUT) ? sj->out : sj->err;
+    if (*fd < 0)
+	return 1;
+
+    for (i = 0; i < 4; i++)
+    {
+	if ((r = read(*fd, buf, sizeof(buf))) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN)
+		return 0;
+	    break;
+	}
+	if (r == 0)
+	    break;
+
+	keep = (sb->len < sup->max_output) ? sup->max_output - sb->len : 0;
+	if (keep > (unsigned long) r)
+	    keep = r;
+	if (keep)
+	    sbuf_append(sb, buf, keep);
+	sj->dropped += r - keep;
+	if (r < (ssize_t) sizeof(buf))
+	    return 0;
+    }
+    if (i == 4)
+	return 0;
+
+    /* EOF or error */
+    sup_unwatch(sup, *fd);
+    *fd = -1;
+    return 1;
+}
+
+static void sup_finish(supervisor_t *sup, sup_job_t *sj, int status)
+{
+    launch_job_t *job;
+    sbuf_t *out, *err;
+    unsigned long dropped;
+
+    /* whatever is left in the pipes, a background grandchild keeping
+       them open does not hold the job */
+    sup_drain(sup, sj, SUP_OUT);
+    sup_drain(sup, sj, SUP_ERR);
+    if (sj->job->out_fd >= 0)
+	sup_unwatch(sup, sj->job->out_fd);
+    if (sj->job->err_fd >= 0)
+	sup_unwatch(sup, sj->job->err_fd);
+    sj->job->out_fd = sj->job->err_fd = -1;
+    if (sj->pidfd >= 0)
+	sup_unwatch(sup, sj->pidfd);
+    if (sj->poll >= 0)
+    {
+	sup->polled[sj->poll] = sup->polled[--sup->npolled];
+	sup->polled[sj->poll]->poll = sj->poll;
+    }
+
+    /* forget it first: the callback may start a job that gets the same
+       pid */
+    job = sj->job;
+    out = sj->out;
+    err = sj->err;
+    dropped = sj->dropped;
+    xdlist_remove(&sj->link);
+    w_free(sj);
+    sup->running--;
+
+    if (sup->done != NULL)
+	sup->done(job, status, out, err, dropped, sup->arg);
+    SBUF_FREE(out);
+    SBUF_FREE(err);
+}
+
+/* returns 1 when the child was reaped, by us or by someone else */
+static int sup_reap(supervisor_t *sup, sup_job_t *sj)
+{
+    int status;
+    pid_t r;
+
+    while ((r = waitpid(sj->job->pid, &status, WNOHANG)) < 0 && errno == EINTR)
+	;
+    if (r < 0 && errno == ECHILD)
+	status = SUP_UNKNOWN;
+    else if (r <= 0)
+	return 0;
+    sup_finish(sup, sj, status);
+    return 1;
+}
+
+/* signalfd mode: SIGCHLD does not say which child, and signals of
+   several exits merge, so every job is asked. waitpid(-1) would also
+   reap the children of others in the process */
+static int sup_reap_all(supervisor_t *sup)
+{
+    struct signalfd_siginfo si;
+    xdlist_node_t *n, *tmp;
+    int done = 0;
+
+    while (read(sup->sigfd, &si, sizeof(si)) == sizeof(si))
+	;
+    /* a job started by a done callback goes at the tail, it is asked
+       too, which is harmless */
+    FOR_XDLIST_SAFE(n, tmp, &sup->jobs)
+	done += sup_reap(sup, XDLIST_ENTRY(n, sup_job_t, link));
+    return done;
+}
+
+/* no pidfd for this job, waitpid() it at each SUP_POLL */
+static void sup_poll(supervisor_t *sup, sup_job_t *sj)
+{
+    if (sup->npolled == sup->polled_size)
+    {
+	sup->polled_size = sup->polled_size ? sup->polled_size * 2 : 16;
+	sup->polled = (sup_job_t **) w_realloc(sup->polled, sup->polled_size * sizeof(sup_job_t *));
+    }
+    sj->poll = (long) sup->npolled;
+    sup->polled[sup->npolled++] = sj;
+}
+
+static int sup_reap_polled(supervisor_t *sup)
+{
+    unsigned long i;
+    int n = 0;
+
+    /* a job reaped is replaced by the last one at i */
+    for (i = 0; i < sup->npolled; )
+    {
+	if (sup_reap(sup, sup->polled[i]))
+	    n++;
+	else
+	    i++;
+    }
+    return n;
+}
+
+supervisor_t *supervisor_create(unsigned long max_output, sup_done_t done, void *arg)
+{
+    supervisor_t *sup;
+    sigset_t mask;
+    int fd;
+
+    sup = (supervisor_t *) w_malloc(sizeof(supervisor_t));
+    if ((sup->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+	message(MSG_ERR, errno, "supervisor: unable to create epoll");
+	w_free(sup);
+	return NULL;
+    }
+    sup->max_output = max_output ? max_output : SUP_OUTPUT_MAX;
+    sup->done = done;
+    sup->arg = arg;
+    xdlist_init(&sup->jobs);
+    sup->sigfd = -1;
+
+    /* probe pidfd support on ourselves */
+    if ((fd = sup_pidfd_open(getpid())) >= 0)
+    {
+	close(fd);
+	return sup;
+    }
+
+    message(MSG_INFO, 0, "supervisor: no pidfd, using signalfd\n");
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if ((sup->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+    {
+	message(MSG_ERR, errno, "supervisor: unable to create signalfd");
+	supervisor_destroy(sup);
+	return NULL;
+    }
+    sup->sigwatch.sj = NULL;
+    sup->sigwatch.kind = SUP_PID;
+    sup_watch(sup, sup->sigfd, &sup->sigwatch);
+    return sup;
+}
+
+/* jobs still running are forgotten, not killed */
+void supervisor_destroy(supervisor_t *sup)
+{
+    xdlist_node_t *n, *tmp;
+    sup_job_t *sj;
+
+    if (sup == NULL)
+	return;
+
+    FOR_XDLIST_SAFE(n, tmp, &sup->jobs)
+    {
+	sj = XDLIST_ENTRY(n, sup_job_t, link);
+	if (sj->pidfd >= 0)
+	    close(sj->pidfd);
+	SBUF_FREE(sj->out);
+	SBUF_FREE(sj->err);
+	w_free(sj);
+    }
+    w_free(sup->polled);
+    if (sup->sigfd >= 0)
+	close(sup->sigfd);
+    close(sup->epfd);
+    w_free(sup);
+}
+
+/* watch a job started by the launcher, until its done callback */
+int supervisor_add(supervisor_t *sup, launch_job_t *job)
+{
+    sup_job_t *sj;
+    int i;
+
+    if (sup == NULL || job == NULL || job->pid <= 0)
+	return -1;
+
+    sj = (sup_job_t *) w_malloc(sizeof(sup_job_t));
+    sj->job = job;
+    sj->pidfd = -1;
+    sj->poll = -1;
+    for (i = 0; i < 3; i++)
+    {
+	sj->watch[i].sj = sj;
+	sj->watch[i].kind = (sup_kind_t) i;
+    }
+    SBUF_NEW(sj->out, 256);
+    SBUF_NEW(sj->err, 256);
+
+    xdlist_insert_tail(&sup->jobs, &sj->link);
+    sup->running++;
+
+    if (job->out_fd >= 0)
+	sup_watch(sup, job->out_fd, &sj->watch[SUP_OUT]);
+    if (job->err_fd >= 0)
+	sup_watch(sup, job->err_fd, &sj->watch[SUP_ERR]);
+
+    if (sup->sigfd < 0)
+    {
+	if ((sj->pidfd = sup_pidfd_open(job->pid)) < 0 ||
+	    sup_watch(sup, sj->pidfd, &sj->watch[SUP_PID]) < 0)
+	{
+	    message(MSG_WARN, errno, "supervisor: unable to watch pid %d, polling it",
+		    (int) job->pid);
+	    if (sj->pidfd >= 0)
+		close(sj->pidfd);
+	    sj->pidfd = -1;
+	    sup_poll(sup, sj);
+	    sup_reap(sup, sj);
+	}
+    }
+    else
+	/* it may have exited before we knew its pid */
+	sup_reap(sup, sj);
+
+    return 0;
+}
+
+int supervisor_fd(supervisor_t *sup)
+{
+    return (sup != NULL) ? sup->epfd : -1;
+}
+
+/* Wait up to timeout ms (-1 forever, 0 not at all) and handle what
+   happened. Returns the number of jobs done */
+int supervisor_process(supervisor_t *sup, int timeout)
+{
+    struct epoll_event ev[SUP_EVENTS];
+    sup_watch_t *w, *exits[SUP_EVENTS];
+    int n, i, nexits, done;
+
+    if (sup == NULL)
+	return -1;
+
+    if (sup->npolled > 0 && (timeout < 0 || timeout > SUP_POLL))
+	timeout = SUP_POLL;
+    if ((n = epoll_wait(sup->epfd, ev, SUP_EVENTS, timeout)) < 0)
+	return (errno == EINTR) ? 0 : -1;
+
+    /* output first, a job done frees the watches of its other events */
+    nexits = 0;
+    for (i = 0; i < n; i++)
+    {
+	w = (sup_watch_t *) ev[i].data.ptr;
+	if (w->kind == SUP_PID)
+	    exits[nexits++] = w;
+	else
+	    sup_drain(sup, w->sj, w->kind);
+    }
+
+    done = 0;
+    for (i = 0; i < nexits; i++)
+    {
+	if (exits[i]->sj == NULL)
+	    done += sup_reap_all(sup);
+	else
+	    done += sup_reap(sup, exits[i]->sj);
+    }
+    if (sup->npolled > 0)
+	done += sup_reap_polled(sup);
+    return done;
+}
@@ -0,0 +1,92 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SUPERVISOR_H__
+#define __SUPERVISOR_H__
+
+#include "common.h"
+#include "xdlist.h"
+#include "launcher.h"
+
+/*
+ * One thread watches every running job with epoll: a pidfd per child
+ * tells when it exits, its stdout and stderr pipes are drained as soon
+ * as they are readable, so that no job ever blocks on a full pipe. What
+ * a job writes is kept up to a limit, the rest is read and counted.
+ * Kernels without pidfd_open() get a signalfd for SIGCHLD instead, the
+ * caller must then block SIGCHLD in every thread before starting any,
+ * and each job is asked with waitpid() on its own pid when it comes, so
+ * that children started by others are left to them.
+ * A job whose pidfd cannot be had (EMFILE, ENOMEM) is polled with
+ * waitpid() every SUP_POLL ms instead.
+ */
+
+#define SUP_OUTPUT_MAX 65536 /* default limit of kept output per stream */
+#define SUP_POLL       100   /* ms between waitpid() of the polled jobs */
+#define SUP_UNKNOWN    (-1)  /* status of a job reaped by someone else */
+
+typedef enum {
+    SUP_PID, SUP_OUT, SUP_ERR
+} sup_kind_t;
+
+struct sup_job;
+
+/* what an epoll event points to */
+typedef struct sup_watch {
+    struct sup_job *sj;
+    sup_kind_t kind;
+} sup_watch_t;
+
+typedef struct sup_job {
+    xdlist_node_t link; /* in the running jobs */
+    launch_job_t *job;
+    int pidfd;          /* -1 with signalfd or when polled */
+    long poll;          /* index in polled, -1 when not polled */
+    sup_watch_t watch[3];
+    sbuf_t *out;
+    sbuf_t *err;
+    unsigned long dropped; /* bytes over the limit */
+} sup_job_t;
+
+/* the job has exited, status as from waitpid() or SUP_UNKNOWN, buffers
+   are freed after */
+typedef void (*sup_done_t)(launch_job_t *job, int status, sbuf_t *out, sbuf_t *err,
+			   unsigned long dropped, void *arg);
+
+typedef struct supervisor {
+    int epfd;
+    int sigfd;          /* -1 when pidfds are used */
+    sup_watch_t sigwatch;
+    unsigned long max_output;
+    sup_done_t done;
+    void *arg;
+    xdlist_t jobs;      /* sup_job_t running, an event finds its own */
+    unsigned long running;
+    sup_job_t **polled;
+    unsigned long npolled;
+    unsigned long polled_size;
+} supervisor_t;
+
+/* ------- API -------- */
+supervisor_t *supervisor_create(unsigned long max_output, sup_done_t done, void *arg);
+void supervisor_destroy(supervisor_t *sup);
+int supervisor_add(supervisor_t *sup, launch_job_t *job);
+int supervisor_fd(supervisor_t *sup);
+int supervisor_process(supervisor_t *sup, int timeout);
+
+#endif /* __SUPERVISOR_H__ */
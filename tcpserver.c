@@ -24,6 +24,7 @@
 #include <fcntl.h>
 
 #include "common.h"
+#include "trace.h"
 #include "tcpserver.h"
 
 
@@ -112,11 +113,14 @@ static void *tcp_server_thread_routine(void *th_handle)
 	    
 	/* process connection */
 	message(MSG_DEBUG, 0, "[%lu] launching connection handler\n", pthread_self());
+	TRACE(TR_WORK_START, st->fd);
 	st->work(st->fd);
+	TRACE(TR_WORK_END, st->fd);
 
 	/* finish */
 	message(MSG_DEBUG, 0, "[%lu] closing connection\n", pthread_self());
 	close(st->fd);
+	TRACE(TR_CLOSE, st->fd);
 
 	pthread_mutex_lock(&(st->th_mutex));
 	st->fd = -1;
@@ -313,13 +317,18 @@ static void *tcp_server_run(void *srv_handle)
 		message(MSG_DEBUG, errno, "tcp_server: unable to accept");
 		srv_h->threads[n]->fd = -1;
 	    }
-	    message(MSG_INFO, 0, "Accepted connection from bla (%d)\n", n);
+	    else
+	    {
+		TRACE(TR_ACCEPT, n);
+		message(MSG_DEBUG, 0, "Accepted connection for thread %d\n", n);
+	    }
 	    pthread_cond_signal(&(srv_h->threads[n]->run_cond));
+	    TRACE(TR_DISPATCH, n);
 	       pthread_mutex_unlock(&(srv_h->threads[n]->th_mutex));
 	}
 	else
 	{
-	    message(MSG_INFO, 0, "Too many connection, waiting a little\n");
+	    message(MSG_DEBUG, 0, "Too many connection, waiting a little\n");
 	    /* find some thread safe sleep */
 	    usleep(500);
 	}
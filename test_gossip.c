@@ -0,0 +1,204 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Run many gossip nodes on loopback in one process: measure how long
+   they take to all know each other, to notice one of them is gone, and
+   to take it back when it restarts */
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <arpa/inet.h>
+
+#include "gossip.h"
+
+#define PERIOD 100
+#define BASE_PORT 17000
+
+typedef struct node {
+    gossip_t *g;
+    int up;
+    u_int64_t suspect_at;
+    u_int64_t dead_at;
+} node_t;
+
+static node_t *nodes;
+static int nnodes;
+static struct sockaddr_in victim;
+
+static void changed(const gossip_member_t *m, void *arg)
+{
+    node_t *n = (node_t *) arg;
+
+    if (m->addr.sin_port != victim.sin_port)
+	return;
+    if (m->state == GS_SUSPECT && n->suspect_at == 0)
+	n->suspect_at = gossip_now();
+    if (m->state == GS_DEAD && n->dead_at == 0)
+	n->dead_at = gossip_now();
+}
+
+/* run every node up to deadline or until done() says so */
+static int run(u_int64_t deadline, int (*done)(void))
+{
+    struct pollfd *fds;
+    u_int64_t now;
+    int i, timeout;
+
+    fds = (struct pollfd *) w_malloc(nnodes * sizeof(struct pollfd));
+    while ((now = gossip_now()) < deadline)
+    {
+	if (done())
+	{
+	    w_free(fds);
+	    return 1;
+	}
+	timeout = (int) (deadline - now);
+	for (i = 0; i < nnodes; i++)
+	{
+	    fds[i].fd = nodes[i].up ? gossip_fd(nodes[i].g) : -1;
+	    fds[i].events = POLLIN;
+	    if (nodes[i].up && gossip_timeout(nodes[i].g, now) < timeout)
+		timeout = gossip_timeout(nodes[i].g, now);
+	}
+	poll(fds, nnodes, timeout);
+	now = gossip_now();
+	for (i = 0; i < nnodes; i++)
+	{
+	    if (!nodes[i].up)
+		continue;
+	    if (fds[i].revents & POLLIN)
+		gossip_recv(nodes[i].g, now);
+	    gossip_tick(nodes[i].g, now);
+	}
+    }
+    w_free(fds);
+    return 0;
+}
+
+static int never(void)
+{
+    return 0;
+}
+
+static int converged(void)
+{
+    int i;
+
+    for (i = 0; i < nnodes; i++)
+	if (gossip_alive(nodes[i].g) != nnodes - 1)
+	    return 0;
+    return 1;
+}
+
+static int all_dead(void)
+{
+    int i;
+
+    for (i = 0; i < nnodes; i++)
+	if (nodes[i].up && nodes[i].dead_at == 0)
+	    return 0;
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    u_int64_t start, killed, first_suspect, first_dead, last_dead;
+    unsigned long sent;
+    int i;
+
+    nnodes = (argc > 1) ? atoi(argv[1]) : 64;
+    if (nnodes < 3)
+	nnodes = 3;
+    nodes = (node_t *) w_malloc(nnodes * sizeof(node_t));
+    for (i = 0; i < nnodes; i++)
+    {
+	if ((nodes[i].g = gossip_create("127.0.0.1", NULL, BASE_PORT + i, PERIOD,
+					changed, &nodes[i])) == NULL)
+	    return 1;
+	nodes[i].up = 1;
+    }
+
+    start = gossip_now();
+    for (i = 1; i < nnodes; i++)
+	gossip_join(nodes[i].g, "127.0.0.1", BASE_PORT, start);
+    if (!run(start + 300 * PERIOD, converged))
+    {
+	printf("no convergence after %d ms\n", 300 * PERIOD);
+	return 1;
+    }
+    printf("%d nodes, period %d ms\n", nnodes, PERIOD);
+    printf("convergence: %llu ms\n", (unsigned long long) (gossip_now() - start));
+
+    /* let the join updates die out, then count the steady traffic */
+    run(gossip_now() + 20 * PERIOD, never);
+    sent = 0;
+    for (i = 0; i < nnodes; i++)
+	sent -= nodes[i].g->msg_sent;
+    start = gossip_now();
+    run(start + 20 * PERIOD, never);
+    for (i = 0; i < nnodes; i++)
+	sent += nodes[i].g->msg_sent;
+    printf("messages: %.2f per node per period\n", (double) sent / nnodes / 20);
+
+    /* the last node stops answering */
+    victim = nodes[nnodes - 1].g->self;
+    nodes[nnodes - 1].up = 0;
+    killed = gossip_now();
+    if (!run(killed + 600 * PERIOD, all_dead))
+    {
+	printf("failure not detected after %d ms\n", 600 * PERIOD);
+	return 1;
+    }
+
+    first_suspect = first_dead = last_dead = 0;
+    for (i = 0; i < nnodes - 1; i++)
+    {
+	if (nodes[i].suspect_at && (!first_suspect || nodes[i].suspect_at < first_suspect))
+	    first_suspect = nodes[i].suspect_at;
+	if (!first_dead || nodes[i].dead_at < first_dead)
+	    first_dead = nodes[i].dead_at;
+	if (nodes[i].dead_at > last_dead)
+	    last_dead = nodes[i].dead_at;
+    }
+    printf("first suspect: %llu ms\n", (unsigned long long) (first_suspect - killed));
+    printf("first dead: %llu ms\n", (unsigned long long) (first_dead - killed));
+    printf("dead everywhere: %llu ms\n", (unsigned long long) (last_dead - killed));
+
+    /* once nobody talks of it anymore, it comes back on the same address
+       knowing nothing */
+    run(gossip_now() + 20 * PERIOD, never);
+    gossip_destroy(nodes[nnodes - 1].g);
+    if ((nodes[nnodes - 1].g = gossip_create(NULL, "127.0.0.1", BASE_PORT + nnodes - 1, PERIOD,
+					     changed, &nodes[nnodes - 1])) == NULL)
+	return 1;
+    nodes[nnodes - 1].up = 1;
+    start = gossip_now();
+    gossip_join(nodes[nnodes - 1].g, "127.0.0.1", BASE_PORT, start);
+    if (!run(start + 300 * PERIOD, converged))
+    {
+	printf("no rejoin after %d ms\n", 300 * PERIOD);
+	return 1;
+    }
+    printf("rejoin: %llu ms\n", (unsigned long long) (gossip_now() - start));
+
+    for (i = 0; i < nnodes; i++)
+	gossip_destroy(nodes[i].g);
+    w_free(nodes);
+    return 0;
+}
@@ -18,12 +18,30 @@
 
 #include <signal.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/signalfd.h>
 #include "common.h"
+#include "log.h"
+#include "trace.h"
 #include "tcpserver.h"
+#include "scheduler.h"
+#include "clockwatch.h"
+#include "jobsnap.h"
+#include "ingest.h"
 
 extern msg_level_t general_msg_level;
 
+#define CORNET_SNAPSHOT "/var/lib/cornet/jobs.snap"
+
 tcp_server_t *server;
+scheduler_t *jobs;
+
+/* where the queued entries point to, kept until exit */
+const char *cron_dirs[] = { "/etc/cron.d", "/var/spool/cron/crontabs" };
+const int cron_system[] = { 1, 0 };
+jobsnap_t *snapshot;
+ingest_t *ingested;
+sched_entry_t *entries;
 
 int readline(int fd, char *buffer, int nbytes)
 {
@@ -78,34 +96,110 @@ void service(int fd)
     
 }
     
-void sighandle(int signo) {
-    if ((signo==SIGTERM) || (signo==SIGINT)) {
-	tcp_server_stop(server);
-	tcp_server_destroy(server);
-	exit(0);
+void job_fire(sched_entry_t *entry, time_t when, void *arg)
+{
+    const jobsnap_job_t *job;
+
+    /* a job from the snapshot whose crontab was not checked yet */
+    if (snapshot != NULL && (job = jobsnap_job_of(snapshot, entry->data)) != NULL &&
+	!jobsnap_runs(snapshot, job, when))
+	return;
+    message(MSG_INFO, 0, "job due at %ld\n", (long) when);
+}
+
+void job_missed(sched_entry_t *entry, time_t last, long count, void *arg)
+{
+    message(MSG_INFO, 0, "job missed %ld runs, the last at %ld\n", count, (long) last);
+}
+
+/* The job table at startup: the snapshot as it is, the crontabs new
+   since parsed, the others are checked later by the main loop. With no
+   snapshot, all of them are parsed and a snapshot taken for the next
+   start. last is set to the last time the scheduler ran, 0 when unknown */
+int load_jobs(const char *path, time_t now, time_t *last)
+{
+    int added;
+
+    *last = 0;
+    if ((snapshot = jobsnap_load(path)) != NULL)
+    {
+	*last = (time_t) snapshot->header->last;
+	if ((entries = jobsnap_schedule(snapshot, jobs, now)) != NULL)
+	{
+	    added = jobsnap_added(snapshot, cron_dirs, cron_system, 2, now);
+	    message(MSG_INFO, 0, "%u jobs from %s, %d new crontabs\n", snapshot->header->njobs,
+		    path, added);
+	    return 0;
+	}
+	jobsnap_unload(snapshot);
+	snapshot = NULL;
     }
-    if (signo == SIGHUP) {
-	
+
+    if ((ingested = ingest_run(cron_dirs, cron_system, 2, 0)) == NULL ||
+	(entries = ingest_schedule(ingested, jobs, now)) == NULL)
+    {
+	message(MSG_ERR, 0, "unable to load the crontabs\n");
+	return -1;
     }
-    if (signo == SIGALRM) {
-	
+    message(MSG_INFO, 0, "%lu jobs parsed from %lu crontabs\n", ingested->njobs, ingested->nfiles);
+    ingest_save(ingested, path, now);
+    return 0;
+}
+
+/* Signals are blocked in every thread and read from a signalfd by the
+   main loop, where stopping the server and the log thread is safe.
+   Returns 0 when the daemon has to stop */
+int handle_signal(int sfd)
+{
+    struct signalfd_siginfo si;
+
+    if (read(sfd, &si, sizeof(si)) != sizeof(si))
+	return 1;
+    if ((si.ssi_signo == SIGTERM) || (si.ssi_signo == SIGINT))
+	return 0;
+    if (si.ssi_signo == SIGHUP) {
+
+    }
+    if (si.ssi_signo == SIGALRM) {
+
     }
+    return 1;
 }
 
 int main(int argc, char** argv)
 {
+    clockwatch_t *watch;
+    clock_change_t change;
+    struct pollfd pfd[2];
+    sigset_t mask;
+    const char *path;
+    time_t now, last;
+    int sfd, running = 1;
+    unsigned long unchecked;
+
+    /* before any thread is created, so that they all inherit the mask */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if ((sfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0)
+    {
+	fprintf(stderr, "can't create signalfd\n");
+	return 1;
+    }
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+	fprintf(stderr, "can't ignore SIGPIPE signal\n");
+
     general_msg_level = MSG_INFO;
+    if (log_start(LS_STDERR, NULL, LP_DROP))
+	fprintf(stderr, "can't start log thread, logging synchronously\n");
 
-    if (signal(SIGPIPE, sighandle) == SIG_ERR)
-	fprintf(stderr, "can't catch SIGPIPE signal\n");
-    if (signal(SIGTERM, sighandle) == SIG_ERR)
-	fprintf(stderr, "can't catch SIGTERM signal\n");
-    if (signal(SIGINT, sighandle) == SIG_ERR)
-	fprintf(stderr, "can't catch SIGINT signal\n");
-    if (signal(SIGALRM, sighandle) == SIG_ERR)
-	fprintf(stderr, "can't catch SIGALRM signal\n");
-    if (signal(SIGHUP, sighandle) == SIG_ERR)
-	fprintf(stderr, "can't catch SIGHUP signal\n");
+    /* kill -USR2 to get a trace, convert it with trace2json */
+    trace_start();
+    if (trace_install_signals("cornet.trace"))
+	fprintf(stderr, "can't install trace dump handlers\n");
 
     message(MSG_DEBUG, 0, "Starting server\n");
     server = tcp_server_create(NULL, 6666, service, 5);
@@ -113,11 +207,65 @@ int main(int argc, char** argv)
     {
 	message(MSG_ERR, 0, "Server start error\n");
 	tcp_server_destroy(server);
+	server = NULL;
+    }
+
+    /* sleep until the next job, a clock change or a signal, nothing else */
+    jobs = scheduler_create(0);
+    if (argc > 3)
+    {
+	cron_dirs[0] = argv[2];
+	cron_dirs[1] = argv[3];
     }
+    path = (argc > 1) ? argv[1] : CORNET_SNAPSHOT;
+    now = time(NULL);
+    load_jobs(path, now, &last);
+    /* the runs missed while the daemon was down */
+    if (last > 0 && last < now)
+	scheduler_catchup(jobs, last, now, job_missed, NULL);
+    unchecked = (snapshot != NULL) ? snapshot->header->nfiles : 0;
+    watch = clockwatch_create();
 
-    while (1)
-	usleep(600);
+    pfd[0].fd = sfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = clockwatch_fd(watch);
+    pfd[1].events = POLLIN;
+    while (running)
+    {
+	if (watch != NULL && clockwatch_arm(watch, scheduler_next(jobs)) < 0)
+	    break;
+	/* crontabs of the snapshot are checked a few at a time, between
+	   the jobs, and the snapshot taken again when some changed */
+	if (unchecked > 0 && (unchecked = jobsnap_validate(snapshot, 64, time(NULL))) == 0 &&
+	    jobsnap_changed(snapshot))
+	    jobsnap_resave(snapshot, path, time(NULL));
+	if (poll(pfd, (watch != NULL) ? 2 : 1, (unchecked > 0) ? 0 : -1) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    message(MSG_ERR, errno, "poll failed");
+	    break;
+	}
+	if (pfd[0].revents & POLLIN)
+	    running = handle_signal(sfd);
+	if (watch != NULL && (pfd[1].revents & POLLIN))
+	{
+	    if (clockwatch_check(watch, &change) < 0)
+		break;
+	    clockwatch_resync(jobs, &change, job_missed, NULL);
+	    now = time(NULL);
+	    scheduler_run(jobs, now, job_fire, NULL);
+	    jobsnap_tick(path, now);
+	}
+    }
 
+    if (server != NULL)
+    {
+	tcp_server_stop(server);
+	tcp_server_destroy(server);
+    }
+    clockwatch_destroy(watch);
+    close(sfd);
+    log_stop();
     return 0;
-	
 }
@@ -0,0 +1,246 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "trace.h"
+
+/*
+ * Dump format, native endianness:
+ *   header: magic "CNTRACE1", u_int32_t record size, u_int32_t zero
+ *   then per thread: u_int32_t tid, u_int32_t count, count records
+ *   oldest first, until end of file
+ */
+#define TRACE_MAGIC "CNTRACE1"
+
+volatile int trace_enabled = 0;
+__thread trace_ring_t *trace_thread_ring = NULL;
+
+/* rings are never freed: a dump may read them at any time */
+static trace_ring_t *trace_rings = NULL;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char trace_path[PATH_MAX];
+
+static const char *trace_event_names[TR_MAX] = {
+    "accept", "dispatch", "work", "work", "close"
+};
+
+static int write_all(int fd, const void *buf, size_t len);
+static void trace_signal_handler(int signo);
+
+trace_ring_t *trace_ring_register(void)
+{
+    trace_ring_t *ring;
+
+    if ((ring = (trace_ring_t *) malloc(sizeof(trace_ring_t))) == NULL)
+	return NULL;
+    ring->head = 0;
+    ring->tid = (pid_t) syscall(SYS_gettid);
+
+    pthread_mutex_lock(&trace_mutex);
+    ring->next = trace_rings;
+    __atomic_store_n(&trace_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_mutex);
+
+    trace_thread_ring = ring;
+    return ring;
+}
+
+void trace_start(void)
+{
+    trace_enabled = 1;
+}
+
+void trace_stop(void)
+{
+    trace_enabled = 0;
+}
+
+/* async signal safe: only write(2) */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    ssize_t w;
+
+    while (len > 0)
+    {
+	if ((w = write(fd, p, len)) < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += w;
+	len -= w;
+    }
+    return 0;
+}
+
+/* write every ring to fd, usable from a signal handler */
+int trace_dump(int fd)
+{
+    trace_ring_t *ring;
+    u_int32_t hdr[2];
+    u_int64_t head, first;
+
+    if (write_all(fd, TRACE_MAGIC, 8) < 0)
+	return -1;
+    hdr[0] = sizeof(trace_record_t);
+    hdr[1] = 0;
+    if (write_all(fd, hdr, sizeof(hdr)) < 0)
+	return -1;
+
+    for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+	hdr[0] = (u_int32_t) ring->tid;
+	hdr[1] = (u_int32_t) (head - first);
+	if (write_all(fd, hdr, sizeof(hdr)) < 0)
+	    return -1;
+
+	/* the ring wraps at most once between first and head */
+	if ((first & (TRACE_RING_SIZE - 1)) + (head - first) > TRACE_RING_SIZE)
+	{
+	    if (write_all(fd, &ring->records[first & (TRACE_RING_SIZE - 1)],
+			  (TRACE_RING_SIZE - (first & (TRACE_RING_SIZE - 1))) * sizeof(trace_record_t)) < 0)
+		return -1;
+	    if (write_all(fd, ring->records,
+			  (head & (TRACE_RING_SIZE - 1)) * sizeof(trace_record_t)) < 0)
+		return -1;
+	}
+	else if (write_all(fd, &ring->records[first & (TRACE_RING_SIZE - 1)],
+			   (head - first) * sizeof(trace_record_t)) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+static void trace_signal_handler(int signo)
+{
+    int fd, saved_errno;
+
+    saved_errno = errno;
+    if ((fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0)
+    {
+	trace_dump(fd);
+	close(fd);
+    }
+    errno = saved_errno;
+
+    /* crash: the handler was reset, let the signal kill us */
+    if (signo != SIGUSR2)
+	raise(signo);
+}
+
+/* SIGUSR2 dumps to path, so does a crash before the default action */
+int trace_install_signals(const char *path)
+{
+    struct sigaction sa;
+    int crash[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    unsigned int i;
+
+    if (path == NULL || strlen(path) >= sizeof(trace_path))
+	return -1;
+    strcpy(trace_path, path);
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = trace_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR2, &sa, NULL) < 0)
+    {
+	message(MSG_ERR, errno, "trace: unable to catch SIGUSR2");
+	return -1;
+    }
+
+    sa.sa_flags = SA_RESETHAND;
+    for (i = 0; i < sizeof(crash) / sizeof(crash[0]); i++)
+	if (sigaction(crash[i], &sa, NULL) < 0)
+	    message(MSG_WARN, errno, "trace: unable to catch signal %d", crash[i]);
+
+    return 0;
+}
+
+/* Convert a dump to the Chrome trace event format: work start/end become
+   duration events, the others instant events */
+int trace_to_json(const char *in_path, const char *out_path)
+{
+    FILE *in, *out;
+    char magic[8];
+    u_int32_t hdr[2], i;
+    trace_record_t rec;
+    const char *sep = "";
+    int ret = -1;
+
+    if ((in = fopen(in_path, "r")) == NULL)
+    {
+	message(MSG_ERR, errno, "trace: unable to open %s", in_path);
+	return -1;
+    }
+    if ((out = fopen(out_path, "w")) == NULL)
+    {
+	message(MSG_ERR, errno, "trace: unable to open %s", out_path);
+	fclose(in);
+	return -1;
+    }
+
+    if (fread(magic, 8, 1, in) != 1 || memcmp(magic, TRACE_MAGIC, 8) ||
+	fread(hdr, sizeof(hdr), 1, in) != 1 || hdr[0] != sizeof(trace_record_t))
+    {
+	message(MSG_ERR, 0, "trace: %s is not a trace dump\n", in_path);
+	goto end;
+    }
+
+    fprintf(out, "{\"traceEvents\":[");
+    while (fread(hdr, sizeof(hdr), 1, in) == 1)
+    {
+	for (i = 0; i < hdr[1]; i++)
+	{
+	    if (fread(&rec, sizeof(rec), 1, in) != 1)
+	    {
+		message(MSG_ERR, 0, "trace: %s is truncated\n", in_path);
+		goto end;
+	    }
+	    if (rec.event >= TR_MAX)
+		continue;
+
+	    fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%llu.%03llu,"
+		    "\"pid\":1,\"tid\":%u,\"args\":{\"arg\":%u}%s}",
+		    sep, trace_event_names[rec.event],
+		    rec.event == TR_WORK_START ? "B" : (rec.event == TR_WORK_END ? "E" : "i"),
+		    (unsigned long long) (rec.ts / 1000), (unsigned long long) (rec.ts % 1000),
+		    hdr[0], rec.arg,
+		    (rec.event == TR_WORK_START || rec.event == TR_WORK_END) ? "" : ",\"s\":\"t\"");
+	    sep = ",";
+	}
+    }
+    fprintf(out, "\n]}\n");
+    ret = 0;
+
+end:
+    fclose(in);
+    if (fclose(out) != 0)
+	ret = -1;
+    return ret;
+}
@@ -0,0 +1,94 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Flight recorder: each thread writes binary events in a ring of its own,
+ * overwriting the oldest ones. Recording an event is a clock read and a
+ * 16 bytes store. The rings are written to a file on demand (SIGUSR2) or
+ * when the process crashes, and trace_to_json() converts that file for
+ * chrome://tracing.
+ */
+
+/* Events, keep trace_event_names in trace.c in sync */
+typedef enum {
+    TR_ACCEPT = 0,      /* arg: worker thread slot */
+    TR_DISPATCH = 1,    /* arg: worker thread slot */
+    TR_WORK_START = 2,  /* arg: client fd */
+    TR_WORK_END = 3,    /* arg: client fd */
+    TR_CLOSE = 4,       /* arg: client fd */
+    TR_MAX
+} trace_event_t;
+
+typedef struct trace_record {
+    u_int64_t ts; /* CLOCK_MONOTONIC, in ns */
+    u_int32_t event;
+    u_int32_t arg;
+} trace_record_t;
+
+#define TRACE_RING_SIZE 4096 /* records per thread, power of 2 */
+
+typedef struct trace_ring {
+    u_int64_t head; /* number of records ever written */
+    pid_t tid;
+    struct trace_ring *next;
+    trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+extern volatile int trace_enabled;
+extern __thread trace_ring_t *trace_thread_ring;
+
+trace_ring_t *trace_ring_register(void);
+
+static __inline void trace_record(trace_event_t event, u_int32_t arg)
+{
+    trace_ring_t *ring;
+    trace_record_t *rec;
+    struct timespec ts;
+
+    if ((ring = trace_thread_ring) == NULL && (ring = trace_ring_register()) == NULL)
+	return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec = &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+    rec->ts = (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->event = event;
+    rec->arg = arg;
+    /* a dump from a signal handler reads head after the record */
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE(EVENT, ARG)                                  \
+do {                                                       \
+    if (trace_enabled)                                     \
+	trace_record((EVENT), (u_int32_t)(ARG));           \
+} while (0)
+
+/* ------- API -------- */
+void trace_start(void);
+void trace_stop(void);
+int trace_dump(int fd);
+int trace_install_signals(const char *path);
+int trace_to_json(const char *in_path, const char *out_path);
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,35 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Convert a trace dump to JSON for chrome://tracing or ui.perfetto.dev */
+
+#include <stdio.h>
+
+#include "common.h"
+#include "trace.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+	fprintf(stderr, "usage: %s <trace dump> <output.json>\n", argv[0]);
+	return 1;
+    }
+
+    return trace_to_json(argv[1], argv[2]) ? 1 : 0;
+}
@@ -0,0 +1,441 @@
+#ifndef __X_CHASH__
+#define __X_CHASH__
+
+/*
+ * Concurrent hash built on top of xhash.
+ *
+ * Keys are spread over a fixed number of shards, each one being a plain
+ * xhash protected by its own read/write lock. There is no map wide lock:
+ * readers of different shards never meet, and readers of the same shard
+ * only wait while a writer holds that shard. The key is hashed once, the
+ * top bits of the hashkey select the shard and the whole hashkey is given,
+ * with the key, to the _hashed functions of xhash, so the seed of the map
+ * is the one that matters, not the ones of the shards.
+ *
+ * Values handed to the map belong to it, like with xhash: they are freed
+ * on remove and destroy. A reader must not keep a value pointer once the
+ * shard lock is released, so value access goes through callbacks run with
+ * the shard locked (read lock for xchash_apply, write lock for
+ * xchash_update). Snapshots read values with no lock, so a value in the
+ * map is never modified: xchash_update builds a new one, and the entry
+ * of a pinned shard is copied, the old one staying with the snapshot.
+ * Pinning a shard that did not change since its last snapshot only
+ * takes its read lock.
+ *
+ * Elements of all shards come from a single xpool, so that workers
+ * adding and removing entries mostly hit their thread local free list.
+ *
+ * This file is placed in the public domain .
+ *
+ *	API:
+ *
+ *	xchash_t * xchash_init(unsigned int nshards)
+ *	void xchash_destroy(xchash_t *xchash)
+ *	unsigned short xchash_add(xchash_t *xchash,const char *key,void *value)
+ *	unsigned short xchash_remove(xchash_t *xchash,char *key)
+ *	unsigned short xchash_exists(xchash_t *xchash,char *key)
+ *	unsigned short xchash_apply(xchash_t *xchash,char *key,xchash_fn_t fn,void *arg)
+ *	unsigned short xchash_update(xchash_t *xchash,char *key,xchash_update_t fn,void *arg)
+ *	unsigned long  xchash_numkeys(xchash_t *xchash)
+ *	void xchash_foreach(xchash_t *xchash,xchash_fn_t fn,void *arg)
+ *	xchash_snap_t * xchash_snapshot(xchash_t *xchash)
+ *	void xchash_snapshot_foreach(xchash_snap_t *snap,xchash_fn_t fn,void *arg)
+ *	void xchash_snapshot_release(xchash_snap_t *snap)
+ */
+
+#include	<pthread.h>
+#include	<stdlib.h>
+#include	<string.h>
+
+#include	"xhash.h"
+
+#define XCHASH_MAX_SHARDS 1024
+#define XCHASH_CACHELINE 64
+
+/* called with the shard locked, returns nothing useful to the map */
+typedef void (*xchash_fn_t)(const char *key, void *value, void *arg);
+
+/* called with the shard write locked: returns a new malloc'ed value built
+ * from value, which must not be modified, or NULL to keep it */
+typedef void *(*xchash_update_t)(const char *key, const void *value, void *arg);
+
+typedef struct _xchash_shard
+{
+	pthread_rwlock_t lock ;
+	xhash_t	*xhash ;
+} __attribute__((aligned(XCHASH_CACHELINE))) xchash_shard_t ;
+
+typedef struct _xchash
+{
+	unsigned int	nshards ;
+	unsigned int	shift ;
+	u_int64_t	seed ;
+	xpool_t	*pool ;
+	xchash_shard_t	*shards ;
+} xchash_t ;
+
+/* one xhash snapshot per shard, taken one shard after the other: each
+ * shard is consistent, the whole is not a point in time view */
+typedef struct _xchash_snap
+{
+	xchash_t	*xchash ;
+	xhash_snap_t	**snaps ;
+} xchash_snap_t ;
+
+static __inline Fnv64_t
+xchash_hashkey(xchash_t *xchash,const char *key,size_t keylen)
+{
+	return(xhash_wyhash(key, keylen, xchash->seed));
+}
+
+static __inline xchash_shard_t *
+xchash_shard(xchash_t *xchash,Fnv64_t hashkey)
+{
+	/* top bits pick the shard, the full hashkey is still compared
+	 * inside of it */
+	return(&xchash->shards[xchash->nshards > 1 ? hashkey >> xchash->shift : 0]);
+}
+
+/* nshards is rounded up to a power of two */
+static __inline xchash_t *
+xchash_init(unsigned int nshards)
+{
+	xchash_t *xchash ;
+	unsigned int i, bits ;
+
+	if (nshards == 0 || nshards > XCHASH_MAX_SHARDS)
+		return(NULL);
+
+	for (bits = 0; (1U << bits) < nshards; bits++)
+		;
+
+	if ((xchash = (xchash_t *)malloc(sizeof(xchash_t))) == NULL)
+		return(NULL);
+	xchash->nshards = 1U << bits ;
+	xchash->shift = 64 - bits ;
+	xchash->seed = xhash_random_seed() ;
+	if ((xchash->pool = xpool_create(sizeof(xhash_elem_t))) == NULL)
+	{
+		free(xchash);
+		return(NULL);
+	}
+
+	/* one shard per cache line, so that two shard locks never share one */
+	if (posix_memalign((void **)&xchash->shards, XCHASH_CACHELINE,
+			   xchash->nshards * sizeof(xchash_shard_t)) != 0)
+	{
+		xpool_destroy(xchash->pool);
+		free(xchash);
+		return(NULL);
+	}
+
+	for (i = 0; i < xchash->nshards; i++)
+	{
+		pthread_rwlock_init(&xchash->shards[i].lock, NULL);
+		xchash->shards[i].xhash = xhash_init(NULL);
+		xhash_set_pool(xchash->shards[i].xhash, xchash->pool);
+	}
+	return(xchash);
+}
+
+/* no other thread may use the map anymore */
+static __inline void
+xchash_destroy(xchash_t *xchash)
+{
+	unsigned int i ;
+
+	if (!xchash)
+		return ;
+
+	for (i = 0; i < xchash->nshards; i++)
+	{
+		xhash_destroy(xchash->shards[i].xhash);
+		pthread_rwlock_destroy(&xchash->shards[i].lock);
+	}
+	free(xchash->shards);
+	xpool_destroy(xchash->pool);
+	free(xchash);
+}
+
+/* return 1 if entry have been inserted, 0 if it already exists */
+static __inline unsigned short
+xchash_add(xchash_t *xchash,const char *key,void *value)
+{
+	xchash_shard_t *shard ;
+	Fnv64_t	hashkey ;
+	size_t	keylen ;
+	unsigned short r ;
+
+	if (!xchash || !key)
+		return(0);
+
+	keylen = strlen(key);
+	hashkey = xchash_hashkey(xchash, key, keylen);
+	shard = xchash_shard(xchash, hashkey);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	r = xhash_add_hashed(shard->xhash, hashkey, key, keylen, value);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return(r);
+}
+
+/* returns 1 if entry is deleted */
+static __inline unsigned short
+xchash_remove(xchash_t *xchash,char *key)
+{
+	xchash_shard_t *shard ;
+	Fnv64_t	hashkey ;
+	size_t	keylen ;
+	unsigned short r ;
+
+	if (!xchash || !key)
+		return(0);
+
+	keylen = strlen(key);
+	hashkey = xchash_hashkey(xchash, key, keylen);
+	shard = xchash_shard(xchash, hashkey);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	r = xhash_remove_hashed(shard->xhash, hashkey, key, keylen);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return(r);
+}
+
+static __inline unsigned short
+xchash_exists(xchash_t *xchash,char *key)
+{
+	xchash_shard_t *shard ;
+	Fnv64_t	hashkey ;
+	size_t	keylen ;
+	unsigned short r ;
+
+	if (!xchash || !key)
+		return(0);
+
+	keylen = strlen(key);
+	hashkey = xchash_hashkey(xchash, key, keylen);
+	shard = xchash_shard(xchash, hashkey);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	r = (xhash_lookup_hashed(shard->xhash, hashkey, key, keylen) != NULL);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return(r);
+}
+
+/* run fn on the value of key with the shard read locked: fn must not
+ * modify the value. returns 1 if key was found */
+static __inline unsigned short
+xchash_apply(xchash_t *xchash,char *key,xchash_fn_t fn,void *arg)
+{
+	xchash_shard_t *shard ;
+	xhash_elem_t *xhash_elem ;
+	Fnv64_t	hashkey ;
+	size_t	keylen ;
+
+	if (!xchash || !key || !fn)
+		return(0);
+
+	keylen = strlen(key);
+	hashkey = xchash_hashkey(xchash, key, keylen);
+	shard = xchash_shard(xchash, hashkey);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	if ((xhash_elem = xhash_lookup_hashed(shard->xhash, hashkey, key, keylen)) != NULL)
+		fn(xhash_elem->key, xhash_elem->value, arg);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return(xhash_elem != NULL);
+}
+
+/* replace the value of key by what fn builds from it, copy on write so
+ * that snapshots keep the old one. returns 1 if key was found */
+static __inline unsigned short
+xchash_update(xchash_t *xchash,char *key,xchash_update_t fn,void *arg)
+{
+	xchash_shard_t *shard ;
+	xhash_elem_t *xhash_elem ;
+	Fnv64_t	hashkey ;
+	size_t	keylen ;
+	void	*value ;
+
+	if (!xchash || !key || !fn)
+		return(0);
+
+	keylen = strlen(key);
+	hashkey = xchash_hashkey(xchash, key, keylen);
+	shard = xchash_shard(xchash, hashkey);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	if ((xhash_elem = xhash_lookup_hashed(shard->xhash, hashkey, key, keylen)) != NULL &&
+	    (value = fn(xhash_elem->key, xhash_elem->value, arg)) != NULL &&
+	    value != xhash_elem->value)
+		xhash_replace_hashed(shard->xhash, hashkey, key, keylen, value);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return(xhash_elem != NULL);
+}
+
+/* not a snapshot: shards are counted one after the other */
+static __inline unsigned long
+xchash_numkeys(xchash_t *xchash)
+{
+	unsigned long n = 0 ;
+	unsigned int i ;
+
+	if (!xchash)
+		return(0);
+
+	for (i = 0; i < xchash->nshards; i++)
+	{
+		pthread_rwlock_rdlock(&xchash->shards[i].lock);
+		n += xhash_numkeys(xchash->shards[i].xhash);
+		pthread_rwlock_unlock(&xchash->shards[i].lock);
+	}
+	return(n);
+}
+
+/* visit every entry in place, each shard being read locked in turn */
+static __inline void
+xchash_foreach(xchash_t *xchash,xchash_fn_t fn,void *arg)
+{
+	xhash_elem_t *xhash_elem ;
+	unsigned int i ;
+
+	if (!xchash || !fn)
+		return ;
+
+	for (i = 0; i < xchash->nshards; i++)
+	{
+		pthread_rwlock_rdlock(&xchash->shards[i].lock);
+		FOR_XHASH(xhash_elem, xchash->shards[i].xhash)
+			fn(xhash_elem->key, xhash_elem->value, arg);
+		pthread_rwlock_unlock(&xchash->shards[i].lock);
+	}
+}
+
+/* the generation of a shard only moves under its write lock, so while
+ * the read lock is held its cached snapshot, when current, can be pinned
+ * by any number of readers at once with atomic increments. The write
+ * lock is taken only to build a new one after the shard changed */
+static __inline xhash_snap_t *
+xchash_shard_pin(xchash_shard_t *shard)
+{
+	xhash_t	*xhash = shard->xhash ;
+	xhash_snap_t *snap ;
+
+	pthread_rwlock_rdlock(&shard->lock);
+	if ((snap = xhash->snap) != NULL && snap->gen == xhash->gen)
+	{
+		__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&xhash->pins, 1, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&shard->lock);
+		return(snap);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	snap = xhash_snapshot(xhash);
+	pthread_rwlock_unlock(&shard->lock);
+	return(snap);
+}
+
+/* counterpart of xchash_shard_pin(), the read lock is enough to drop a
+ * pin. An outdated snapshot left with no reader cannot be reached anymore
+ * and is freed with no lock, the entries retired meanwhile need the
+ * write lock, and only once the last pin is gone */
+static __inline void
+xchash_shard_unpin(xchash_shard_t *shard,xhash_snap_t *snap)
+{
+	xhash_t	*xhash = shard->xhash ;
+	xhash_elem_t *tmp1, *tmp2 ;
+	int	unused, retired ;
+
+	pthread_rwlock_rdlock(&shard->lock);
+	unused = (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0 && snap != xhash->snap) ;
+	retired = (__atomic_sub_fetch(&xhash->pins, 1, __ATOMIC_ACQ_REL) == 0 && xhash->retired != NULL) ;
+	pthread_rwlock_unlock(&shard->lock);
+
+	if (unused)
+		xhash_snap_free(snap);
+
+	if (retired)
+	{
+		pthread_rwlock_wrlock(&shard->lock);
+		if (xhash->pins == 0)
+		{
+			for (tmp1 = xhash->retired; tmp1 != NULL; tmp1 = tmp2)
+			{
+				tmp2 = tmp1->next ;
+				xhash_elem_free(xhash, tmp1);
+			}
+			xhash->retired = NULL ;
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+static __inline void
+xchash_snapshot_release(xchash_snap_t *snap)
+{
+	unsigned int i ;
+
+	if (!snap)
+		return ;
+
+	for (i = 0; i < snap->xchash->nshards; i++)
+		if (snap->snaps[i] != NULL)
+			xchash_shard_unpin(&snap->xchash->shards[i], snap->snaps[i]);
+	free(snap->snaps);
+	free(snap);
+}
+
+/* readers of the map are not held back: a shard that did not change
+ * since the last snapshot is pinned under its read lock */
+static __inline xchash_snap_t *
+xchash_snapshot(xchash_t *xchash)
+{
+	xchash_snap_t *snap ;
+	unsigned int i ;
+
+	if (!xchash)
+		return(NULL);
+
+	if ((snap = (xchash_snap_t *)malloc(sizeof(xchash_snap_t))) == NULL)
+		return(NULL);
+	snap->xchash = xchash ;
+	if ((snap->snaps = (xhash_snap_t **)calloc(xchash->nshards, sizeof(xhash_snap_t *))) == NULL)
+	{
+		free(snap);
+		return(NULL);
+	}
+
+	for (i = 0; i < xchash->nshards; i++)
+		if ((snap->snaps[i] = xchash_shard_pin(&xchash->shards[i])) == NULL)
+		{
+			xchash_snapshot_release(snap);
+			return(NULL);
+		}
+	return(snap);
+}
+
+/* no lock taken, the map may change meanwhile but the entries and
+ * values seen stay as they were when the snapshot was taken */
+static __inline void
+xchash_snapshot_foreach(xchash_snap_t *snap,xchash_fn_t fn,void *arg)
+{
+	xhash_elem_t *xhash_elem ;
+	unsigned long j ;
+	unsigned int i ;
+
+	if (!snap || !fn)
+		return ;
+
+	for (i = 0; i < snap->xchash->nshards; i++)
+		for (j = 0; (xhash_elem = xhash_snapshot_elem(snap->snaps[i], j)) != NULL; j++)
+			fn(xhash_elem->key, xhash_elem->value, arg);
+}
+
+#endif /* __X_CHASH__ */
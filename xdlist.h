@@ -0,0 +1,142 @@
+/*
+ *
+ * Copyright (C) 2008 Nicolas THAUVIN <nico@orgrim.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __XDLIST_H__
+#define __XDLIST_H__
+
+#include <stddef.h>
+
+/*
+ * Intrusive doubly linked lists: the links are a xdlist_node_t embedded
+ * in the element, so inserting or removing never allocates and never
+ * walks the list. The list head is a sentinel node, an empty list points
+ * to itself.
+ *
+ *	- XDLIST_ENTRY get the element from a pointer to its node
+ *	- XDLIST_INIT / xdlist_init make an empty list
+ *	- xdlist_insert_head, xdlist_insert_tail, xdlist_insert_after
+ *	- xdlist_remove unlink a node in O(1)
+ *	- xdlist_splice move all nodes of a list at the tail of another one
+ *	- FOR_XDLIST walk the nodes, FOR_XDLIST_SAFE allows removing the
+ *	  current one
+ *
+ *	typedef struct job {
+ *		int id;
+ *		xdlist_node_t link;
+ *	} job_t;
+ *
+ *	xdlist_t jobs;
+ *	xdlist_node_t *n, *tmp;
+ *
+ *	xdlist_init(&jobs);
+ *	xdlist_insert_tail(&jobs, &job->link);
+ *	FOR_XDLIST_SAFE(n, tmp, &jobs)
+ *	  if (XDLIST_ENTRY(n, job_t, link)->id == 42)
+ *	    xdlist_remove(n);
+ */
+
+typedef struct xdlist_node {
+	struct xdlist_node	*prev, *next;
+} xdlist_node_t;
+
+typedef struct xdlist {
+	xdlist_node_t	head;
+} xdlist_t;
+
+#define XDLIST_ENTRY(NODE, TYPE, MEMBER)				\
+	((TYPE *)((char *)(NODE) - offsetof(TYPE, MEMBER)))
+
+#define XDLIST_INIT(LIST)	{ { &(LIST).head, &(LIST).head } }
+
+#define XDLIST_ISEMPTY(LIST)	((LIST)->head.next == &(LIST)->head)
+
+#define XDLIST_FIRST(LIST)						\
+	(XDLIST_ISEMPTY(LIST) ? NULL : (LIST)->head.next)
+
+#define XDLIST_LAST(LIST)						\
+	(XDLIST_ISEMPTY(LIST) ? NULL : (LIST)->head.prev)
+
+#define FOR_XDLIST(VAR, LIST)						\
+	for (VAR = (LIST)->head.next; VAR != &(LIST)->head; VAR = VAR->next)
+
+#define FOR_XDLIST_SAFE(VAR, TMP, LIST)					\
+	for (VAR = (LIST)->head.next, TMP = VAR->next;			\
+	     VAR != &(LIST)->head;					\
+	     VAR = TMP, TMP = VAR->next)
+
+static __inline void xdlist_init(xdlist_t *list)
+{
+	list->head.prev = list->head.next = &list->head;
+}
+
+/* a node not in any list points to itself, so removing it twice is harmless */
+static __inline void xdlist_node_init(xdlist_node_t *node)
+{
+	node->prev = node->next = node;
+}
+
+static __inline int xdlist_node_linked(const xdlist_node_t *node)
+{
+	return node->next != node;
+}
+
+static __inline void xdlist_insert_after(xdlist_node_t *pos, xdlist_node_t *node)
+{
+	node->prev = pos;
+	node->next = pos->next;
+	pos->next->prev = node;
+	pos->next = node;
+}
+
+static __inline void xdlist_insert_head(xdlist_t *list, xdlist_node_t *node)
+{
+	xdlist_insert_after(&list->head, node);
+}
+
+static __inline void xdlist_insert_tail(xdlist_t *list, xdlist_node_t *node)
+{
+	xdlist_insert_after(list->head.prev, node);
+}
+
+static __inline void xdlist_remove(xdlist_node_t *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	xdlist_node_init(node);
+}
+
+/* move every node of src at the tail of dst, src is left empty */
+static __inline void xdlist_splice(xdlist_t *dst, xdlist_t *src)
+{
+	xdlist_node_t *first, *last;
+
+	if (XDLIST_ISEMPTY(src))
+		return;
+
+	first = src->head.next;
+	last = src->head.prev;
+
+	first->prev = dst->head.prev;
+	dst->head.prev->next = first;
+	last->next = &dst->head;
+	dst->head.prev = last;
+
+	xdlist_init(src);
+}
+
+#endif /* __XDLIST_H__ */
@@ -10,21 +10,64 @@
  * Fowler / Noll / Vo Hash (FNV Hash)
  * http://www.isthe.com/chongo/tech/comp/fnv/
  *
+ * Table lookups use xhash_wyhash, a seeded hash of the wyhash family
+ * (https://github.com/wangyi-fudan/wyhash) reading 8 bytes at a time.
+ * Every table gets a random seed at init so that keys sent by peers
+ * cannot be chosen to collide. Two keys may still share a hashkey, so
+ * entries are matched on the hashkey, then the length and the bytes.
+ * FNV is kept for values that must stay the same across runs and hosts
+ * (on-disk formats, ETags...).
+ *
  *	API:
  *
  *	xhash_t * xhash_init(xhash_t *xhash)
  *	xhash_t * xhash_destroy(xhash_t *xhash)
  *	unsigned short xhash_add(xhash_t *xhash,const char *key,void *value)
+ *	unsigned short xhash_addn(xhash_t *xhash,const char *key,size_t keylen,void *value)
  *	unsigned short xhash_remove(xhash_t *xhash,char *key)
+ *	unsigned short xhash_removen(xhash_t *xhash,const char *key,size_t keylen)
  *	unsigned short xhash_exists(xhash_t *xhash,char *key)
+ *	unsigned short xhash_existsn(xhash_t *xhash,const char *key,size_t keylen)
  *	unsigned long  xhash_numkeys(xhash_t *xhash)
  *	void *  xhash_value(xhash_t *xhash,char *key)
+ *	void *  xhash_valuen(xhash_t *xhash,const char *key,size_t keylen)
  *	void ** xhash_values(xhash_t *xhash,void **values)
  *	char ** xhash_keys(xhash_t *xhash,char **keys)
+ *
+ *	Walking without allocation, prefer them to xhash_keys/xhash_values:
+ *
+ *	void xhash_iter_init(xhash_t *xhash,xhash_iter_t *iter)
+ *	unsigned short xhash_iter_next(xhash_iter_t *iter,char **key,void **value)
+ *	FOR_XHASH(ELEM, XHASH)
+ *	xhash_snap_t * xhash_snapshot(xhash_t *xhash)
+ *	void xhash_snapshot_release(xhash_snap_t *snap)
+ *	unsigned long xhash_snapshot_numkeys(xhash_snap_t *snap)
+ *	xhash_elem_t * xhash_snapshot_elem(xhash_snap_t *snap,unsigned long i)
+ *
+ *	unsigned short xhash_add_hashed(xhash_t *xhash,Fnv64_t hashkey,const char *key,size_t keylen,void *value)
+ *	unsigned short xhash_remove_hashed(xhash_t *xhash,Fnv64_t hashkey,const char *key,size_t keylen)
+ *	unsigned short xhash_replace_hashed(xhash_t *xhash,Fnv64_t hashkey,const char *key,size_t keylen,void *value)
+ *	xhash_elem_t * xhash_lookup_hashed(xhash_t *xhash,Fnv64_t hashkey,const char *key,size_t keylen)
+ *	Fnv64_t xhash_hashkey(xhash_t *xhash,const char *key,size_t keylen)
+ *
+ *	Fnv64_t fnv_64_str(const char *str,Fnv64_t hval)
+ *	Fnv64_t fnv_64_buf(const void *buf,size_t len,Fnv64_t hval)
+ *	u_int64_t xhash_wyhash(const void *key,size_t len,u_int64_t seed)
+ *	u_int64_t xhash_random_seed(void)
+ *
+ *	Elements come from malloc unless a pool is set on the empty table:
+ *
+ *	int xhash_set_pool(xhash_t *xhash,xpool_t *pool)
  */
 
 #include	<sys/types.h>
+#include	<sys/random.h>
 #include	<stdlib.h>
+#include	<string.h>
+#include	<time.h>
+#include	<unistd.h>
+
+#include	"xpool.h"
 
 #define FNV1_64_INIT ((Fnv64_t) 0xcbf29ce484222325ULL)
 #define FNV_64_PRIME ((Fnv64_t) 0x100000001b3ULL)
@@ -46,11 +89,12 @@ typedef u_int64_t Fnv64_t;
         TYPE *value;			  \
         struct NAME *next;		  \
     } NAME##_t;
-/*
+
 typedef struct _xhash_elem
 {
 	Fnv64_t	hashkey ;
 	char 	*key ;
+	size_t	keylen ;
 	void 	*value ;
 	struct 	_xhash_elem	*next ;
 } xhash_elem_t ;
@@ -60,8 +104,34 @@ typedef struct _xhash
 	xhash_elem_t *first; 
 	xhash_elem_t *last;
 	unsigned long	entries ;
+	u_int64_t	seed ;
+	unsigned long	gen ;		/* bumped by every add and remove */
+	struct _xhash_snap *snap ;	/* last snapshot taken, reused until gen changes */
+	unsigned long	pins ;		/* references held on snapshots */
+	xhash_elem_t	*retired ;	/* removed while pinned, freed on last unpin */
+	xpool_t	*pool ;		/* where elements come from, NULL for malloc */
 } xhash_t ;
-*/
+
+/* Cursor over a table, visiting entries in place. The next entry is
+ * fetched before the current one is returned, so removing the current
+ * entry does not break the walk. Any other change to the table does. */
+typedef struct _xhash_iter
+{
+	xhash_elem_t *next ;
+} xhash_iter_t ;
+
+/* Immutable view of a table. The array is built once per generation of
+ * the table and shared by every reader until the table changes. While a
+ * snapshot is held, removed entries are kept aside instead of being freed,
+ * so keys and values seen through it stay valid. */
+typedef struct _xhash_snap
+{
+	xhash_t	*xhash ;
+	unsigned long	gen ;
+	unsigned long	refs ;
+	unsigned long	entries ;
+	xhash_elem_t	**elems ;
+} xhash_snap_t ;
 
 static __inline Fnv64_t
 fnv_64_str(const char *str, Fnv64_t hval)
@@ -76,99 +146,298 @@ fnv_64_str(const char *str, Fnv64_t hval)
 	return hval;
 }
 
+static __inline Fnv64_t
+fnv_64_buf(const void *buf, size_t len, Fnv64_t hval)
+{
+	const u_int8_t *s = (const u_int8_t *)buf;
+	const u_int8_t *e = s + len;
+
+	while (s < e) {
+		hval *= FNV_64_PRIME;
+		hval ^= *s++;
+	}
+	return hval;
+}
+
+/* wyhash: secret from the reference implementation */
+static const u_int64_t _xhash_wysecret[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static __inline u_int64_t
+_xhash_wymix(u_int64_t a, u_int64_t b)
+{
+	__uint128_t r = a;
+
+	r *= b;
+	return((u_int64_t)r ^ (u_int64_t)(r >> 64));
+}
+
+/* unaligned loads, the compiler turns them into single moves */
+static __inline u_int64_t
+_xhash_wyr8(const u_int8_t *p)
+{
+	u_int64_t v;
+
+	memcpy(&v, p, 8);
+	return(v);
+}
+
+static __inline u_int64_t
+_xhash_wyr4(const u_int8_t *p)
+{
+	u_int32_t v;
+
+	memcpy(&v, p, 4);
+	return(v);
+}
+
+static __inline u_int64_t
+xhash_wyhash(const void *key, size_t len, u_int64_t seed)
+{
+	const u_int8_t *p = (const u_int8_t *)key;
+	const u_int64_t *s = _xhash_wysecret;
+	u_int64_t a, b, see1, see2;
+	size_t i;
+
+	seed ^= _xhash_wymix(seed ^ s[0], s[1]);
+
+	if (len <= 16)
+	{
+		if (len >= 4)
+		{
+			a = (_xhash_wyr4(p) << 32) | _xhash_wyr4(p + ((len >> 3) << 2));
+			b = (_xhash_wyr4(p + len - 4) << 32) | _xhash_wyr4(p + len - 4 - ((len >> 3) << 2));
+		}
+		else if (len > 0)
+		{
+			a = ((u_int64_t)p[0] << 16) | ((u_int64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else
+	{
+		i = len;
+		if (i > 48)
+		{
+			see1 = see2 = seed;
+			do {
+				seed = _xhash_wymix(_xhash_wyr8(p) ^ s[1], _xhash_wyr8(p + 8) ^ seed);
+				see1 = _xhash_wymix(_xhash_wyr8(p + 16) ^ s[2], _xhash_wyr8(p + 24) ^ see1);
+				see2 = _xhash_wymix(_xhash_wyr8(p + 32) ^ s[3], _xhash_wyr8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16)
+		{
+			seed = _xhash_wymix(_xhash_wyr8(p) ^ s[1], _xhash_wyr8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = _xhash_wyr8(p + i - 16);
+		b = _xhash_wyr8(p + i - 8);
+	}
+
+	a ^= s[1];
+	b ^= seed;
+	{
+		__uint128_t r = a;
+
+		r *= b;
+		a = (u_int64_t)r;
+		b = (u_int64_t)(r >> 64);
+	}
+	return(_xhash_wymix(a ^ s[0] ^ len, b ^ s[1]));
+}
+
+/* random bits for table seeds, never fails: without getrandom() we fall
+ * back on things an outsider cannot easily guess */
+static __inline u_int64_t
+xhash_random_seed(void)
+{
+	u_int64_t seed;
+	struct timespec ts;
+
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed))
+		return(seed);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	seed = ((u_int64_t)ts.tv_sec << 32) ^ (u_int64_t)ts.tv_nsec;
+	seed ^= ((u_int64_t)getpid() << 16) ^ (u_int64_t)(size_t)&seed;
+	return(_xhash_wymix(seed, _xhash_wysecret[2]));
+}
+
+static __inline Fnv64_t
+xhash_hashkey(xhash_t *xhash,const char *key,size_t keylen)
+{
+	return(xhash_wyhash(key, keylen, xhash->seed));
+}
+
 static __inline xhash_t *
 xhash_init(xhash_t *xhash)
 {
 	xhash = (xhash_t *)malloc(sizeof(xhash_t));
 	xhash->first = xhash->last = NULL ;
 	xhash->entries = 0 ;
+	xhash->seed = xhash_random_seed() ;
+	xhash->gen = 0 ;
+	xhash->snap = NULL ;
+	xhash->pins = 0 ;
+	xhash->retired = NULL ;
+	xhash->pool = NULL ;
 	return(xhash);
 }
 
+/* the pool may be shared by several tables, it is not destroyed with
+ * them. returns -1 if the table is not empty */
+static __inline int
+xhash_set_pool(xhash_t *xhash,xpool_t *pool)
+{
+	if (!xhash || xhash->first || xhash->retired)
+		return(-1);
+	xhash->pool = pool ;
+	return(0);
+}
+
+static __inline xhash_elem_t *
+xhash_elem_alloc(xhash_t *xhash)
+{
+	if (xhash->pool)
+		return(XPOOL_NEW(xhash->pool, xhash_elem_t));
+	return((xhash_elem_t *)malloc(sizeof(xhash_elem_t)));
+}
+
+static __inline void
+xhash_elem_free(xhash_t *xhash,xhash_elem_t *xhash_elem)
+{
+	free(xhash_elem->key); 
+	if (xhash_elem->value)
+		free(xhash_elem->value); 
+	xhash_elem->key = NULL ;
+	xhash_elem->value = NULL ;
+	if (xhash->pool)
+		xpool_free(xhash->pool, xhash_elem);
+	else
+		free(xhash_elem);
+}
+
+/* the element is already unlinked from the table */
+static __inline void
+xhash_elem_release(xhash_t *xhash,xhash_elem_t *xhash_elem)
+{
+	if (xhash->pins)
+	{
+		xhash_elem->next = xhash->retired ;
+		xhash->retired = xhash_elem ;
+	}
+	else
+		xhash_elem_free(xhash, xhash_elem);
+}
+
+/* the hashkey first, it settles almost every mismatch */
+static __inline int
+xhash_elem_match(const xhash_elem_t *xhash_elem,Fnv64_t hashkey,const char *key,size_t keylen)
+{
+	return(xhash_elem->hashkey == hashkey && xhash_elem->keylen == keylen &&
+	    memcmp(xhash_elem->key, key, keylen) == 0);
+}
+
 /* return 1 if entry have benn inserted 
- * else returns 0 for allready existing values*/
+ * else returns 0 for allready existing values.
+ * The _hashed variants take a hashkey computed by the caller, so that
+ * a container built on top of xhash hashes a key only once */
 static __inline unsigned short
-xhash_add(xhash_t *xhash,const char *key,void *value)
+xhash_add_hashed(xhash_t *xhash,Fnv64_t hashkey,const char *key,size_t keylen,void *value)
 {
-	Fnv64_t	hashkey ;
 	xhash_elem_t *xhash_elem ;
 
 	if (!xhash || !key)
 		return(0);
 
-	hashkey = fnv_64_str(key, FNV1_64_INIT) ; 
-
 	if (!xhash->first)
 	{
-		xhash_elem = (xhash_elem_t *)malloc(sizeof(xhash_elem_t));
+		xhash_elem = xhash_elem_alloc(xhash);
 		xhash_elem->hashkey = hashkey ;
 		xhash_elem->key = (char *)key ;
+		xhash_elem->keylen = keylen ;
 		xhash_elem->value = value ;
 		xhash_elem->next = NULL ;
 		xhash->last = xhash->first = xhash_elem ;
 		xhash->entries++;
+		xhash->gen++;
 	}
 	else
 	{
 		/* first find if the entry already exists */
 		for (xhash_elem = xhash->first; xhash_elem != NULL; xhash_elem = xhash_elem->next)
-			if (xhash_elem->hashkey == hashkey)
+			if (xhash_elem_match(xhash_elem, hashkey, key, keylen))
 				return(0); /* entry already exists */
 
 		if (!xhash_elem)
 		{
-			xhash_elem = (xhash_elem_t *)malloc(sizeof(xhash_elem_t));
+			xhash_elem = xhash_elem_alloc(xhash);
 			xhash_elem->hashkey = hashkey ;
 			xhash_elem->key = (char *)key ;
+			xhash_elem->keylen = keylen ;
 			xhash_elem->value = value ;
 			xhash_elem->next = NULL ;
 			xhash->last->next = xhash_elem; /* previous last xhash_elem->next points to new xhash_elem */
 			xhash->last = xhash_elem ; /* insert to list */
 			xhash->entries++;
+			xhash->gen++;
 		}
 	} 
 	return(1); /* huh ?  */
 }
 
+/* key does not need to be NUL terminated, but is freed with the entry */
+static __inline unsigned short
+xhash_addn(xhash_t *xhash,const char *key,size_t keylen,void *value)
+{
+	if (!xhash || !key)
+		return(0);
+
+	return(xhash_add_hashed(xhash, xhash_hashkey(xhash, key, keylen), key, keylen, value));
+}
+
+static __inline unsigned short
+xhash_add(xhash_t *xhash,const char *key,void *value)
+{
+	if (!key)
+		return(0);
+
+	return(xhash_addn(xhash, key, strlen(key), value));
+}
+
 /* returns 1 if entry is deleted */
 static __inline unsigned short
-xhash_remove(xhash_t *xhash,char *key)
+xhash_remove_hashed(xhash_t *xhash,Fnv64_t hashkey,const char *key,size_t keylen)
 {
-	Fnv64_t	hashkey ;
 	xhash_elem_t *xhash_elem ;
 	
-	if (!key || !xhash || !(xhash->first))
+	if (!xhash || !(xhash->first) || !key)
 		return(0);
 
-	hashkey = fnv_64_str(key,FNV1_64_INIT);
-
 	for (xhash_elem = xhash->first; xhash_elem != NULL; xhash_elem = xhash_elem->next)
 	{
-		if (xhash_elem->hashkey == hashkey)
+		if (xhash_elem_match(xhash_elem, hashkey, key, keylen))
 		{
 			/* if there's only one entry */
 			if (xhash_elem == xhash->first && xhash_elem == xhash->last)
 			{
 				xhash->first = xhash->last = NULL ;
 
-				/* free elem */
-				free(xhash_elem->key); 
-				if (xhash_elem->value)
-					free(xhash_elem->value); 
-				xhash_elem->key = NULL ;
-				xhash_elem->value = NULL ;
-				free(xhash_elem);
+				xhash_elem_release(xhash, xhash_elem);
 			}
 			else if (xhash_elem == xhash->first)
 			{
 				xhash->first = xhash_elem->next ;
-				/* free elem */
-				free(xhash_elem->key); 
-				if (xhash_elem->value)
-					free(xhash_elem->value); 
-				xhash_elem->key = NULL ;
-				xhash_elem->value = NULL ;
-				free(xhash_elem);
+				xhash_elem_release(xhash, xhash_elem);
 			}
 			else if (xhash_elem == xhash->last) /* sucks ! boubler la liste */
 			{
@@ -180,13 +449,7 @@ xhash_remove(xhash_t *xhash,char *key)
 	    		tmp->next = NULL;
 	    		xhash->last = tmp;
 				
-				/* free elem */
-				free(xhash_elem->key); 
-				if (xhash_elem->value)
-					free(xhash_elem->value); 
-				xhash_elem->key = NULL ;
-				xhash_elem->value = NULL ;
-				free(xhash_elem);
+				xhash_elem_release(xhash, xhash_elem);
 			}
 			else
 			{
@@ -197,21 +460,92 @@ xhash_remove(xhash_t *xhash,char *key)
 
 	    		tmp->next = xhash_elem->next;
 				
-				/* free elem */
-				free(xhash_elem->key); 
-				if (xhash_elem->value)
-					free(xhash_elem->value); 
-				xhash_elem->key = NULL ;
-				xhash_elem->value = NULL ;
-				free(xhash_elem);
+				xhash_elem_release(xhash, xhash_elem);
 			}
 			xhash->entries--;
+			xhash->gen++;
 			return(1);
 		}
 	}
 	return(0);
 }
 
+/* give an entry a new value. While a snapshot is held the entry is
+ * copied and the old one retired with its value, that the snapshot
+ * still sees, else the old value is freed. returns 1 if found */
+static __inline unsigned short
+xhash_replace_hashed(xhash_t *xhash,Fnv64_t hashkey,const char *key,size_t keylen,void *value)
+{
+	xhash_elem_t *xhash_elem, *prev, *copy ;
+
+	if (!xhash || !key)
+		return(0);
+
+	prev = NULL ;
+	for (xhash_elem = xhash->first; xhash_elem != NULL; xhash_elem = xhash_elem->next)
+	{
+		if (xhash_elem_match(xhash_elem, hashkey, key, keylen))
+			break;
+		prev = xhash_elem ;
+	}
+	if (!xhash_elem)
+		return(0);
+
+	/* same value: nothing to copy nor to free, retiring the entry
+	 * would free what the live one points to */
+	if (xhash_elem->value == value)
+	{
+		xhash->gen++;
+		return(1);
+	}
+
+	if (!xhash->pins)
+	{
+		if (xhash_elem->value)
+			free(xhash_elem->value);
+		xhash_elem->value = value ;
+		xhash->gen++;
+		return(1);
+	}
+
+	copy = xhash_elem_alloc(xhash);
+	copy->hashkey = hashkey ;
+	copy->key = (char *)malloc(xhash_elem->keylen + 1);
+	memcpy(copy->key, xhash_elem->key, xhash_elem->keylen);
+	copy->key[xhash_elem->keylen] = '\0' ;
+	copy->keylen = xhash_elem->keylen ;
+	copy->value = value ;
+	copy->next = xhash_elem->next ;
+	if (prev)
+		prev->next = copy ;
+	else
+		xhash->first = copy ;
+	if (xhash->last == xhash_elem)
+		xhash->last = copy ;
+	xhash_elem_release(xhash, xhash_elem);
+	xhash->gen++;
+	return(1);
+}
+
+/* key does not need to be NUL terminated */
+static __inline unsigned short
+xhash_removen(xhash_t *xhash,const char *key,size_t keylen)
+{
+	if (!xhash || !key)
+		return(0);
+
+	return(xhash_remove_hashed(xhash, xhash_hashkey(xhash, key, keylen), key, keylen));
+}
+
+static __inline unsigned short
+xhash_remove(xhash_t *xhash,char *key)
+{
+	if (!key)
+		return(0);
+
+	return(xhash_removen(xhash, key, strlen(key)));
+}
+
 static __inline xhash_t *
 xhash_destroy(xhash_t *xhash)
 {
@@ -224,54 +558,82 @@ xhash_destroy(xhash_t *xhash)
 	{
 		tmp2 = tmp1->next ;
 
-		/* free elem */
-		if (tmp1->key != NULL) free(tmp1->key); 
-		if (tmp1->value != NULL) free(tmp1->value); 
-		tmp1->key = NULL ;
-		tmp1->value = NULL ;
-		free(tmp1);
+		xhash_elem_free(xhash, tmp1);
 
 		tmp1 = tmp2;
 	}
+	/* snapshots still held are dangling from now on */
+	for (tmp1 = xhash->retired; tmp1 != NULL; tmp1 = tmp2)
+	{
+		tmp2 = tmp1->next ;
+		xhash_elem_free(xhash, tmp1);
+	}
+	if (xhash->snap)
+	{
+		free(xhash->snap->elems);
+		free(xhash->snap);
+	}
 	free(xhash);
 	xhash = NULL ;
 	return(xhash);
 }
 
-static __inline unsigned short
-xhash_exists(xhash_t *xhash,char *key)
+static __inline xhash_elem_t *
+xhash_lookup_hashed(xhash_t *xhash,Fnv64_t hashkey,const char *key,size_t keylen)
 {
-	Fnv64_t	hashkey ;
 	xhash_elem_t *xhash_elem ;
 	
-	if (!key || !xhash || !xhash->first)
+	if (!xhash || !xhash->first || !key)
+		return(NULL);
+
+	for (xhash_elem = xhash->first; xhash_elem != NULL; xhash_elem = xhash_elem->next)
+		if (xhash_elem_match(xhash_elem, hashkey, key, keylen))
+			return(xhash_elem);
+
+	return(NULL);
+}
+
+/* key does not need to be NUL terminated */
+static __inline unsigned short
+xhash_existsn(xhash_t *xhash,const char *key,size_t keylen)
+{
+	if (!xhash || !key)
 		return(0);
 
-	hashkey = fnv_64_str(key,FNV1_64_INIT);
+	return(xhash_lookup_hashed(xhash, xhash_hashkey(xhash, key, keylen), key, keylen) != NULL);
+}
 
-	for (xhash_elem = xhash->first; xhash_elem != NULL; xhash_elem = xhash_elem->next)
-		if (xhash_elem->hashkey == hashkey)
-			return(1);
+static __inline unsigned short
+xhash_exists(xhash_t *xhash,char *key)
+{
+	if (!key)
+		return(0);
 
-	return(0);
+	return(xhash_existsn(xhash, key, strlen(key)));
 }
 
+/* key does not need to be NUL terminated */
 static __inline void *
-xhash_value(xhash_t *xhash,char *key)
+xhash_valuen(xhash_t *xhash,const char *key,size_t keylen)
 {
-	Fnv64_t	hashkey ;
 	xhash_elem_t *xhash_elem ;
 	
-	if (!key || !xhash || !xhash->first)
+	if (!xhash || !key)
 		return(NULL);
 
-	hashkey = fnv_64_str(key,FNV1_64_INIT);
+	if ((xhash_elem = xhash_lookup_hashed(xhash, xhash_hashkey(xhash, key, keylen), key, keylen)) == NULL)
+		return(NULL);
 
-	for (xhash_elem = xhash->first; xhash_elem != NULL; xhash_elem = xhash_elem->next)
-		if (xhash_elem->hashkey == hashkey)
-			return(xhash_elem->value);
+	return(xhash_elem->value);
+}
 
-	return(NULL);
+static __inline void *
+xhash_value(xhash_t *xhash,char *key)
+{
+	if (!key)
+		return(NULL);
+
+	return(xhash_valuen(xhash, key, strlen(key)));
 }
 
 static __inline void **
@@ -310,4 +672,128 @@ xhash_numkeys(xhash_t *xhash)
 	return(xhash->entries);
 }
 
+static __inline void
+xhash_iter_init(xhash_t *xhash,xhash_iter_t *iter)
+{
+	iter->next = xhash ? xhash->first : NULL ;
+}
+
+/* returns 0 when the walk is over, key and value may be NULL */
+static __inline unsigned short
+xhash_iter_next(xhash_iter_t *iter,char **key,void **value)
+{
+	xhash_elem_t *xhash_elem ;
+
+	if ((xhash_elem = iter->next) == NULL)
+		return(0);
+
+	iter->next = xhash_elem->next ;
+	if (key)
+		*key = xhash_elem->key ;
+	if (value)
+		*value = xhash_elem->value ;
+	return(1);
+}
+
+/* same as FOR_XLIST, the body must not remove ELEM */
+#define FOR_XHASH(ELEM, XHASH)	\
+	for (ELEM = (XHASH)->first; ELEM != NULL; ELEM = ELEM->next)
+
+static __inline void
+xhash_snap_free(xhash_snap_t *snap)
+{
+	free(snap->elems);
+	free(snap);
+}
+
+/* returns NULL only when out of memory. Every snapshot must be given back
+ * with xhash_snapshot_release(). Not thread safe by itself: taking and
+ * releasing must be serialized with changes to the table, reading the
+ * snapshot needs no lock */
+static __inline xhash_snap_t *
+xhash_snapshot(xhash_t *xhash)
+{
+	xhash_snap_t *snap ;
+	xhash_elem_t *xhash_elem ;
+	unsigned long i ;
+
+	if (!xhash)
+		return(NULL);
+
+	if ((snap = xhash->snap) != NULL && snap->gen == xhash->gen)
+	{
+		snap->refs++;
+		xhash->pins++;
+		return(snap);
+	}
+
+	/* the cached one is outdated, drop it unless readers still use it */
+	if (snap != NULL && snap->refs == 0)
+		xhash_snap_free(snap);
+	xhash->snap = NULL ;
+
+	if ((snap = (xhash_snap_t *)malloc(sizeof(xhash_snap_t))) == NULL)
+		return(NULL);
+	snap->elems = NULL ;
+	if (xhash->entries &&
+	    (snap->elems = (xhash_elem_t **)malloc(sizeof(xhash_elem_t *) * xhash->entries)) == NULL)
+	{
+		free(snap);
+		return(NULL);
+	}
+
+	i = 0 ;
+	FOR_XHASH(xhash_elem, xhash)
+		snap->elems[i++] = xhash_elem ;
+
+	snap->xhash = xhash ;
+	snap->gen = xhash->gen ;
+	snap->entries = i ;
+	snap->refs = 1 ;
+	xhash->snap = snap ;
+	xhash->pins++;
+	return(snap);
+}
+
+static __inline void
+xhash_snapshot_release(xhash_snap_t *snap)
+{
+	xhash_t *xhash ;
+	xhash_elem_t *tmp1, *tmp2 ;
+
+	if (!snap)
+		return ;
+
+	xhash = snap->xhash ;
+	snap->refs--;
+	xhash->pins--;
+
+	/* outdated and unused: nobody can get it anymore */
+	if (snap->refs == 0 && snap != xhash->snap)
+		xhash_snap_free(snap);
+
+	if (xhash->pins == 0)
+	{
+		for (tmp1 = xhash->retired; tmp1 != NULL; tmp1 = tmp2)
+		{
+			tmp2 = tmp1->next ;
+			xhash_elem_free(xhash, tmp1);
+		}
+		xhash->retired = NULL ;
+	}
+}
+
+static __inline unsigned long
+xhash_snapshot_numkeys(xhash_snap_t *snap)
+{
+	return(snap->entries);
+}
+
+/* returns the i-th entry of the snapshot, NULL past the end */
+static __inline xhash_elem_t *
+xhash_snapshot_elem(xhash_snap_t *snap,unsigned long i)
+{
+	return(i < snap->entries ? snap->elems[i] : NULL);
+}
+
 #endif /* __X_HASH__ */
@@ -38,6 +38,8 @@
  *	- INSERT_XLIST insert new elmt in XLIST
  *	- REMOVE_XLIST remove an elmt in XLIST
  *	- FIND_BY_FIELD_XLIST search a elmt on XLIST
+ *	- NEW_XLIST_ITEM_POOL / FREE_XLIST_POOL same with items taken from
+ *	  a xpool_t (xpool.h) instead of malloc
  */
 
 #define DEF_XLIST(NAME, TYPE)		\
@@ -51,8 +53,9 @@
 	LIST->first = LIST->last = NULL;	\
 }
 
+/* VAR may be set to NULL in the body, by REMOVE_XLIST, to stop */
 #define FOR_XLIST(VAR, LIST)					\
-	for (VAR = LIST->first; VAR != NULL; VAR = VAR->next)
+	for (VAR = LIST->first; VAR != NULL; VAR = (VAR != NULL) ? VAR->next : NULL)
 
 #define FREE_XLIST(LIST, TYPE, FREE)	\
 if (LIST != NULL)			\
@@ -69,6 +72,26 @@ if (LIST != NULL)			\
 	LIST = NULL ; \
 } 
 
+#define NEW_XLIST_ITEM_POOL(VAR, TYPE, POOL)	\
+	VAR = XPOOL_NEW(POOL, TYPE)
+
+/* when the pool is private to the list, xpool_destroy() releases all the
+ * items at once and the walk can be skipped */
+#define FREE_XLIST_POOL(LIST, TYPE, POOL)	\
+if (LIST != NULL)			\
+{					\
+	TYPE	*tmp1, *tmp2;		\
+	tmp1 = LIST->first;		\
+	while (tmp1)			\
+	{				\
+	  tmp2 = tmp1->next;		\
+	  xpool_free(POOL, tmp1);	\
+	  tmp1 = tmp2;			\
+	}				\
+	free(LIST);			\
+	LIST = NULL ; \
+} 
+
 #define XLIST_ISEMPTY(LIST)	(LIST->first == NULL)
 
 #define INSERT_XLIST(LIST, NEW_ITEM)	\
@@ -82,8 +105,15 @@ if (NEW_ITEM != NULL)			\
 	LIST->last = NEW_ITEM;		\
 }
 
+/*
+ * REMOVE_XLIST walks the list to find the predecessor of LIST_ITEM, use
+ * xdlist.h for lists where elements are removed often. The body is a
+ * do/while so that the early exits are real breaks. LIST_ITEM is left on
+ * the element before the removed one, or the new first, or NULL when the
+ * list is now empty, so that a FOR_XLIST walk can go on.
+ */
 #define REMOVE_XLIST(LIST, LIST_ITEM, TYPE, FREE_ITEM)			\
-{									\
+do {									\
 	TYPE	*tmp;							\
 									\
 	if (LIST_ITEM == NULL || LIST == NULL)				\
@@ -93,6 +123,7 @@ if (NEW_ITEM != NULL)			\
 	    FREE_ITEM(LIST_ITEM);					\
 	    LIST->first = NULL;						\
 	    LIST->last = NULL;						\
+	    LIST_ITEM = NULL;						\
 	    break;							\
 	}								\
 	else if (LIST_ITEM == LIST->first)				\
@@ -120,7 +151,7 @@ if (NEW_ITEM != NULL)			\
 	     FREE_ITEM(LIST_ITEM);					\
 	     LIST_ITEM = tmp;						\
 	  }								\
-}
+} while (0)
 
 
 #define FIND_BY_ID_XLIST(VAR, LIST, TYPE, ID, VALUE)	\
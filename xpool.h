@@ -0,0 +1,286 @@
+#ifndef __X_POOL__
+#define __X_POOL__
+
+/*
+ * Slab pool for fixed size objects (list and hash nodes).
+ *
+ * Objects are carved out of 64KB slabs, so nodes of one container sit
+ * next to each other in memory and malloc is called once per slab.
+ * Each thread keeps a small free list of its own (found through a
+ * pthread key) and only takes the pool mutex to move a batch of objects
+ * between its cache and the shared free list. Nothing is given back to
+ * the system before xpool_destroy, which releases all the slabs at once:
+ * objects still in use are freed with them.
+ *
+ * Objects are not zeroed.
+ *
+ * This file is placed in the public domain .
+ *
+ *	API:
+ *
+ *	xpool_t * xpool_create(size_t size)
+ *	void xpool_destroy(xpool_t *pool)
+ *	void * xpool_alloc(xpool_t *pool)
+ *	void xpool_free(xpool_t *pool,void *obj)
+ *	XPOOL_NEW(POOL, TYPE)
+ */
+
+#include	<pthread.h>
+#include	<stdlib.h>
+
+#define XPOOL_SLAB_SIZE		(64 * 1024)
+#define XPOOL_ALIGN		16
+#define XPOOL_BATCH		64	/* objects moved at once between a cache and the pool */
+
+typedef struct _xpool_obj
+{
+	struct _xpool_obj *next ;
+} xpool_obj_t ;
+
+typedef struct _xpool_slab
+{
+	struct _xpool_slab *next ;
+} xpool_slab_t ;
+
+typedef struct _xpool_cache
+{
+	struct _xpool *pool ;
+	xpool_obj_t	*free ;
+	unsigned int	count ;
+	struct _xpool_cache *prev, *next ;	/* caches of all threads, for destroy */
+} xpool_cache_t ;
+
+typedef struct _xpool
+{
+	size_t	size ;		/* object size, rounded to XPOOL_ALIGN */
+	size_t	per_slab ;
+	size_t	offset ;	/* of the first object in a slab */
+	pthread_mutex_t	mutex ;
+	pthread_key_t	key ;
+	xpool_slab_t	*slabs ;
+	xpool_obj_t	*free ;
+	unsigned long	nslabs ;
+	xpool_cache_t	*caches ;
+} xpool_t ;
+
+#define XPOOL_NEW(POOL, TYPE)	((TYPE *)xpool_alloc(POOL))
+
+/* chain first..last on the shared free list, pool locked */
+static __inline void
+_xpool_give(xpool_t *pool,xpool_obj_t *first,xpool_obj_t *last)
+{
+	last->next = pool->free ;
+	pool->free = first ;
+}
+
+/* thread exit: the objects cached by the thread go back to the pool */
+static __inline void
+_xpool_cache_release(void *arg)
+{
+	xpool_cache_t *cache = (xpool_cache_t *)arg ;
+	xpool_t *pool = cache->pool ;
+	xpool_obj_t *last ;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (cache->free)
+	{
+		for (last = cache->free; last->next != NULL; last = last->next)
+			;
+		_xpool_give(pool, cache->free, last);
+	}
+	if (cache->prev)
+		cache->prev->next = cache->next ;
+	else
+		pool->caches = cache->next ;
+	if (cache->next)
+		cache->next->prev = cache->prev ;
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(cache);
+}
+
+static __inline xpool_t *
+xpool_create(size_t size)
+{
+	xpool_t *pool ;
+
+	if (size == 0 || size > XPOOL_SLAB_SIZE / 4)
+		return(NULL);
+
+	if ((pool = (xpool_t *)malloc(sizeof(xpool_t))) == NULL)
+		return(NULL);
+
+	if (size < sizeof(xpool_obj_t))
+		size = sizeof(xpool_obj_t) ;
+	pool->size = (size + XPOOL_ALIGN - 1) & ~((size_t)XPOOL_ALIGN - 1) ;
+	pool->offset = (sizeof(xpool_slab_t) + XPOOL_ALIGN - 1) & ~((size_t)XPOOL_ALIGN - 1) ;
+	pool->per_slab = (XPOOL_SLAB_SIZE - pool->offset) / pool->size ;
+	pool->slabs = NULL ;
+	pool->free = NULL ;
+	pool->nslabs = 0 ;
+	pool->caches = NULL ;
+
+	if (pthread_key_create(&pool->key, _xpool_cache_release) != 0)
+	{
+		free(pool);
+		return(NULL);
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	return(pool);
+}
+
+/* every thread must be done with the pool */
+static __inline void
+xpool_destroy(xpool_t *pool)
+{
+	xpool_slab_t *slab, *next ;
+	xpool_cache_t *cache, *cnext ;
+
+	if (!pool)
+		return ;
+
+	/* no destructor runs once the key is deleted */
+	pthread_key_delete(pool->key);
+	for (cache = pool->caches; cache != NULL; cache = cnext)
+	{
+		cnext = cache->next ;
+		free(cache);
+	}
+	for (slab = pool->slabs; slab != NULL; slab = next)
+	{
+		next = slab->next ;
+		free(slab);
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+static __inline xpool_cache_t *
+_xpool_cache(xpool_t *pool)
+{
+	xpool_cache_t *cache ;
+
+	if ((cache = (xpool_cache_t *)pthread_getspecific(pool->key)) != NULL)
+		return(cache);
+
+	if ((cache = (xpool_cache_t *)malloc(sizeof(xpool_cache_t))) == NULL)
+		return(NULL);
+	cache->pool = pool ;
+	cache->free = NULL ;
+	cache->count = 0 ;
+	cache->prev = NULL ;
+
+	pthread_mutex_lock(&pool->mutex);
+	cache->next = pool->caches ;
+	if (pool->caches)
+		pool->caches->prev = cache ;
+	pool->caches = cache ;
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_setspecific(pool->key, cache);
+	return(cache);
+}
+
+/* fill an empty cache with a batch, pool locked */
+static __inline int
+_xpool_refill(xpool_t *pool,xpool_cache_t *cache)
+{
+	xpool_slab_t *slab ;
+	xpool_obj_t *obj ;
+	char *p ;
+	size_t i ;
+
+	if (pool->free == NULL)
+	{
+		if (posix_memalign((void **)&slab, 64, XPOOL_SLAB_SIZE) != 0)
+			return(-1);
+		slab->next = pool->slabs ;
+		pool->slabs = slab ;
+		pool->nslabs++;
+
+		/* thread the new objects in address order */
+		p = (char *)slab + pool->offset ;
+		for (i = 0; i < pool->per_slab; i++)
+		{
+			obj = (xpool_obj_t *)(p + i * pool->size) ;
+			obj->next = (i + 1 < pool->per_slab) ? (xpool_obj_t *)(p + (i + 1) * pool->size) : pool->free ;
+		}
+		pool->free = (xpool_obj_t *)p ;
+	}
+
+	for (i = 0; i < XPOOL_BATCH && pool->free != NULL; i++)
+	{
+		obj = pool->free ;
+		pool->free = obj->next ;
+		obj->next = cache->free ;
+		cache->free = obj ;
+		cache->count++;
+	}
+	return(0);
+}
+
+/* returns NULL when out of memory */
+static __inline void *
+xpool_alloc(xpool_t *pool)
+{
+	xpool_cache_t *cache ;
+	xpool_obj_t *obj ;
+	int r ;
+
+	if ((cache = _xpool_cache(pool)) == NULL)
+		return(NULL);
+
+	if (cache->free == NULL)
+	{
+		pthread_mutex_lock(&pool->mutex);
+		r = _xpool_refill(pool, cache);
+		pthread_mutex_unlock(&pool->mutex);
+		if (r < 0)
+			return(NULL);
+	}
+
+	obj = cache->free ;
+	cache->free = obj->next ;
+	cache->count--;
+	return((void *)obj);
+}
+
+static __inline void
+xpool_free(xpool_t *pool,void *ptr)
+{
+	xpool_cache_t *cache ;
+	xpool_obj_t *obj = (xpool_obj_t *)ptr, *first, *last ;
+	unsigned int i ;
+
+	if (!ptr)
+		return ;
+
+	if ((cache = _xpool_cache(pool)) == NULL)
+	{
+		/* no cache for this thread, straight to the pool */
+		pthread_mutex_lock(&pool->mutex);
+		_xpool_give(pool, obj, obj);
+		pthread_mutex_unlock(&pool->mutex);
+		return ;
+	}
+
+	obj->next = cache->free ;
+	cache->free = obj ;
+	cache->count++;
+
+	/* a thread freeing what others allocate must not hoard everything */
+	if (cache->count >= 2 * XPOOL_BATCH)
+	{
+		first = last = cache->free ;
+		for (i = 1; i < XPOOL_BATCH; i++)
+			last = last->next ;
+		cache->free = last->next ;
+		cache->count -= XPOOL_BATCH ;
+
+		pthread_mutex_lock(&pool->mutex);
+		_xpool_give(pool, first, last);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+#endif /* __X_POOL__ */